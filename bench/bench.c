@@ -0,0 +1,223 @@
+// Runs the benchmark workloads and writes the results as JSON to the standard output.
+//
+// Usage: bench/bench [-t seconds] [name ...]
+//
+// Each workload runs in a process of its own, in a fresh interpreter. After its setup has been
+// evaluated and the workload has run once to warm up, it is repeated for at least the given time
+// (0.5 seconds by default). For each workload the result has the number of operations timed, the
+// time and the number of allocated objects per operation, and the peak resident set size of the
+// process in kilobytes. With names, only the workloads of those names are run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+typedef struct
+{
+    const char *name;
+    // The definitions, evaluated once
+    const char *setup;
+    // One operation. If NULL, the source is made by make_source(distinct).
+    const char *op;
+    int distinct;
+} Workload;
+
+static const Workload workloads[] = {
+    {"fib",
+     "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+     "(fib 20)"},
+    {"tak",
+     "(define tak (lambda (x y z) (if (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z)))",
+     "(tak 18 12 6)"},
+    // There are no car and cdr, so a list is built as nested two-element lists and reversing is
+    // done on a vector.
+    {"list-build",
+     "(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (list n acc)))))",
+     "(build 10000 ())"},
+    {"vector-reverse",
+     "(define v (make-vector 10000 0))"
+     "(define swap (lambda (v i j x) (vector-set! v i (vector-ref v j)) (vector-set! v j x)))"
+     "(define reverse! (lambda (v i j) (if (>= i j) v (swap v i j (vector-ref v i)) (reverse! v (+ i 1) (- j 1)))))",
+     "(reverse! v 0 9999)"},
+    // A loop on fixnums, which runs in native code once it's hot.
+    {"sum-loop",
+     "(define sum (lambda (i n acc) (if (= i n) acc (sum (+ i 1) n (+ acc (* i i))))))",
+     "(sum 0 100000 0)"},
+    // Each variable is looked up through the frames of the enclosing lambdas.
+    {"closures",
+     "(define deep (lambda (a) ((lambda (b) ((lambda (c) ((lambda (d) ((lambda (e) (+ a b c d e))"
+     "  (+ d 1))) (+ c 1))) (+ b 1))) (+ a 1))))"
+     "(define deep-loop (lambda (n acc) (if (= n 0) acc (deep-loop (- n 1) (+ acc (deep n))))))",
+     "(deep-loop 1000 0)"},
+    // The output goes to /dev/null.
+    {"print",
+     "(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (list n acc)))))"
+     "(define big (build 10000 ()))"
+     "(define wide (make-vector 10000 'symbol))",
+     "(println big) (println wide)"},
+    // Reading 100000 symbol tokens cycling through the given number of names.
+    {"parse-10", "", NULL, 10},
+    {"parse-1000", "", NULL, 1000},
+    {"parse-100000", "", NULL, 100000},
+};
+
+#define PARSE_TOKENS 100000
+
+// Returns (quote (s0 s1 ...)) forms of 1000 symbols each, PARSE_TOKENS symbols in all.
+static char *make_source(int distinct)
+{
+    size_t cap = PARSE_TOKENS * 9 + 1024, len = 0;
+    char *buf = malloc(cap);
+    if (!buf)
+        return NULL;
+    for (int i = 0; i < PARSE_TOKENS; i += 1000)
+    {
+        len += sprintf(buf + len, "(quote (");
+        for (int j = i; j < i + 1000; j++)
+            len += sprintf(buf + len, " s%d", j % distinct);
+        len += sprintf(buf + len, "))\n");
+    }
+    return buf;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int fail(Lispy *L, const Workload *w)
+{
+    fprintf(stderr, "%s: %s\n", w->name, lispy_error(L));
+    return 1;
+}
+
+// Runs the workload and writes its result to out. Called in a child process.
+static int run(const Workload *w, double min_time, FILE *out)
+{
+    char *source = w->op ? NULL : make_source(w->distinct);
+    const char *op = w->op ? w->op : source;
+    if (!op)
+    {
+        fprintf(stderr, "%s: out of memory\n", w->name);
+        return 1;
+    }
+    Lispy *L = lispy_new(NULL);
+    if (!L)
+    {
+        fprintf(stderr, "%s: cannot create an interpreter\n", w->name);
+        return 1;
+    }
+    if (lispy_eval_string(L, w->setup) < 0 || lispy_eval_string(L, op) < 0)
+        return fail(L, w);
+
+    long n = 0;
+    unsigned long long allocs = lispy_allocations(L);
+    double start = now(), elapsed;
+    do
+    {
+        if (lispy_eval_string(L, op) < 0)
+            return fail(L, w);
+        n++;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+    allocs = lispy_allocations(L) - allocs;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out,
+            "    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.1f, "
+            "\"peak_rss_kb\": %ld}",
+            w->name, n, elapsed * 1e9 / n, (double)allocs / n, usage.ru_maxrss);
+    fclose(out);
+    lispy_free(L);
+    free(source);
+    return 0;
+}
+
+static int selected(const char *name, int argc, char **argv)
+{
+    if (argc == 0)
+        return 1;
+    for (int i = 0; i < argc; i++)
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double min_time = 0.5;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        if (opt != 't')
+        {
+            fprintf(stderr, "Usage: %s [-t seconds] [name ...]\n", argv[0]);
+            return 2;
+        }
+        min_time = atof(optarg);
+    }
+    argc -= optind;
+    argv += optind;
+
+    int status = 0;
+    const char *sep = "";
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const Workload *w = &workloads[i];
+        if (!selected(w->name, argc, argv))
+            continue;
+        fflush(stdout);
+
+        // The child writes its result to a pipe, so that a failed workload leaves no partial entry.
+        int fds[2];
+        if (pipe(fds) < 0)
+        {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            _exit(run(w, min_time, fdopen(fds[1], "w")));
+        }
+        close(fds[1]);
+        char result[512];
+        size_t len = 0;
+        ssize_t k;
+        while ((k = read(fds[0], result + len, sizeof(result) - 1 - len)) > 0)
+            len += k;
+        result[len] = '\0';
+        close(fds[0]);
+        int wstatus;
+        waitpid(pid, &wstatus, 0);
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0 || len == 0)
+        {
+            fprintf(stderr, "%s failed\n", w->name);
+            status = 1;
+            continue;
+        }
+        printf("%s%s", sep, result);
+        sep = ",\n";
+    }
+    printf("\n  ]\n}\n");
+    return status;
+}
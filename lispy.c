@@ -1,12 +1,29 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "lispy.h"
 
 // The Lisp object type
 enum
@@ -17,8 +34,26 @@ enum
     SYMBOL,
     PRIMITIVE,
     FUNCTION,
+    MACRO,
+    CONDITION,
+    VECTOR,
+    STRING,
+    INTVECTOR,
+    BIGNUM,
     KEYWORD,
     ENV,
+
+    // Objects created by the resolver and the compiler
+    LVAR,
+    CODE,
+
+    // The number of the types above, for the allocation counters
+    NTYPES,
+
+    // The marker that indicates the object has been moved to other location by GC. The new location
+    // can be found at the forwarding pointer. Only the functions to do garbage collection set and
+    // handle the object of this type. Other functions will never see the object of this type.
+    MOVED = 100,
 };
 
 // Subtypes for KEYWORD
@@ -35,636 +70,8236 @@ struct Object;
 // Typedef for the primitive function.
 typedef struct Object *Primitive(struct Object *env, struct Object *args);
 
+// Typedef for the built-in function that takes evaluated arguments. argv points into the VM stack,
+// so the arguments are GC roots and argv[i] stays valid across allocation.
+typedef struct Object *Builtin(int argc, struct Object **argv);
+
+// Typedef for the native code of a code object; see Native code.
+typedef int NativeCode(struct Object ***sp, struct Object *env, struct Object *code, int pc, bool *gc_pending);
+
+// The native code of a code object. entry[pc] is set if the VM should switch to the native code at
+// the instruction at pc, which is when enough instructions from there on run natively to pay for
+// the switch.
+typedef struct Native
+{
+    NativeCode *fn;
+    uint8_t entry[];
+} Native;
+
 // The object type
 typedef struct Object
 {
     int type;
 
+    // The length of an object of variable size, which together with the type gives the size of the
+    // object; see object_size(). Functions keep the number of their parameters here, which saves a
+    // word in every closure.
+    union {
+        // Vector
+        int nelems;
+        // Integer vector
+        int nints;
+        // String, message of a condition or name of a symbol, not counting the NUL at the end of
+        // the last two
+        int nbytes;
+        // Environment frame
+        int nvars;
+        // Compiled code
+        int nconsts;
+        // Function
+        int nparams;
+        // Bignum; negative for a negative number
+        int nlimbs;
+    };
+
     // Objectect values.
     union {
-        // Int
-        int value;
+        // Int that does not fit in a fixnum
+        int64_t value;
         // Cons cell type
         struct
         {
             struct Object *car;
             struct Object *cdr;
         };
-        // Symbol
-        char name[1];
-        // Primitive
-        Primitive *fn;
+        // Symbol. The value of the global variable is stored in the symbol itself, or NULL if
+        // the variable is unbound.
+        struct
+        {
+            struct Object *global;
+            uint32_t hash;
+            char name[1];
+        };
+        // Primitive. A special form takes the environment and the list of its unevaluated
+        // arguments; any other primitive takes the evaluated arguments as an array. prim_prof
+        // identifies the primitive in the profile.
+        struct
+        {
+            union
+            {
+                Primitive *fn;
+                Builtin *builtin;
+            };
+            bool special;
+            int prim_prof;
+        };
         // Subtype for special type
         int subtype;
+        // Condition, which describes a caught error
+        char message[1];
+        // Vector
+        struct Object *elems[1];
+        // Byte string, which may contain any byte including NUL
+        char bytes[1];
+        // Vector of unboxed integers, for the bulk numeric primitives
+        int64_t ints[1];
+        // Magnitude of a bignum, least significant limb first; see make_integer()
+        uint64_t limbs[1];
+        // Function. A frame of the function has nslots slots, the first nparams of which hold the
+        // arguments and the others the variables defined in the body. code is the compiled body, or
+        // NULL if the body is interpreted. prof identifies the function in the profile.
+        struct
+        {
+            struct Object *params;
+            struct Object *body;
+            struct Object *env;
+            struct Object *code;
+            int nslots;
+            int prof;
+        };
         // Environment frame
         struct
         {
-            struct Object *vars;
             struct Object *up;
+            struct Object *slots[1];
+        };
+        // Local variable reference, which refers to the index-th slot of the frame depth levels up
+        // from the current one.
+        struct
+        {
+            struct Object *sym;
+            int depth;
+            int index;
+        };
+        // Compiled code. The constants are followed by ninsns instructions; see code_insns().
+        // maxstack is the number of VM stack slots the code needs. ncalls counts the calls that
+        // entered the code until it is compiled to native, and native is that native code or NULL.
+        struct
+        {
+            int ninsns;
+            int maxstack;
+            uint32_t ncalls;
+            Native *native;
+            struct Object *consts[1];
         };
         // Forwarding pointer
         void *moved;
     };
 } Object;
 
-// Constants
-static Object *Nil;
-static Object *Dot;
-static Object *Paren;
-static Object *True;
-
-// The list containing all symbols.
-static Object *Symbols;
+// Constants. They live outside the heap.
+static Object special_objects[] = {
+    {KEYWORD, .subtype = NIL},
+    {KEYWORD, .subtype = DOT},
+    {KEYWORD, .subtype = PARENTHESIS},
+    {KEYWORD, .subtype = TTRUE},
+};
+static Object *const Nil = &special_objects[0];
+static Object *const Dot = &special_objects[1];
+static Object *const Paren = &special_objects[2];
+static Object *const True = &special_objects[3];
 
 static void error(char *fmt, ...) __attribute((noreturn));
 
 //======================================================================
-// Constructors
+// Fixnums
 //======================================================================
 
-static Object *allocate(int type, size_t size)
-{
-    // Add the size of the type tag.
-    size += offsetof(Object, value);
-
-    // Allocate the object.
-    Object *obj = malloc(size);
-    obj->type = type;
-    return obj;
-}
+// Small integers are not allocated but stored in the object pointer itself, shifted left by one
+// with the lowest bit set. Heap objects and constants are at least pointer-aligned, so no real
+// object pointer has that bit set. Integers outside of the fixnum range are boxed INTEGER objects,
+// and those outside of the int64_t range BIGNUM objects.
+#define FIXNUM_MAX (INTPTR_MAX >> 1)
+#define FIXNUM_MIN (INTPTR_MIN >> 1)
 
-static Object *make_int(int value)
+static inline bool is_fixnum(Object *obj)
 {
-    Object *r = allocate(INTEGER, sizeof(int));
-    r->value = value;
-    return r;
+    return (uintptr_t)obj & 1;
 }
 
-static Object *make_symbol(char *name)
+static inline Object *make_fixnum(intptr_t value)
 {
-    Object *sym = allocate(SYMBOL, strlen(name) + 1);
-    strcpy(sym->name, name);
-    return sym;
+    return (Object *)(((uintptr_t)value << 1) | 1);
 }
 
-static Object *make_primitive(Primitive *fn)
+static inline intptr_t fixnum_value(Object *obj)
 {
-    Object *r = allocate(PRIMITIVE, sizeof(Primitive *));
-    r->fn = fn;
-    return r;
+    return (intptr_t)obj >> 1;
 }
 
-static Object *make_function(int type, Object *params, Object *body, Object *env)
+// Returns the type of the object. Use this instead of obj->type unless obj is known not to be a
+// fixnum.
+static inline int type_of(Object *obj)
 {
-    assert(type == FUNCTION);
-    Object *r = allocate(type, sizeof(Object *) * 3);
-    r->params = params;
-    r->body = body;
-    r->env = env;
-    return r;
+    return is_fixnum(obj) ? INTEGER : obj->type;
 }
 
-static Object *make_special(int subtype)
+// Returns the value of a fixnum or an INTEGER.
+static inline int64_t int_value(Object *obj)
 {
-    Object *r = malloc(sizeof(void *) * 2);
-    r->type = KEYWORD;
-    r->subtype = subtype;
-    return r;
+    return is_fixnum(obj) ? fixnum_value(obj) : obj->value;
 }
 
-struct Object *make_env(Object *vars, Object *up)
+static inline bool is_integer(Object *obj)
 {
-    Object *r = allocate(ENV, sizeof(Object *) * 2);
-    r->vars = vars;
-    r->up = up;
-    return r;
+    return type_of(obj) == INTEGER || type_of(obj) == BIGNUM;
 }
 
-static Object *cons(Object *car, Object *cdr)
+//======================================================================
+// Memory management
+//======================================================================
+
+// The size of the old generation when the interpreter starts. It grows on demand.
+#define INITIAL_HEAP_SIZE (1 << 20)
+
+// The size of the nursery, where new objects are allocated. A minor collection copies what
+// survives of it into the old generation, so its pause is bounded by the size of the nursery, not
+// of the heap.
+#define NURSERY_SIZE (1 << 20)
+
+// Objects larger than this are allocated in the old generation, so that they are never copied by a
+// minor collection.
+#define PRETENURE_SIZE (NURSERY_SIZE / 4)
+
+// The size of the allocation buffer of a thread once the thread pool has started. Before that, the
+// main thread's buffer is the whole free part of the nursery.
+#define ALLOC_BUFFER_SIZE (64 << 10)
+
+// The old generation is divided into cards of CARD_SIZE bytes. See note_store().
+#define CARD_SHIFT 9
+#define CARD_SIZE (1 << CARD_SHIFT)
+
+// Flag to run GC on every allocation. Set by the LISPY_ALWAYS_GC environment variable; useful to
+// find missing roots.
+static bool always_gc;
+
+// The call frame of the bytecode VM
+typedef struct VMFrame
 {
-    Object *cell = allocate(CELL, sizeof(Object *) * 2);
-    cell->car = car;
-    cell->cdr = cdr;
-    return cell;
-}
+    Object *code;
+    Object *env;
+    int pc;
+} VMFrame;
 
-// Returns ((x . y) . a)
-static Object *acons(Object *x, Object *y, Object *a)
+// A point that error() unwinds to, with the depths of the thread's stacks at that point; see
+// CATCH().
+typedef struct Handler
 {
-    return cons(cons(x, y), a);
-}
+    jmp_buf buf;
+    struct Handler *up;
+    int nroots;
+    int vm_sp;
+    int vm_nframes;
+    int eval_depth;
+    int prof_depth;
+} Handler;
 
-//======================================================================
-// Parser
-//======================================================================
+// A node of the call tree recorded by the profiler. The path from the root to a node is a stack of
+// calls; calls is the number of times the function was called on that stack, total_ns the time
+// spent in those calls, and self_ns the part of it not spent in the calls made from them.
+typedef struct ProfNode
+{
+    int id;
+    struct ProfNode *parent;
+    struct ProfNode *child;
+    struct ProfNode *sibling;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t self_ns;
+} ProfNode;
 
-static Object *read(void);
+#define PROF_BLOCK_SIZE 1024
 
-static void error(char *fmt, ...)
+typedef struct ProfBlock
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    va_end(ap);
-    exit(1);
-}
+    struct ProfBlock *next;
+    int nused;
+    ProfNode nodes[PROF_BLOCK_SIZE];
+} ProfBlock;
 
-static int peek(void)
+// A call tree, whose nodes are allocated in blocks
+typedef struct ProfTree
 {
-    int c = getchar();
-    ungetc(c, stdin);
-    return c;
-}
+    ProfNode root;
+    ProfBlock *blocks;
+} ProfTree;
 
-// Skips the input until newline is found.
-static void skip_line(void)
+// A call in progress and the time spent so far in the calls made from it
+typedef struct ProfFrame
 {
-    for (;;)
-    {
-        int c = getchar();
-        if (c == EOF || c == '\n')
-            return;
-        if (c == '\r')
-        {
-            if (peek() == '\n')
-                getchar();
-            return;
-        }
-    }
-}
+    ProfNode *node;
+    uint64_t start;
+    uint64_t children_ns;
+} ProfFrame;
 
-// Reads a list
-static Object *read_list(void)
+// A growable byte buffer
+typedef struct Bytes
 {
-    Object *obj = read();
-    if (!obj)
-        error("Unclosed parenthesis");
-    if (obj == Dot)
-        error("Stray dot");
-    if (obj == Paren)
-        return Nil;
-    Object *head, *tail;
-    head = tail = cons(obj, Nil);
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Bytes;
 
-    for (;;)
-    {
-        Object *obj = read();
-        if (!obj)
-            error("Unclosed parenthesis");
-        if (obj == Paren)
-            return head;
-        if (obj == Dot)
-        {
-            tail->cdr = read();
-            if (read() != Paren)
-                error("Closed parenthesis expected after dot");
-            return head;
-        }
-        tail->cdr = cons(obj, Nil);
-        tail = tail->cdr;
-    }
-}
+// A symbol met by write-binary, at its slot in the table of the symbols written so far. Slots
+// whose stamp is not the current one are free.
+typedef struct BinarySym
+{
+    struct Object *sym;
+    uint32_t index;
+    uint32_t stamp;
+} BinarySym;
 
-// If there's a symbol with the same name, it will not create a new symbol but return the existing one. Otherwise create a new one.
-static Object *intern(char *name)
+// The state of the interpreter that is private to a thread. The contexts of all threads are linked
+// so that the collector can find their roots.
+typedef struct Context
 {
-    for (Object *p = Symbols; p != Nil; p = p->cdr)
-        if (strcmp(name, p->car->name) == 0)
-            return p->car;
-    Object *sym = make_symbol(name);
-    Symbols = cons(sym, Symbols);
-    return sym;
-}
+    // The allocation buffer
+    uint8_t *alloc_ptr;
+    uint8_t *alloc_end;
 
-// Reads an expression and returns (quote <expr>).
-static Object *read_quote(void)
+    // The root stack. Every local variable that holds a heap object across a call that may allocate
+    // is registered here, so that the collector can find and update it.
+    Object ***roots;
+    int nroots;
+    int roots_cap;
+
+    // The value stack and the call frames of the bytecode VM. They are part of the root set.
+    Object **vm_stack;
+    int vm_sp;
+    VMFrame *vm_frames;
+    int vm_nframes;
+
+    // The nesting depth of eval()
+    int eval_depth;
+
+    // The bounds of the C stack; see check_c_stack()
+    char *c_stack_base;
+    size_t c_stack_limit;
+
+    // The lists that print() is in the middle of. The top is the cell whose car has just been printed.
+    Object **print_stack;
+    size_t print_stack_cap;
+
+    // The scratch space of write-binary and read-binary; see Binary serialization
+    Bytes binary_body;
+    Bytes binary_names;
+    BinarySym *binary_syms;
+    uint32_t binary_syms_cap;
+    uint32_t binary_stamp;
+    Object ***binary_holes;
+    size_t binary_holes_cap;
+
+    // The index of the thread's work queue in the thread pool
+    int queue;
+
+    // The innermost error handler, or NULL if errors exit the process. The message of the error
+    // being handled is in error.
+    Handler *handler;
+    char error[256];
+
+    // The interpreter that the thread works for
+    Lispy *lispy;
+
+    // The number of objects the thread has allocated
+    uint64_t nallocs;
+
+    // The profile of the thread: the call tree, the calls in progress, and the number of objects
+    // and bytes allocated by type. Only recorded with --profile.
+    ProfTree profile;
+    ProfFrame *prof_stack;
+    int prof_depth;
+    int prof_cap;
+    uint64_t alloc_objects[NTYPES];
+    uint64_t alloc_bytes[NTYPES];
+
+    struct Context *next;
+} Context;
+
+// The tasks of the thread pool. A task is stored in a chunk that never moves, so that it can be read
+// without a lock. The function, the arguments and the result of a task in use are part of the root
+// set. A task is referred to by a handle holding its index and its generation, which is bumped when
+// the task is freed, so that a handle can't be used again once its task has been joined.
+#define TASK_CHUNK_SIZE 1024
+#define MAX_TASK_CHUNKS 4096
+#define TASK_INDEX_BITS 22
+
+enum
 {
-    Object *sym = intern("quote");
-    return cons(sym, cons(read(), Nil));
-}
+    TASK_FREE,
+    TASK_PENDING,
+    TASK_RUNNING,
+    TASK_DONE,
+};
 
-static int read_number(int val)
+typedef struct Task
 {
-    while (isdigit(peek()))
-        val = val * 10 + (getchar() - '0');
-    return val;
-}
+    Object *fn;
+    Object *args;
+    Object *result;
+    int state;
+    // The message of the error that the task failed with, or NULL
+    char *error;
+    // The next free task
+    int next;
+    uint32_t gen;
+    // Set by the one join that may wait for the task and free it
+    bool joined;
+} Task;
 
-#define SYMBOL_MAX_LEN 200
+typedef struct Queue Queue;
 
-static Object *read_symbol(char c)
+// The forms that the reader thread of --pipeline has read ahead, in a ring. The reader is the only
+// producer and the evaluator the only consumer, so the counts need no lock; the lock and the
+// condition are only for sleeping while the ring is full or empty. The forms are part of the root
+// set.
+#define PIPELINE_SIZE 256
+
+typedef struct Pipeline
 {
-    char buf[SYMBOL_MAX_LEN + 1];
-    int len = 1;
-    buf[0] = c;
-    while (isalnum(peek()) || peek() == '-')
-    {
-        if (SYMBOL_MAX_LEN <= len)
-            error("Symbol name too long");
-        buf[len++] = getchar();
-    }
-    buf[len] = '\0';
-    return intern(buf);
-}
+    Object *forms[PIPELINE_SIZE];
+    // The numbers of forms pushed and popped so far
+    unsigned pushed;
+    unsigned popped;
+    // Set by the reader at the end of the input, with the message of the error that stopped it if any
+    bool done;
+    char *error;
+    // The number of threads sleeping on cond
+    int nsleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    pthread_t thread;
+} Pipeline;
 
-static Object *read(void)
+// An interpreter. Interpreters share little more than the constants and the standard output, so a
+// process can run any number of them side by side. The calling thread's interpreter and context are
+// in the thread-local variables lispy and ctx; the threads of an interpreter's pool share the
+// interpreter.
+struct Lispy
 {
-    for (;;)
-    {
-        int c = getchar();
-        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
-            continue;
-        if (c == EOF)
-            return NULL;
-        if (c == ';')
-        {
-            skip_line();
-            continue;
-        }
-        if (c == '(')
-            return read_list();
-        if (c == ')')
-            return Paren;
-        if (c == '.')
-            return Dot;
-        if (c == '\'')
-            return read_quote();
-        if (isdigit(c))
-            return make_int(read_number(c - '0'));
-        if (c == '-')
-            return make_int(-read_number(0));
-        if (isalpha(c) || strchr("+=!@#$%^&*", c))
-            return read_symbol(c);
-        error("Unknown character: %c", c);
-    }
+    // The heap, which all threads share, in two generations. Each thread bump-allocates objects
+    // from a buffer of its own, which it claims from the front of the nursery. When the nursery
+    // fills up, the collector stops every thread and copies the live objects of the nursery to the
+    // end of the old generation, memory. When that fills up too, both are copied into a freshly
+    // allocated old generation, and the old one is freed.
+    uint8_t *memory;
+    size_t mem_size;
+    size_t mem_nused;
+    uint8_t *nursery;
+    size_t nursery_nused;
+
+    // The card table of the old generation: a byte per card, set if an object in the card may
+    // point into the nursery, and the offset in words of the object that covers the start of each
+    // card. See note_store().
+    uint8_t *cards;
+    uint32_t *card_starts;
+
+    // The numbers of minor and major collections, and their total and longest pauses
+    uint64_t ngcs[2];
+    uint64_t gc_ns[2];
+    uint64_t gc_max_ns[2];
+
+    // The symbol table. An open-addressing hash table of all interned symbols with linear probing.
+    // The capacity is a power of two, and empty slots are NULL.
+    Object **symbols;
+    size_t symbols_cap;
+    size_t nsymbols;
+    pthread_mutex_t symbols_lock;
+
+    // The contexts of all threads of the interpreter. main is the context of the thread that
+    // calls into the interpreter.
+    Context *contexts;
+    Context main;
+
+    // See arena_begin()
+    uint8_t *arena_mark;
+    bool arena_dirty;
+    bool threads_started;
+
+    // See park()
+    pthread_mutex_t heap_lock;
+    pthread_cond_t heap_cond;
+    int nthreads;
+    int nparked;
+    bool gc_pending;
+
+    // The tasks, and the list of the free ones
+    Task *task_chunks[MAX_TASK_CHUNKS];
+    int ntasks;
+    int free_task;
+
+    // The thread pool. Idle threads wait on pool_cond; npending is the number of tasks in the
+    // queues. See start_threads().
+    Queue *queues;
+    int nqueues;
+    pthread_t *workers;
+    int nworkers;
+    bool shutdown;
+    pthread_mutex_t pool_lock;
+    pthread_cond_t pool_cond;
+    int npending;
+
+    // See Pipeline. NULL unless the reader thread is running.
+    Pipeline *pipeline;
+
+    // The number of objects allocated by the threads that have exited
+    uint64_t nallocs_exited;
+
+    // The profiles of the threads that have exited, merged, and the number of profile ids in use
+    ProfTree profile_exited;
+    uint64_t alloc_objects_exited[NTYPES];
+    uint64_t alloc_bytes_exited[NTYPES];
+    int nprofiled;
+};
+
+static __thread Lispy *lispy;
+static __thread Context *ctx;
+
+// Set by --profile. Checked on every call and allocation, so the test is hinted to fail.
+static bool profiling;
+#define PROFILING __builtin_expect(profiling, 0)
+
+static void profile_merge(ProfTree *dst, ProfTree *src);
+static void profile_free(ProfTree *t);
+static uint64_t now_ns(void);
+
+// Returns a new id for a function in the profile.
+static int new_profile_id(void)
+{
+    return __atomic_add_fetch(&lispy->nprofiled, 1, __ATOMIC_RELAXED);
 }
 
-// Prints the given object.
-static void print(Object *obj)
+static void restore_roots(int *mark)
 {
-    switch (obj->type)
-    {
-    case INTEGER:
-        printf("%d", obj->value);
-        return;
-    case CELL:
-        printf("(");
-        for (;;)
-        {
-            print(obj->car);
-            if (obj->cdr == Nil)
-                break;
-            if (obj->cdr->type != CELL)
-            {
-                printf(" . ");
-                print(obj->cdr);
-                break;
-            }
-            printf(" ");
-            obj = obj->cdr;
-        }
-        printf(")");
-        return;
-    case SYMBOL:
-        printf("%s", obj->name);
-        return;
-    case PRIMITIVE:
-        printf("<primitive>");
-        return;
-    case FUNCTION:
-        printf("<function>");
-        return;
-    case KEYWORD:
-        if (obj == Nil)
-            printf("()");
-        else if (obj == True)
-            printf("t");
-        else
-            error("Unknown subtype: %d", obj->subtype);
-        return;
-    default:
-        error("Unknown tag type: %d", obj->type);
-    }
+    ctx->nroots = *mark;
 }
 
-static int list_length(Object *list)
+static void push_root(Object **p)
 {
-    int len = 0;
-    for (;;)
+    if (ctx->nroots == ctx->roots_cap)
     {
-        if (list == Nil)
-            return len;
-        if (list->type != CELL)
-            error("Cannot handle dotted list");
-        list = list->cdr;
-        len++;
+        ctx->roots_cap = ctx->roots_cap ? ctx->roots_cap * 2 : 1024;
+        ctx->roots = realloc(ctx->roots, sizeof(Object **) * ctx->roots_cap);
+        if (!ctx->roots)
+            error("Memory exhausted");
     }
+    ctx->roots[ctx->nroots++] = p;
 }
 
-//======================================================================
-// Evaluator
-//======================================================================
+// Starts a root frame. The variables registered with ROOT() are popped from the root stack when the
+// enclosing scope is left.
+#define ROOT_FRAME int root_mark_ __attribute__((cleanup(restore_roots))) = ctx->nroots
 
-static Object *eval(Object *env, Object *obj);
+#define ROOT(var) push_root(&(var))
 
-static void add_variable(Object *env, Object *sym, Object *val)
-{
-    env->vars = acons(sym, val, env->vars);
-}
+// Errors are caught with
+//
+//     Handler h;
+//     if (CATCH(h))
+//         ... code that may raise an error ...
+//     else
+//         ... the error, whose message is in ctx->error ...
+//     pop_handler(&h);
+//
+// An error raised inside unwinds the root stack and the VM stack to where the handler was pushed
+// and returns from CATCH() a second time, with false. Nothing is done on the way, so the code must
+// not raise errors while it holds a lock.
+#define CATCH(h) (push_handler(&(h)), setjmp((h).buf) == 0)
 
-// Returns a newly created environment frame.
-static Object *push_env(Object *env, Object *vars, Object *values)
+static void push_handler(Handler *h)
 {
-    if (list_length(vars) != list_length(values))
-        error("Number of argument does not match");
-    Object *map = Nil;
-    for (Object *p = vars, *q = values; p != Nil; p = p->cdr, q = q->cdr)
-    {
-        Object *sym = p->car;
-        Object *val = q->car;
-        map = acons(sym, val, map);
-    }
-    return make_env(map, env);
+    h->up = ctx->handler;
+    h->nroots = ctx->nroots;
+    h->vm_sp = ctx->vm_sp;
+    h->vm_nframes = ctx->vm_nframes;
+    h->eval_depth = ctx->eval_depth;
+    h->prof_depth = ctx->prof_depth;
+    ctx->handler = h;
 }
 
-// Evaluates the list elements from head and returns the last return value.
-static Object *progn(Object *env, Object *list)
+static void pop_handler(Handler *h)
 {
-    Object *r = NULL;
-    for (Object *lp = list; lp != Nil; lp = lp->cdr)
-        r = eval(env, lp->car);
-    return r;
+    ctx->handler = h->up;
 }
 
-// Evaluates all the list elements and returns their return values as a new list.
-static Object *eval_list(Object *env, Object *list)
+// The top-level arena. The objects allocated while one top-level form is evaluated are released in
+// constant time when the form is done, unless an older object has been made to point to them or GC
+// has moved the heap in the meantime. In that case they are left to the collector. Once other
+// threads are running, they may be holding such objects, so the arena is no longer reset.
+
+// Records that an object that may be older than the current top-level form has been modified.
+static inline void arena_note_store(void)
 {
-    Object *head = NULL;
-    Object *tail = NULL;
-    for (Object *lp = list; lp != Nil; lp = lp->cdr)
-    {
-        Object *tmp = eval(env, lp->car);
-        if (head == NULL)
-        {
-            head = tail = cons(tmp, Nil);
-        }
-        else
-        {
-            tail->cdr = cons(tmp, Nil);
-            tail = tail->cdr;
-        }
-    }
-    if (head == NULL)
-        return Nil;
-    return head;
+    // Any thread may write it, while the main thread reads it.
+    __atomic_store_n(&lispy->arena_dirty, true, __ATOMIC_RELAXED);
 }
 
-static bool is_list(Object *obj)
+static void arena_begin(void)
 {
-    return obj == Nil || obj->type == CELL;
+    lispy->arena_mark = ctx->alloc_ptr;
+    __atomic_store_n(&lispy->arena_dirty, false, __ATOMIC_RELAXED);
 }
 
-// Apply fn with args.
-static Object *apply(Object *env, Object *fn, Object *args)
+static void arena_reset(void)
 {
-    if (!is_list(args))
-        error("Argument must be a list");
-    if (fn->type == PRIMITIVE)
-        return fn->fn(env, args);
-    if (fn->type == FUNCTION)
-    {
-        Object *body = fn->body;
-        Object *params = fn->params;
-        Object *eargs = eval_list(env, args);
-        Object *newenv = push_env(fn->env, params, eargs);
-        return progn(newenv, body);
-    }
-    error("Not supported");
+    if (!__atomic_load_n(&lispy->arena_dirty, __ATOMIC_RELAXED) && !lispy->threads_started)
+        ctx->alloc_ptr = lispy->arena_mark;
 }
 
-// Searches for a variable by symbol. Returns null if not found.
-static Object *find(Object *env, Object *sym)
-{
-    for (Object *p = env; p; p = p->up)
+// The number of values on the VM stack of a thread
+#define VM_STACK_SIZE (1 << 22)
+
+// The maximum depth of non-tail calls, for both the VM and the interpreter. Set by --max-depth.
+#define DEFAULT_MAX_DEPTH (1 << 20)
+static int max_depth = DEFAULT_MAX_DEPTH;
+
+// The C stack is checked in the recursive functions, so that deeply nested data or code reports an
+// error instead of crashing.
+
+// The size of the C stack of every thread; the limit of the main thread's stack. The threads of the
+// pool get a stack as large as that.
+static size_t c_stack_size = 8 << 20;
+
+// The limit of the C stack is its size minus a safety margin.
+static void set_c_stack_base(char *base)
+{
+    ctx->c_stack_base = base;
+    ctx->c_stack_limit = c_stack_size - (256 << 10);
+}
+
+static inline void check_c_stack(void)
+{
+    if (ctx->c_stack_limit < (size_t)(ctx->c_stack_base - (char *)__builtin_frame_address(0)))
+        error("Stack overflow: C stack exhausted");
+}
+
+static inline Task *task_at(int i)
+{
+    return &lispy->task_chunks[i / TASK_CHUNK_SIZE][i % TASK_CHUNK_SIZE];
+}
+
+// Stopping the world. A thread that needs to collect sets gc_pending and waits until every other
+// thread has parked. Threads park when they next allocate, and count as parked while they are
+// blocked in a safe region, where they don't touch the heap.
+
+// Parks the thread until the collection in progress is done. Called with heap_lock held.
+static void park(void)
+{
+    lispy->nparked++;
+    pthread_cond_broadcast(&lispy->heap_cond);
+    while (lispy->gc_pending)
+        pthread_cond_wait(&lispy->heap_cond, &lispy->heap_lock);
+    lispy->nparked--;
+}
+
+// Called before the thread blocks. Local variables holding objects must be rooted.
+static void enter_safe_region(void)
+{
+    pthread_mutex_lock(&lispy->heap_lock);
+    lispy->nparked++;
+    pthread_cond_broadcast(&lispy->heap_cond);
+    pthread_mutex_unlock(&lispy->heap_lock);
+}
+
+static void leave_safe_region(void)
+{
+    pthread_mutex_lock(&lispy->heap_lock);
+    while (lispy->gc_pending)
+        pthread_cond_wait(&lispy->heap_cond, &lispy->heap_lock);
+    lispy->nparked--;
+    pthread_mutex_unlock(&lispy->heap_lock);
+}
+
+// Adds the calling thread to the threads that the collector knows about.
+static void register_thread(void)
+{
+    pthread_mutex_lock(&lispy->heap_lock);
+    while (lispy->gc_pending)
+        pthread_cond_wait(&lispy->heap_cond, &lispy->heap_lock);
+    ctx->next = lispy->contexts;
+    lispy->contexts = ctx;
+    lispy->nthreads++;
+    pthread_mutex_unlock(&lispy->heap_lock);
+}
+
+static void unregister_thread(void)
+{
+    pthread_mutex_lock(&lispy->heap_lock);
+    while (lispy->gc_pending)
+        pthread_cond_wait(&lispy->heap_cond, &lispy->heap_lock);
+    Context **p = &lispy->contexts;
+    while (*p != ctx)
+        p = &(*p)->next;
+    *p = ctx->next;
+    lispy->nthreads--;
+    lispy->nallocs_exited += ctx->nallocs;
+    if (PROFILING)
     {
-        for (Object *cell = p->vars; cell != Nil; cell = cell->cdr)
+        profile_merge(&lispy->profile_exited, &ctx->profile);
+        for (int i = 0; i < NTYPES; i++)
         {
-            Object *bind = cell->car;
-            if (sym == bind->car)
-                return bind;
+            lispy->alloc_objects_exited[i] += ctx->alloc_objects[i];
+            lispy->alloc_bytes_exited[i] += ctx->alloc_bytes[i];
         }
     }
-    return NULL;
+    pthread_cond_broadcast(&lispy->heap_cond);
+    pthread_mutex_unlock(&lispy->heap_lock);
 }
 
-// Evaluates the S expression.
-static Object *eval(Object *env, Object *obj)
+// The size of an object whose contents take n bytes, including the header and rounded up to
+// pointer alignment. Every object has room for the forwarding pointer.
+#define OBJECT_SIZE(n) \
+    ((((n) < sizeof(void *) ? sizeof(void *) : (n)) + offsetof(Object, value) + sizeof(void *) - 1) & \
+     ~(sizeof(void *) - 1))
+
+// The offset of a field from the start of the contents
+#define CONTENTS_OFFSET(field) (offsetof(Object, field) - offsetof(Object, value))
+
+// The sizes of the objects of each type
+#define INTEGER_SIZE OBJECT_SIZE(sizeof(int64_t))
+#define CELL_SIZE OBJECT_SIZE(sizeof(Object *) * 2)
+#define SYMBOL_SIZE(nbytes) OBJECT_SIZE(CONTENTS_OFFSET(name) + (size_t)(nbytes) + 1)
+#define PRIMITIVE_SIZE OBJECT_SIZE(CONTENTS_OFFSET(prim_prof) + sizeof(int))
+#define FUNCTION_SIZE OBJECT_SIZE(sizeof(Object *) * 4 + sizeof(int) * 2)
+#define CONDITION_SIZE(nbytes) OBJECT_SIZE((size_t)(nbytes) + 1)
+#define VECTOR_SIZE(nelems) OBJECT_SIZE(sizeof(Object *) * (size_t)(nelems))
+#define STRING_SIZE(nbytes) OBJECT_SIZE((size_t)(nbytes))
+#define INTVECTOR_SIZE(nints) OBJECT_SIZE(sizeof(int64_t) * (size_t)(nints))
+#define BIGNUM_SIZE(nlimbs) OBJECT_SIZE(sizeof(uint64_t) * (size_t)abs(nlimbs))
+#define ENV_SIZE(nvars) OBJECT_SIZE(sizeof(Object *) * ((size_t)(nvars) + 1))
+#define LVAR_SIZE OBJECT_SIZE(sizeof(Object *) + sizeof(int) * 2)
+#define CODE_SIZE(nconsts, ninsns) \
+    OBJECT_SIZE(CONTENTS_OFFSET(consts) + sizeof(Object *) * (size_t)(nconsts) + sizeof(uint32_t) * (size_t)(ninsns))
+
+// The sizes of the fixed-size types, or 0 for the types of variable size
+static const uint8_t fixed_sizes[NTYPES] = {
+    [INTEGER] = INTEGER_SIZE,
+    [CELL] = CELL_SIZE,
+    [PRIMITIVE] = PRIMITIVE_SIZE,
+    [FUNCTION] = FUNCTION_SIZE,
+    [MACRO] = FUNCTION_SIZE,
+    [LVAR] = LVAR_SIZE,
+};
+
+// Returns the size of the object in bytes. Objects don't record their size: the fixed-size types
+// have one size each, and the others have it computed from their length.
+static inline size_t object_size(Object *obj)
+{
+    if (obj->type < NTYPES && fixed_sizes[obj->type])
+        return fixed_sizes[obj->type];
+    switch (obj->type)
+    {
+    case SYMBOL:
+        return SYMBOL_SIZE(obj->nbytes);
+    case CONDITION:
+        return CONDITION_SIZE(obj->nbytes);
+    case VECTOR:
+        return VECTOR_SIZE(obj->nelems);
+    case STRING:
+        return STRING_SIZE(obj->nbytes);
+    case INTVECTOR:
+        return INTVECTOR_SIZE(obj->nints);
+    case BIGNUM:
+        return BIGNUM_SIZE(obj->nlimbs);
+    case ENV:
+        return ENV_SIZE(obj->nvars);
+    case CODE:
+        return CODE_SIZE(obj->nconsts, obj->ninsns);
+    default:
+        error("Bug: object_size: unknown type %d", obj->type);
+    }
+}
+
+// Cheney's algorithm uses two pointers to keep track of GC status. At first both pointers point to
+// the beginning of the to-space. As GC progresses, they are moved towards the end of the to-space.
+// The objects before "scan1" are the objects that are fully copied. The objects between "scan1" and
+// "scan2" have already been copied, but may contain pointers to the from-space. "scan2" points to
+// the beginning of the free space. A minor collection moves the objects of the nursery, and its
+// to-space is the end of the old generation; a major one also moves those of the old generation.
+// Interpreters may collect at the same time, so these are private to the collecting thread.
+static __thread uint8_t *from_space;
+static __thread size_t from_size;
+static __thread uint8_t *from_nursery;
+static __thread size_t from_nursery_size;
+static __thread uint8_t *scan1;
+static __thread uint8_t *scan2;
+
+// Moves one object from the from-space to the to-space. Returns the object's new address. If the
+// object has already been moved, does nothing but just returns the new address.
+static Object *forward(Object *obj)
+{
+    // Fixnums, constants, NULL and the objects that aren't being collected are never moved.
+    if (is_fixnum(obj) || ((uintptr_t)obj - (uintptr_t)from_nursery >= from_nursery_size &&
+                           (uintptr_t)obj - (uintptr_t)from_space >= from_size))
+        return obj;
+
+    // The pointer pointing to an already-moved object.
+    if (obj->type == MOVED)
+        return obj->moved;
+
+    // Otherwise, the object has not been moved yet. Move it.
+    Object *newloc = (Object *)scan2;
+    size_t size = object_size(obj);
+    memcpy(newloc, obj, size);
+    scan2 += size;
+
+    // Put a tombstone at the location where the object used to occupy, so that the following call of
+    // forward() can find the object's new location.
+    obj->type = MOVED;
+    obj->moved = newloc;
+    return newloc;
+}
+
+// Replaces every pointer to an object in obj with the result of calling fn on it.
+static inline void update_pointers(Object *obj, Object *(*fn)(Object *))
 {
     switch (obj->type)
     {
     case INTEGER:
     case PRIMITIVE:
-    case FUNCTION:
-    case KEYWORD:
-        // Self-evaluating objects
-        return obj;
-    case SYMBOL:
+    case CONDITION:
+    case STRING:
+    case INTVECTOR:
+    case BIGNUM:
+        // Any of the above types does not contain a pointer to a GC-managed object.
+        break;
+    case VECTOR:
     {
-        // Variable
-        Object *bind = find(env, obj);
-        if (!bind)
-            error("Undefined symbol: %s", obj->name);
-        return bind->cdr;
+        int n = obj->nelems;
+        for (int i = 0; i < n; i++)
+            obj->elems[i] = fn(obj->elems[i]);
+        break;
     }
+    case SYMBOL:
+        obj->global = fn(obj->global);
+        break;
     case CELL:
+        obj->car = fn(obj->car);
+        obj->cdr = fn(obj->cdr);
+        break;
+    case FUNCTION:
+    case MACRO:
+        obj->params = fn(obj->params);
+        obj->body = fn(obj->body);
+        obj->env = fn(obj->env);
+        obj->code = fn(obj->code);
+        break;
+    case ENV:
     {
-        // Function application form
-        Object *expanded = macroexpand(env, obj);
-        if (expanded != obj)
-            return eval(env, expanded);
-        Object *fn = eval(env, obj->car);
-        Object *args = obj->cdr;
-        if (fn->type != PRIMITIVE && fn->type != FUNCTION)
-            error("The head of a list must be a function");
-        return apply(env, fn, args);
+        obj->up = fn(obj->up);
+        for (int i = 0; i < obj->nvars; i++)
+            obj->slots[i] = fn(obj->slots[i]);
+        break;
     }
+    case LVAR:
+        obj->sym = fn(obj->sym);
+        break;
+    case CODE:
+        for (int i = 0; i < obj->nconsts; i++)
+            obj->consts[i] = fn(obj->consts[i]);
+        break;
     default:
-        error("Unknown tag type: %d", obj->type);
+        error("Bug: copy: unknown type %d", obj->type);
     }
 }
 
-//======================================================================
-// Functions and special forms
-//======================================================================
+// The card table. Every store of a pointer into an object that may be in the old generation goes
+// through note_store(), which marks the card of the field. A minor collection then only has to
+// scan the marked cards for pointers into the nursery, instead of the whole old generation. A
+// new old generation has every card clear, and so has the old one after a minor collection, since
+// the nursery is empty then.
 
-// 'expr
-static Object *primitive_QUOTE(Object *env, Object *list)
+// Records in card_starts the object of size bytes at p, which has been placed in the old
+// generation.
+static inline void note_object(uint8_t *p, size_t size)
 {
-    if (list_length(list) != 1)
-        error("Malformed quote");
-    return list->car;
+    size_t off = p - lispy->memory;
+    for (size_t c = (off + CARD_SIZE - 1) >> CARD_SHIFT; c << CARD_SHIFT < off + size; c++)
+        lispy->card_starts[c] = off / sizeof(void *);
 }
 
-// (list expr ...)
-static Object *primitive_LIST(Object *env, Object *list)
+static void note_objects(uint8_t *start, uint8_t *end)
 {
-    return eval_list(env, list);
+    for (uint8_t *p = start; p < end;)
+    {
+        size_t size = object_size((Object *)p);
+        note_object(p, size);
+        p += size;
+    }
 }
 
-// (setvalue <symbol> expr)
-static Object *primitive_SETVALUE(Object *env, Object *list)
+// Records that a pointer has been stored into the field, which may be in the old generation.
+static inline void note_store(void *field)
 {
-    if (list_length(list) != 2 || list->car->type != SYMBOL)
-        error("Unable to set new value");
-    Object *bind = find(env, list->car);
-    if (!bind)
-        error("Unbound variable %s", list->car->name);
-    Object *value = eval(env, list->cdr->car);
-    bind->cdr = value;
-    return value;
+    arena_note_store();
+    size_t off = (uint8_t *)field - lispy->memory;
+    // Threads mark cards concurrently, and a card may be shared by objects of different threads.
+    if (off < lispy->mem_size)
+        __atomic_store_n(&lispy->cards[off >> CARD_SHIFT], 1, __ATOMIC_RELAXED);
 }
 
-// (+ <integer> ...)
-static Object *primitive_PLUS(Object *env, Object *list)
+// Returns a clear card table for an old generation of size bytes, and the table of the starts of
+// its cards in *starts. Returns NULL if they can't be allocated.
+static uint8_t *new_cards(size_t size, uint32_t **starts)
 {
-    int sum = 0;
-    for (Object *args = eval_list(env, list); args != Nil; args = args->cdr)
+    size_t n = (size + CARD_SIZE - 1) >> CARD_SHIFT;
+    uint8_t *cards = calloc(n, 1);
+    *starts = malloc(sizeof(uint32_t) * n);
+    // The starts are offsets in words, which must fit in 32 bits.
+    if (!cards || !*starts || UINT32_MAX < size / sizeof(void *))
     {
-        if (args->car->type != INTEGER)
-            error("+ takes only numbers");
-        sum += args->car->value;
+        free(cards);
+        free(*starts);
+        return NULL;
     }
-    return make_int(sum);
+    return cards;
 }
 
-static Object *handle_function(Object *env, Object *list, int type)
+// Replaces the card table with a new one, and fills in the starts of the cards from the objects
+// of the old generation.
+static void set_cards(uint8_t *cards, uint32_t *starts)
 {
-    if (list->type != CELL || !is_list(list->car) || list->cdr->type != CELL)
-        error("Unable to create new lambda");
-    for (Object *p = list->car; p != Nil; p = p->cdr)
+    free(lispy->cards);
+    free(lispy->card_starts);
+    lispy->cards = cards;
+    lispy->card_starts = starts;
+    note_objects(lispy->memory, lispy->memory + lispy->mem_nused);
+}
+
+// Like update_pointers(obj, forward), but a vector, which may span many cards, only has its
+// elements between lo and hi forwarded.
+static void forward_fields_in(Object *obj, uint8_t *lo, uint8_t *hi)
+{
+    if (obj->type != VECTOR)
     {
-        if (p->car->type != SYMBOL)
-            error("Parameter must be a symbol");
-        if (!is_list(p->cdr))
-            error("Parameter list is not a flat list");
+        update_pointers(obj, forward);
+        return;
     }
-    Object *car = list->car;
-    Object *cdr = list->cdr;
-    return make_function(type, car, cdr, env);
+    Object **p = obj->elems;
+    Object **end = obj->elems + obj->nelems;
+    if ((uint8_t *)p < lo)
+        p = (Object **)lo;
+    if (hi < (uint8_t *)end)
+        end = (Object **)hi;
+    for (; p < end; p++)
+        *p = forward(*p);
 }
 
-// (lambda (<symbol> ...) expr ...)
-static Object *primitive_LAMBDA(Object *env, Object *list)
+// Forwards the pointers in the marked cards of the old generation up to old_end, and clears the
+// marks. The objects after old_end have been moved there by this collection, which scans them.
+static void scan_card(size_t c, uint8_t *old_end)
 {
-    return handle_function(env, list, FUNCTION);
+    lispy->cards[c] = 0;
+    uint8_t *lo = lispy->memory + (c << CARD_SHIFT);
+    uint8_t *hi = old_end - lo < CARD_SIZE ? old_end : lo + CARD_SIZE;
+    for (uint8_t *p = lispy->memory + (size_t)lispy->card_starts[c] * sizeof(void *); p < hi;
+         p += object_size((Object *)p))
+        forward_fields_in((Object *)p, lo, hi);
 }
 
-// (define <symbol> expr)
-static Object *primitive_DEFINE(Object *env, Object *list)
+static void scan_cards(uint8_t *old_end)
 {
-    if (list_length(list) != 2 || list->car->type != SYMBOL)
-        error("Malformed setq");
-    Object *sym = list->car;
-    Object *value = eval(env, list->cdr->car);
-    add_variable(env, sym, value);
-    return value;
+    uint8_t *cards = lispy->cards;
+    size_t n = (old_end - lispy->memory + CARD_SIZE - 1) >> CARD_SHIFT;
+    // Most cards are clear, so they are checked 64 at a time first.
+    for (size_t c = 0; c < n; c += 64)
+    {
+        if (c + 64 <= n)
+        {
+            uint64_t words[8], any = 0;
+            memcpy(words, cards + c, sizeof(words));
+            for (int i = 0; i < 8; i++)
+                any |= words[i];
+            if (!any)
+                continue;
+        }
+        for (size_t i = c; i < c + 64 && i < n; i++)
+            if (cards[i])
+                scan_card(i, old_end);
+    }
 }
 
-// (println expr)
-static Object *primitive_PRINTLN(Object *env, Object *list)
+// Forwards the roots: the symbols, the stacks of the threads, the tasks and the forms read ahead.
+static void forward_roots(void)
 {
-    print(eval(env, list->car));
-    printf("\n");
-    return Nil;
+    for (size_t i = 0; i < lispy->symbols_cap; i++)
+        lispy->symbols[i] = forward(lispy->symbols[i]);
+    for (Context *c = lispy->contexts; c; c = c->next)
+    {
+        for (int i = 0; i < c->nroots; i++)
+            *c->roots[i] = forward(*c->roots[i]);
+        for (int i = 0; i < c->vm_sp; i++)
+            c->vm_stack[i] = forward(c->vm_stack[i]);
+        for (int i = 0; i < c->vm_nframes; i++)
+        {
+            c->vm_frames[i].code = forward(c->vm_frames[i].code);
+            c->vm_frames[i].env = forward(c->vm_frames[i].env);
+        }
+    }
+    for (int i = 0; i < lispy->ntasks; i++)
+    {
+        Task *t = task_at(i);
+        if (t->state == TASK_FREE)
+            continue;
+        t->fn = forward(t->fn);
+        t->args = forward(t->args);
+        t->result = forward(t->result);
+    }
+    if (lispy->pipeline)
+        for (int i = 0; i < PIPELINE_SIZE; i++)
+            lispy->pipeline->forms[i] = forward(lispy->pipeline->forms[i]);
 }
 
-// (if expr expr expr ...)
-static Object *primitive_IF(Object *env, Object *list)
+// Copies the objects referenced by the objects in the to-space, and empties the nursery.
+static void finish_collection(void)
 {
-    if (list_length(list) < 2)
-        error("Malformed if");
-    Object *cond = eval(env, list->car);
-    if (cond != Nil)
+    while (scan1 < scan2)
     {
-        Object *then = list->cdr->car;
-        return eval(env, then);
+        Object *obj = (Object *)scan1;
+        update_pointers(obj, forward);
+        scan1 += object_size(obj);
     }
-    Object *els = list->cdr->cdr;
-    return els == Nil ? Nil : progn(env, els);
+    lispy->nursery_nused = 0;
+    from_space = from_nursery = NULL;
+    from_size = from_nursery_size = 0;
+    __atomic_store_n(&lispy->arena_dirty, true, __ATOMIC_RELAXED);
+
+    // The allocation buffers were in the nursery.
+    for (Context *c = lispy->contexts; c; c = c->next)
+        c->alloc_ptr = c->alloc_end = NULL;
 }
 
-// (= <integer> <integer>)
-static Object *primitive_EQUAL(Object *env, Object *list)
+// Copies the live objects of the nursery to the end of the old generation, which must have room
+// for the whole nursery. Every other thread must be parked.
+static void collect_minor(void)
 {
-    if (list_length(list) != 2)
-        error("Malformed =");
-    Object *values = eval_list(env, list);
-    Object *x = values->car;
-    Object *y = values->cdr->car;
-    if (x->type != INTEGER || y->type != INTEGER)
-        error("= only takes numbers");
-    return x->value == y->value ? True : Nil;
+    uint8_t *old_end = lispy->memory + lispy->mem_nused;
+    from_nursery = lispy->nursery;
+    from_nursery_size = lispy->nursery_nused;
+    scan1 = scan2 = old_end;
+    forward_roots();
+    scan_cards(old_end);
+    finish_collection();
+    note_objects(old_end, scan2);
+    lispy->mem_nused = scan2 - lispy->memory;
 }
 
-// (exit)
-static Object *primitive_EXIT(Object *env, Object *list)
+// Copies the live objects of both generations into a new old generation of new_size bytes, which
+// must be large enough for them, and frees the old one. Every other thread must be parked. Returns
+// false if the new space can't be allocated.
+static bool collect(size_t new_size)
 {
-    exit(0);
+    uint32_t *starts;
+    uint8_t *to_space = malloc(new_size);
+    uint8_t *cards = to_space ? new_cards(new_size, &starts) : NULL;
+    if (!cards)
+    {
+        free(to_space);
+        return false;
+    }
+    from_space = lispy->memory;
+    from_size = lispy->mem_nused;
+    from_nursery = lispy->nursery;
+    from_nursery_size = lispy->nursery_nused;
+    scan1 = scan2 = to_space;
+    forward_roots();
+    finish_collection();
+
+    free(lispy->memory);
+    lispy->memory = to_space;
+    lispy->mem_size = new_size;
+    lispy->mem_nused = scan2 - to_space;
+    set_cards(cards, starts);
+    return true;
 }
 
-static void add_primitive(Object *env, char *name, Primitive *fn)
+// If the thread's buffer is the last one claimed from the nursery, gives back its unused end.
+static void release_buffer(void)
 {
-    Object *sym = intern(name);
-    Object *prim = make_primitive(fn);
-    add_variable(env, sym, prim);
+    if (ctx->alloc_end && ctx->alloc_end == lispy->nursery + lispy->nursery_nused)
+    {
+        lispy->nursery_nused = ctx->alloc_ptr - lispy->nursery;
+        ctx->alloc_end = ctx->alloc_ptr;
+    }
 }
 
-static void define_constants(Object *env)
+// Gives the thread a new allocation buffer of at least need bytes. Called with heap_lock held.
+// Returns false if the heap is full. A large object gets a buffer of its own in the old generation,
+// with its cards marked, since the caller fills it in without note_store().
+static bool claim_buffer(size_t need)
 {
-    Object *sym = intern("t");
-    add_variable(env, sym, True);
+    release_buffer();
+    if (PRETENURE_SIZE < need)
+    {
+        if (lispy->mem_size - lispy->mem_nused < need)
+            return false;
+        ctx->alloc_ptr = lispy->memory + lispy->mem_nused;
+        ctx->alloc_end = ctx->alloc_ptr + need;
+        lispy->mem_nused += need;
+        note_object(ctx->alloc_ptr, need);
+        size_t first = (ctx->alloc_ptr - lispy->memory) >> CARD_SHIFT;
+        size_t last = (ctx->alloc_end - 1 - lispy->memory) >> CARD_SHIFT;
+        memset(lispy->cards + first, 1, last - first + 1);
+    }
+    else
+    {
+        size_t size = lispy->threads_started ? ALLOC_BUFFER_SIZE : NURSERY_SIZE - lispy->nursery_nused;
+        if (size < need)
+            size = need;
+        if (NURSERY_SIZE - lispy->nursery_nused < size)
+            return false;
+        ctx->alloc_ptr = lispy->nursery + lispy->nursery_nused;
+        ctx->alloc_end = ctx->alloc_ptr + size;
+        lispy->nursery_nused += size;
+    }
+    // The arena mark is not in the new buffer.
+    __atomic_store_n(&lispy->arena_dirty, true, __ATOMIC_RELAXED);
+    return true;
 }
 
-static void define_primitives(Object *env)
+// Waits until every other thread has parked. Returns with heap_lock held.
+static void stop_the_world(void)
 {
-    add_primitive(env, "quote", primitive_QUOTE);
-    add_primitive(env, "list", primitive_LIST);
-    add_primitive(env, "setvalue", primitive_SETVALUE);
-    add_primitive(env, "+", primitive_PLUS);
-    add_primitive(env, "define", primitive_DEFINE);
-    add_primitive(env, "lambda", primitive_LAMBDA);
-    add_primitive(env, "if", primitive_IF);
-    add_primitive(env, "=", primitive_EQUAL);
-    add_primitive(env, "println", primitive_PRINTLN);
-    add_primitive(env, "exit", primitive_EXIT);
+    pthread_mutex_lock(&lispy->heap_lock);
+    while (lispy->gc_pending)
+        park();
+    __atomic_store_n(&lispy->gc_pending, true, __ATOMIC_RELAXED);
+    while (lispy->nparked < lispy->nthreads - 1)
+        pthread_cond_wait(&lispy->heap_cond, &lispy->heap_lock);
 }
 
-int main(int argc, char **argv)
+static void resume_the_world(void)
+{
+    __atomic_store_n(&lispy->gc_pending, false, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&lispy->heap_cond);
+    pthread_mutex_unlock(&lispy->heap_lock);
+}
+
+// Makes room for at least need bytes in the thread's allocation buffer, running the garbage
+// collector if the nursery is full. The collection is minor unless the old generation is short of
+// room for what survives of the nursery. A major collection doubles the old generation until at
+// least half of it is free, which keeps the cost of the collector amortized constant per allocated
+// byte.
+static void gc(size_t need)
 {
-    // Constants and primitives
-    Nil = make_special(NIL);
-    Dot = make_special(DOT);
-    Paren = make_special(PARENTHESIS);
-    True = make_special(TTRUE);
-    Symbols = Nil;
+    pthread_mutex_lock(&lispy->heap_lock);
+    while (lispy->gc_pending)
+        park();
+    bool claimed = !always_gc && claim_buffer(need);
+    pthread_mutex_unlock(&lispy->heap_lock);
+    if (claimed)
+        return;
+
+    stop_the_world();
+    uint64_t start = PROFILING ? now_ns() : 0;
+    release_buffer();
+    bool ok = true;
+    bool major = lispy->mem_size - lispy->mem_nused < lispy->nursery_nused;
+    if (!major)
+        collect_minor();
+    if (major || lispy->mem_size - lispy->mem_nused < NURSERY_SIZE + need)
+    {
+        major = true;
+        size_t size = lispy->mem_size;
+        while (size < lispy->mem_nused + lispy->nursery_nused)
+            size *= 2;
+        ok = collect(size);
+        size_t new_size = lispy->mem_size;
+        while (new_size < (lispy->mem_nused + NURSERY_SIZE + need) * 2)
+            new_size *= 2;
+        // If the heap can't grow, the old one may still have room.
+        if (ok && new_size != lispy->mem_size)
+            collect(new_size);
+    }
+    ok = ok && claim_buffer(need);
+    if (PROFILING)
+    {
+        uint64_t ns = now_ns() - start;
+        lispy->ngcs[major]++;
+        lispy->gc_ns[major] += ns;
+        if (lispy->gc_max_ns[major] < ns)
+            lispy->gc_max_ns[major] = ns;
+    }
+    resume_the_world();
+    if (!ok)
+        error("Memory exhausted");
+}
 
-    Object *env = make_env(Nil, NULL);
+static void init_heap(void)
+{
+    uint32_t *starts;
+    lispy->memory = malloc(INITIAL_HEAP_SIZE);
+    lispy->nursery = malloc(NURSERY_SIZE);
+    lispy->cards = new_cards(INITIAL_HEAP_SIZE, &starts);
+    if (!lispy->memory || !lispy->nursery || !lispy->cards)
+        error("Memory exhausted");
+    lispy->card_starts = starts;
+    lispy->mem_size = INITIAL_HEAP_SIZE;
+    lispy->mem_nused = 0;
+    lispy->nursery_nused = 0;
+}
 
-    define_constants(env);
-    define_primitives(env);
+// Sets up the calling thread's context, which is ctx. base is the base of its C stack.
+static void init_context(char *base)
+{
+    ctx->lispy = lispy;
+    ctx->vm_stack = malloc(sizeof(Object *) * VM_STACK_SIZE);
+    ctx->vm_frames = malloc(sizeof(VMFrame) * max_depth);
+    if (!ctx->vm_stack || !ctx->vm_frames)
+        error("Memory exhausted");
+    set_c_stack_base(base);
+    register_thread();
+}
 
-    // The main loop
-    for (;;)
+static void free_context(Context *c)
+{
+    free(c->vm_stack);
+    free(c->vm_frames);
+    free(c->roots);
+    free(c->print_stack);
+    free(c->binary_body.data);
+    free(c->binary_names.data);
+    free(c->binary_syms);
+    free(c->binary_holes);
+    free(c->prof_stack);
+    profile_free(&c->profile);
+}
+
+//======================================================================
+// Constructors
+//======================================================================
+
+// Returns true if an object of size bytes can be allocated without calling gc(). Returns false while
+// another thread waits to collect, so that the thread parks in gc().
+static inline bool has_room(size_t size)
+{
+    return !always_gc && !__atomic_load_n(&lispy->gc_pending, __ATOMIC_RELAXED) &&
+           (size_t)(ctx->alloc_end - ctx->alloc_ptr) >= size;
+}
+
+// Takes size bytes from the allocation buffer. The caller must have made room with has_room() or
+// gc().
+static inline Object *bump(int type, size_t size)
+{
+    Object *obj = (Object *)ctx->alloc_ptr;
+    ctx->alloc_ptr += size;
+    ctx->nallocs++;
+    if (PROFILING)
     {
-        Object *expr = read();
-        if (!expr)
-            return 0;
-        if (expr == Paren)
-            error("Stray parenthesis");
-        if (expr == Dot)
-            error("Stray dot");
-        print(eval(env, expr));
-        printf("\n");
+        ctx->alloc_objects[type]++;
+        ctx->alloc_bytes[type] += size;
+    }
+    obj->type = type;
+    return obj;
+}
+
+// Allocates an object of size bytes, which the caller gets from one of the size macros above.
+static Object *allocate(int type, size_t size)
+{
+    // Run GC if the heap has no room for the new object.
+    if (!has_room(size))
+        gc(size);
+    return bump(type, size);
+}
+
+// Returns a fixnum if the value is in the fixnum range, or a boxed integer otherwise.
+static Object *make_int(int64_t value)
+{
+    if (FIXNUM_MIN <= value && value <= FIXNUM_MAX)
+        return make_fixnum(value);
+    if (!has_room(INTEGER_SIZE))
+        gc(INTEGER_SIZE);
+    Object *r = bump(INTEGER, INTEGER_SIZE);
+    r->value = value;
+    return r;
+}
+
+static Object *make_symbol(char *name, size_t len, uint32_t hash)
+{
+    Object *sym = allocate(SYMBOL, SYMBOL_SIZE(len));
+    sym->nbytes = len;
+    sym->global = NULL;
+    sym->hash = hash;
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    return sym;
+}
+
+// The largest vector and string, whose sizes are kept within an int
+#define VECTOR_MAX ((INT_MAX - (int)sizeof(Object)) / (int)sizeof(Object *))
+#define STRING_MAX (INT_MAX - (int)sizeof(Object))
+#define INTVECTOR_MAX ((INT_MAX - (int)sizeof(Object)) / (int)sizeof(int64_t))
+
+// Returns a vector of n elements, each of which is fill.
+static Object *make_vector(int64_t n, Object *fill)
+{
+    if (n < 0 || VECTOR_MAX < n)
+        error("Invalid vector length: %" PRId64, n);
+    ROOT_FRAME;
+    ROOT(fill);
+    Object *v = allocate(VECTOR, VECTOR_SIZE(n));
+    v->nelems = n;
+    for (int i = 0; i < n; i++)
+        v->elems[i] = fill;
+    return v;
+}
+
+// Returns an integer vector of n zeros.
+static Object *make_int_vector(int64_t n)
+{
+    if (n < 0 || INTVECTOR_MAX < n)
+        error("Invalid vector length: %" PRId64, n);
+    Object *v = allocate(INTVECTOR, INTVECTOR_SIZE(n));
+    v->nints = n;
+    memset(v->ints, 0, sizeof(int64_t) * n);
+    return v;
+}
+
+static Object *make_string(char *bytes, size_t n)
+{
+    if (STRING_MAX < n)
+        error("String too long");
+    Object *str = allocate(STRING, STRING_SIZE(n));
+    str->nbytes = n;
+    memcpy(str->bytes, bytes, n);
+    return str;
+}
+
+static Object *make_condition(char *message)
+{
+    size_t len = strlen(message);
+    Object *c = allocate(CONDITION, CONDITION_SIZE(len));
+    c->nbytes = len;
+    memcpy(c->message, message, len + 1);
+    return c;
+}
+
+// Returns a special form if fn is given, or a primitive taking evaluated arguments otherwise.
+static Object *make_primitive(Primitive *fn, Builtin *builtin)
+{
+    Object *r = allocate(PRIMITIVE, PRIMITIVE_SIZE);
+    r->special = fn != NULL;
+    r->prim_prof = 0;
+    if (fn)
+        r->fn = fn;
+    else
+        r->builtin = builtin;
+    return r;
+}
+
+static Object *make_function(int type, Object *params, Object *body, Object *env, int nparams, int nslots)
+{
+    assert(type == FUNCTION || type == MACRO);
+    if (!has_room(FUNCTION_SIZE))
+    {
+        ROOT_FRAME;
+        ROOT(params);
+        ROOT(body);
+        ROOT(env);
+        gc(FUNCTION_SIZE);
+    }
+    Object *r = bump(type, FUNCTION_SIZE);
+    r->params = params;
+    r->body = body;
+    r->env = env;
+    r->code = NULL;
+    r->nparams = nparams;
+    r->nslots = nslots;
+    r->prof = PROFILING ? new_profile_id() : 0;
+    return r;
+}
+
+// Returns a closure of the function template over env.
+static Object *make_closure(Object *tmpl, Object *env)
+{
+    if (!has_room(FUNCTION_SIZE))
+    {
+        ROOT_FRAME;
+        ROOT(tmpl);
+        ROOT(env);
+        gc(FUNCTION_SIZE);
+    }
+    Object *r = bump(tmpl->type, FUNCTION_SIZE);
+    r->params = tmpl->params;
+    r->body = tmpl->body;
+    r->env = env;
+    r->code = tmpl->code;
+    r->nparams = tmpl->nparams;
+    r->nslots = tmpl->nslots;
+    r->prof = tmpl->prof;
+    return r;
+}
+
+// Returns a new frame of nslots unbound slots.
+static Object *make_env(int nslots, Object *up)
+{
+    size_t size = ENV_SIZE(nslots);
+    if (!has_room(size))
+    {
+        ROOT_FRAME;
+        ROOT(up);
+        gc(size);
+    }
+    Object *r = bump(ENV, size);
+    r->nvars = nslots;
+    r->up = up;
+    for (int i = 0; i < nslots; i++)
+        r->slots[i] = NULL;
+    return r;
+}
+
+static Object *make_lvar(Object *sym, int depth, int index)
+{
+    ROOT_FRAME;
+    ROOT(sym);
+    Object *r = allocate(LVAR, LVAR_SIZE);
+    r->sym = sym;
+    r->depth = depth;
+    r->index = index;
+    return r;
+}
+
+// Returns a code object with room for nconsts constants and ninsns instructions.
+static Object *make_code(int nconsts, int ninsns, int maxstack)
+{
+    Object *r = allocate(CODE, CODE_SIZE(nconsts, ninsns));
+    r->nconsts = nconsts;
+    r->ninsns = ninsns;
+    r->maxstack = maxstack;
+    r->ncalls = 0;
+    r->native = NULL;
+    return r;
+}
+
+static inline uint32_t *code_insns(Object *code)
+{
+    return (uint32_t *)(code->consts + code->nconsts);
+}
+
+static Object *cons(Object *car, Object *cdr)
+{
+    if (!has_room(CELL_SIZE))
+    {
+        ROOT_FRAME;
+        ROOT(car);
+        ROOT(cdr);
+        gc(CELL_SIZE);
     }
+    Object *cell = bump(CELL, CELL_SIZE);
+    cell->car = car;
+    cell->cdr = cdr;
+    return cell;
+}
+
+//======================================================================
+// Bignums
+//======================================================================
+
+// The arithmetic on bignums works on magnitudes in malloc'ed buffers and allocates no Lisp object
+// until the result is boxed by make_integer(). Multiplication uses Karatsuba's algorithm above
+// KARATSUBA_THRESHOLD limbs. Decimal conversion splits a number in halves, converts them and
+// combines them with a multiplication in the other radix, so with Karatsuba multiplication in radix
+// 10^18 both printing and reading take subquadratic time.
+
+typedef uint64_t Limb;
+
+// A signed integer of n limbs, least significant first. A result has no leading zero limbs.
+typedef struct
+{
+    Limb *d;
+    int n;
+    bool neg;
+} Big;
+
+#define KARATSUBA_THRESHOLD 32
+
+// The largest bignum, whose size is kept within an int
+#define BIGNUM_MAX ((INT_MAX - (int)sizeof(Object)) / (int)sizeof(Limb))
+
+// The limbs of a radix of decimal conversion
+#define DECIMAL_RADIX 1000000000000000000ull
+#define DECIMAL_DIGITS 18
+
+static Limb *alloc_limbs(size_t n)
+{
+    Limb *d = malloc(sizeof(Limb) * (n ? n : 1));
+    if (!d)
+        error("Memory exhausted");
+    return d;
+}
+
+// Returns the length of the n limbs at d without the leading zeros.
+static inline int limbs_len(const Limb *d, int n)
+{
+    while (n > 0 && d[n - 1] == 0)
+        n--;
+    return n;
 }
+
+// Compares two magnitudes without leading zeros.
+static int compare_limbs(const Limb *a, int an, const Limb *b, int bn)
+{
+    if (an != bn)
+        return an < bn ? -1 : 1;
+    for (int i = an - 1; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+// The limb operations of a radix. For an >= bn, add and sub store the an limbs of a + b and a - b
+// in r, which may be a, and return the carry or the borrow. mul stores the an + bn limbs of a * b
+// in r, which must not overlap a or b, by the schoolbook method. set stores a 64-bit number in r
+// and returns the number of limbs it takes.
+typedef struct
+{
+    Limb (*add)(Limb *r, const Limb *a, int an, const Limb *b, int bn);
+    Limb (*sub)(Limb *r, const Limb *a, int an, const Limb *b, int bn);
+    void (*mul)(Limb *r, const Limb *a, int an, const Limb *b, int bn);
+    int (*set)(Limb *r, uint64_t x);
+} Radix;
+
+static Limb add_binary(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    Limb c = 0;
+    for (int i = 0; i < bn; i++)
+    {
+        unsigned __int128 t = (unsigned __int128)a[i] + b[i] + c;
+        r[i] = t;
+        c = t >> 64;
+    }
+    for (int i = bn; i < an; i++)
+    {
+        r[i] = a[i] + c;
+        c = r[i] < c;
+    }
+    return c;
+}
+
+static Limb sub_binary(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    Limb borrow = 0;
+    for (int i = 0; i < bn; i++)
+    {
+        Limb x = a[i], t = x - b[i];
+        r[i] = t - borrow;
+        borrow = (x < b[i]) | (t < borrow);
+    }
+    for (int i = bn; i < an; i++)
+    {
+        Limb x = a[i];
+        r[i] = x - borrow;
+        borrow = x < borrow;
+    }
+    return borrow;
+}
+
+static void mul_binary(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    memset(r, 0, sizeof(Limb) * (an + bn));
+    for (int j = 0; j < bn; j++)
+    {
+        Limb c = 0;
+        for (int i = 0; i < an; i++)
+        {
+            unsigned __int128 t = (unsigned __int128)a[i] * b[j] + r[i + j] + c;
+            r[i + j] = t;
+            c = t >> 64;
+        }
+        r[j + an] = c;
+    }
+}
+
+static int set_binary(Limb *r, uint64_t x)
+{
+    r[0] = x;
+    return 1;
+}
+
+static Limb add_decimal(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    Limb c = 0;
+    for (int i = 0; i < an; i++)
+    {
+        Limb t = a[i] + (i < bn ? b[i] : 0) + c;
+        c = t >= DECIMAL_RADIX;
+        r[i] = c ? t - DECIMAL_RADIX : t;
+    }
+    return c;
+}
+
+static Limb sub_decimal(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    Limb borrow = 0;
+    for (int i = 0; i < an; i++)
+    {
+        Limb x = a[i], y = (i < bn ? b[i] : 0) + borrow;
+        borrow = x < y;
+        r[i] = borrow ? x + DECIMAL_RADIX - y : x - y;
+    }
+    return borrow;
+}
+
+// Sums the products of each column before carrying, which divides only once per limb of the
+// result. A column has at most bn products below 10^36, so the sum fits in 128 bits as long as bn
+// is smaller than KARATSUBA_THRESHOLD.
+static void mul_decimal(Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    if (an < bn)
+    {
+        mul_decimal(r, b, bn, a, an);
+        return;
+    }
+    unsigned __int128 acc = 0;
+    for (int k = 0; k < an + bn - 1; k++)
+    {
+        int lo = k < an ? 0 : k - an + 1, hi = k < bn ? k : bn - 1;
+        for (int j = lo; j <= hi; j++)
+            acc += (unsigned __int128)a[k - j] * b[j];
+        r[k] = acc % DECIMAL_RADIX;
+        acc /= DECIMAL_RADIX;
+    }
+    r[an + bn - 1] = acc;
+}
+
+static int set_decimal(Limb *r, uint64_t x)
+{
+    r[0] = x % DECIMAL_RADIX;
+    r[1] = x / DECIMAL_RADIX;
+    return r[1] ? 2 : 1;
+}
+
+static const Radix binary_radix = {add_binary, sub_binary, mul_binary, set_binary};
+static const Radix decimal_radix = {add_decimal, sub_decimal, mul_decimal, set_decimal};
+
+// Stores the an + bn limbs of a * b in r, which must not overlap a or b. an and bn must be positive.
+static void mul_limbs(const Radix *radix, Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    if (an < bn)
+    {
+        const Limb *t = a;
+        a = b;
+        b = t;
+        int tn = an;
+        an = bn;
+        bn = tn;
+    }
+    if (bn < KARATSUBA_THRESHOLD)
+    {
+        radix->mul(r, a, an, b, bn);
+        return;
+    }
+
+    // Split a into a1 R^h + a0. If b is no longer than a0, a * b = a1 b R^h + a0 b.
+    int h = (an + 1) / 2;
+    if (bn <= h)
+    {
+        Limb *t = alloc_limbs(an - h + bn);
+        mul_limbs(radix, r, a, h, b, bn);
+        mul_limbs(radix, t, a + h, an - h, b, bn);
+        memset(r + h + bn, 0, sizeof(Limb) * (an - h));
+        radix->add(r + h, r + h, an + bn - h, t, an - h + bn);
+        free(t);
+        return;
+    }
+
+    // Otherwise, split b into b1 R^h + b0 too. With z0 = a0 b0, z2 = a1 b1 and
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2, a * b = z2 R^2h + z1 R^h + z0.
+    int an1 = an - h, bn1 = bn - h;
+    Limb *t = alloc_limbs(4 * h + 4);
+    Limb *sa = t, *sb = t + h + 1, *z1 = t + 2 * h + 2;
+    sa[h] = radix->add(sa, a, h, a + h, an1);
+    sb[h] = radix->add(sb, b, h, b + h, bn1);
+    mul_limbs(radix, z1, sa, h + 1, sb, h + 1);
+    mul_limbs(radix, r, a, h, b, h);
+    mul_limbs(radix, r + 2 * h, a + h, an1, b + h, bn1);
+    radix->sub(z1, z1, 2 * h + 2, r, 2 * h);
+    radix->sub(z1, z1, 2 * h + 2, r + 2 * h, an1 + bn1);
+    radix->add(r + h, r + h, an + bn - h, z1, limbs_len(z1, 2 * h + 2));
+    free(t);
+}
+
+// Stores the an - bn + 1 limbs of the quotient of a by b in q and the bn limbs of the remainder in
+// r, for an >= bn > 0 and b without leading zeros. This is Knuth's algorithm D.
+static void divmod_limbs(Limb *q, Limb *r, const Limb *a, int an, const Limb *b, int bn)
+{
+    if (bn == 1)
+    {
+        unsigned __int128 rem = 0;
+        for (int i = an - 1; i >= 0; i--)
+        {
+            rem = rem << 64 | a[i];
+            q[i] = rem / b[0];
+            rem %= b[0];
+        }
+        r[0] = rem;
+        return;
+    }
+
+    // Normalize the divisor so that its top bit is set, which keeps each estimate of a quotient
+    // limb at most two off.
+    int s = __builtin_clzll(b[bn - 1]);
+    Limb *v = alloc_limbs(bn), *u = alloc_limbs(an + 1);
+    for (int i = bn - 1; i >= 0; i--)
+        v[i] = b[i] << s | (s && i > 0 ? b[i - 1] >> (64 - s) : 0);
+    u[an] = s ? a[an - 1] >> (64 - s) : 0;
+    for (int i = an - 1; i >= 0; i--)
+        u[i] = a[i] << s | (s && i > 0 ? a[i - 1] >> (64 - s) : 0);
+
+    for (int j = an - bn; j >= 0; j--)
+    {
+        unsigned __int128 num = (unsigned __int128)u[j + bn] << 64 | u[j + bn - 1];
+        unsigned __int128 qhat = num / v[bn - 1], rhat = num % v[bn - 1];
+        while (qhat >> 64 || qhat * v[bn - 2] > (rhat << 64 | u[j + bn - 2]))
+        {
+            qhat--;
+            rhat += v[bn - 1];
+            if (rhat >> 64)
+                break;
+        }
+
+        // Subtract qhat v from the current part of u.
+        Limb borrow = 0, carry = 0;
+        for (int i = 0; i < bn; i++)
+        {
+            unsigned __int128 p = qhat * v[i] + carry;
+            carry = p >> 64;
+            Limb x = u[i + j], t = x - (Limb)p;
+            u[i + j] = t - borrow;
+            borrow = (x < (Limb)p) | (t < borrow);
+        }
+        Limb x = u[j + bn], t = x - carry;
+        u[j + bn] = t - borrow;
+        if ((x < carry) | (t < borrow))
+        {
+            // qhat was one too large; add v back.
+            qhat--;
+            u[j + bn] += add_binary(u + j, u + j, bn, v, bn);
+        }
+        q[j] = qhat;
+    }
+
+    for (int i = 0; i < bn; i++)
+        r[i] = u[i] >> s | (s && i + 1 < bn ? u[i + 1] << (64 - s) : 0);
+    free(u);
+    free(v);
+}
+
+// Returns the integer obj as a Big. The magnitude of a fixnum or an INTEGER is stored in small; that
+// of a bignum stays in the object, and is valid only until the next allocation.
+static Big big_view(Object *obj, Limb *small)
+{
+    if (type_of(obj) == BIGNUM)
+        return (Big){obj->limbs, abs(obj->nlimbs), obj->nlimbs < 0};
+    int64_t v = int_value(obj);
+    *small = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    return (Big){small, v != 0, v < 0};
+}
+
+static Big big_finish(Big r)
+{
+    r.n = limbs_len(r.d, r.n);
+    if (r.n == 0)
+        r.neg = false;
+    return r;
+}
+
+// Returns a + b, or a - b if negate is true.
+static Big big_add(Big a, Big b, bool negate)
+{
+    b.neg ^= negate;
+    if (compare_limbs(a.d, a.n, b.d, b.n) < 0)
+    {
+        Big t = a;
+        a = b;
+        b = t;
+    }
+    Big r = {alloc_limbs(a.n + 1), a.n + 1, a.neg};
+    if (a.neg == b.neg)
+        r.d[a.n] = add_binary(r.d, a.d, a.n, b.d, b.n);
+    else
+    {
+        sub_binary(r.d, a.d, a.n, b.d, b.n);
+        r.d[a.n] = 0;
+    }
+    return big_finish(r);
+}
+
+static Big big_mul(Big a, Big b)
+{
+    Big r = {alloc_limbs(a.n + b.n), a.n && b.n ? a.n + b.n : 0, a.neg != b.neg};
+    if (r.n)
+        mul_limbs(&binary_radix, r.d, a.d, a.n, b.d, b.n);
+    return big_finish(r);
+}
+
+// Stores the quotient of a by b, truncated toward zero, in q and the remainder, which has the sign
+// of a, in r. b must not be zero.
+static void big_divmod(Big a, Big b, Big *q, Big *r)
+{
+    if (compare_limbs(a.d, a.n, b.d, b.n) < 0)
+    {
+        *q = (Big){alloc_limbs(0), 0, false};
+        *r = (Big){alloc_limbs(a.n), a.n, a.neg};
+        memcpy(r->d, a.d, sizeof(Limb) * a.n);
+        return;
+    }
+    *q = (Big){alloc_limbs(a.n - b.n + 1), a.n - b.n + 1, a.neg != b.neg};
+    *r = (Big){alloc_limbs(b.n), b.n, a.neg};
+    divmod_limbs(q->d, r->d, a.d, a.n, b.d, b.n);
+    *q = big_finish(*q);
+    *r = big_finish(*r);
+}
+
+// Returns the integer a as a fixnum, an INTEGER or a BIGNUM, whichever is the smallest that holds
+// it, and frees the magnitude.
+static Object *make_integer(Big a)
+{
+    if (a.n <= 1)
+    {
+        uint64_t m = a.n ? a.d[0] : 0;
+        if (m <= INT64_MAX || (a.neg && m == (uint64_t)INT64_MAX + 1))
+        {
+            free(a.d);
+            return make_int(a.neg ? (int64_t)(0 - m) : (int64_t)m);
+        }
+    }
+    if (BIGNUM_MAX < a.n)
+    {
+        free(a.d);
+        error("Integer too large");
+    }
+    Object *r = allocate(BIGNUM, BIGNUM_SIZE(a.n));
+    r->nlimbs = a.neg ? -a.n : a.n;
+    memcpy(r->limbs, a.d, sizeof(Limb) * a.n);
+    free(a.d);
+    return r;
+}
+
+// Returns x + y, or x - y if negate is true.
+static Object *integer_add(Object *x, Object *y, bool negate)
+{
+    Limb sx, sy;
+    return make_integer(big_add(big_view(x, &sx), big_view(y, &sy), negate));
+}
+
+static Object *integer_mul(Object *x, Object *y)
+{
+    Limb sx, sy;
+    return make_integer(big_mul(big_view(x, &sx), big_view(y, &sy)));
+}
+
+// Returns the quotient of x by y rounded toward negative infinity, or if mod is true the remainder,
+// which has the sign of y.
+static Object *integer_div(Object *x, Object *y, bool mod)
+{
+    Limb sx, sy;
+    Big a = big_view(x, &sx), b = big_view(y, &sy), q, r;
+    if (b.n == 0)
+        error("Division by zero");
+    big_divmod(a, b, &q, &r);
+    // The truncated quotient is one too high when the remainder has the other sign than y.
+    bool below = r.n && r.neg != b.neg;
+    if (!mod)
+    {
+        free(r.d);
+        if (below)
+        {
+            Limb one = 1;
+            Big t = big_add(q, (Big){&one, 1, false}, true);
+            free(q.d);
+            q = t;
+        }
+        return make_integer(q);
+    }
+    free(q.d);
+    if (below)
+    {
+        Big t = big_add(r, b, false);
+        free(r.d);
+        r = t;
+    }
+    return make_integer(r);
+}
+
+// Compares two integers.
+static int integer_compare(Object *x, Object *y)
+{
+    if (type_of(x) != BIGNUM && type_of(y) != BIGNUM)
+        return int_value(x) < int_value(y) ? -1 : int_value(x) > int_value(y);
+    Limb sx, sy;
+    Big a = big_view(x, &sx), b = big_view(y, &sy);
+    if (a.neg != b.neg)
+        return a.neg ? -1 : 1;
+    int c = compare_limbs(a.d, a.n, b.d, b.n);
+    return a.neg ? -c : c;
+}
+
+// The state of a conversion between radixes. pow[k] holds the source radix to the power of 2^k in
+// the target radix; pow[0] is set up by the caller, and the others are computed on demand.
+#define CONVERT_THRESHOLD 32
+
+typedef struct
+{
+    const Radix *to;
+    Big pow[32];
+    int npow;
+} Conversion;
+
+static Big convert_power(Conversion *cv, int k)
+{
+    while (cv->npow <= k)
+    {
+        Big p = cv->pow[cv->npow - 1];
+        Big sq = {alloc_limbs(2 * p.n), 2 * p.n, false};
+        mul_limbs(cv->to, sq.d, p.d, p.n, p.d, p.n);
+        cv->pow[cv->npow++] = big_finish(sq);
+    }
+    return cv->pow[k];
+}
+
+// Returns the an limbs at a in the target radix.
+static Big convert_limbs(Conversion *cv, const Limb *a, int an)
+{
+    an = limbs_len(a, an);
+    if (an <= CONVERT_THRESHOLD)
+    {
+        // Horner's rule: r = r R + a[i] from the top limb down
+        Big p = cv->pow[0];
+        Limb *r = alloc_limbs(2 * an + 2), *t = alloc_limbs(2 * an + 2), digit[2];
+        int rn = 0;
+        for (int i = an - 1; i >= 0; i--)
+        {
+            int tn = 2;
+            if (rn)
+            {
+                mul_limbs(cv->to, t, r, rn, p.d, p.n);
+                tn = rn + p.n;
+            }
+            else
+                t[0] = t[1] = 0;
+            int dn = cv->to->set(digit, a[i]);
+            cv->to->add(t, t, tn, digit, dn);
+            rn = limbs_len(t, tn);
+            Limb *s = r;
+            r = t;
+            t = s;
+        }
+        free(t);
+        return (Big){r, rn, false};
+    }
+
+    // Split a into hi R^h + lo for the largest power of two h below an.
+    int k = 0;
+    while ((2 << k) < an)
+        k++;
+    int h = 1 << k;
+    Big lo = convert_limbs(cv, a, h), hi = convert_limbs(cv, a + h, an - h), p = convert_power(cv, k);
+    Big r = {alloc_limbs(hi.n + p.n), hi.n + p.n, false};
+    mul_limbs(cv->to, r.d, hi.d, hi.n, p.d, p.n);
+    if (lo.n)
+        cv->to->add(r.d, r.d, r.n, lo.d, lo.n);
+    free(lo.d);
+    free(hi.d);
+    return big_finish(r);
+}
+
+static Big convert(const Radix *to, const Big *radix, const Limb *a, int an)
+{
+    Conversion cv = {to, {{alloc_limbs(radix->n), radix->n, false}}, 1};
+    memcpy(cv.pow[0].d, radix->d, sizeof(Limb) * radix->n);
+    Big r = convert_limbs(&cv, a, an);
+    for (int i = 0; i < cv.npow; i++)
+        free(cv.pow[i].d);
+    return r;
+}
+
+// Returns the decimal digits of the magnitude of a as a malloc'ed string.
+static char *decimal_string(Big a)
+{
+    // 2^64 in radix 10^18
+    static Limb two64[] = {446744073709551616ull, 18};
+    Big d = convert(&decimal_radix, &(Big){two64, 2, false}, a.d, a.n);
+    char *s = malloc((size_t)d.n * DECIMAL_DIGITS + 2);
+    if (!s)
+        error("Memory exhausted");
+    char *p = s + sprintf(s, "%" PRIu64, d.n ? d.d[d.n - 1] : 0);
+    for (int i = d.n - 2; i >= 0; i--)
+        p += sprintf(p, "%0*" PRIu64, DECIMAL_DIGITS, d.d[i]);
+    free(d.d);
+    return s;
+}
+
+// Returns the integer of the n decimal digits.
+static Object *parse_integer(const char *digits, size_t n, bool neg)
+{
+    size_t nlimbs = (n + DECIMAL_DIGITS - 1) / DECIMAL_DIGITS;
+    if (BIGNUM_MAX < nlimbs)
+        error("Number too large");
+    Limb *a = alloc_limbs(nlimbs);
+    for (size_t i = 0; i < nlimbs; i++)
+    {
+        size_t end = n - i * DECIMAL_DIGITS, start = end < DECIMAL_DIGITS ? 0 : end - DECIMAL_DIGITS;
+        Limb v = 0;
+        for (size_t j = start; j < end; j++)
+            v = v * 10 + (digits[j] - '0');
+        a[i] = v;
+    }
+    Big r = convert(&binary_radix, &(Big){(Limb[]){DECIMAL_RADIX}, 1, false}, a, nlimbs);
+    free(a);
+    r.neg = neg && r.n;
+    return make_integer(r);
+}
+
+//======================================================================
+// Output
+//======================================================================
+
+// The standard output is written through a buffer of our own. In line mode, which is the default for
+// a terminal, the buffer is flushed at every newline so that the REPL shows each result right away;
+// otherwise it's flushed only when it fills up. Set by --flush.
+#define OUTPUT_BUFFER_SIZE 65536
+
+static struct
+{
+    char buf[OUTPUT_BUFFER_SIZE];
+    size_t len;
+    bool line;
+} output;
+
+// Held while a value is printed, so that the output of threads doesn't interleave.
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void out_flush(void)
+{
+    for (char *p = output.buf; output.len;)
+    {
+        ssize_t n = write(STDOUT_FILENO, p, output.len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            // Don't call error(); it flushes the output.
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        output.len -= n;
+    }
+}
+
+static inline void out_char(char c)
+{
+    if (output.len == OUTPUT_BUFFER_SIZE)
+        out_flush();
+    output.buf[output.len++] = c;
+    if (c == '\n' && output.line)
+        out_flush();
+}
+
+static void out_bytes(const char *s, size_t n)
+{
+    while (n)
+    {
+        if (output.len == OUTPUT_BUFFER_SIZE)
+            out_flush();
+        size_t k = OUTPUT_BUFFER_SIZE - output.len;
+        if (k > n)
+            k = n;
+        memcpy(output.buf + output.len, s, k);
+        output.len += k;
+        s += k;
+        n -= k;
+    }
+}
+
+static void out_str(const char *s)
+{
+    out_bytes(s, strlen(s));
+}
+
+static void out_int(int64_t v)
+{
+    // Digits are generated from the end. The magnitude is taken as unsigned so INT64_MIN works.
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    if (OUTPUT_BUFFER_SIZE - output.len < sizeof(digits))
+        out_flush();
+    memcpy(output.buf + output.len, p, digits + sizeof(digits) - p);
+    output.len += digits + sizeof(digits) - p;
+}
+
+//======================================================================
+// Profiler
+//======================================================================
+
+// With --profile, every call of a function or a primitive is timed and recorded in the call tree of
+// the thread, under the calls in progress. Calls of the arithmetic primitives that the VM computes
+// inline are not counted. A thread's tree is merged into the interpreter's when the thread exits.
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the child of parent for the function id, which is added if there is none. The child is
+// moved to the front of the list so that repeated calls find it first.
+static ProfNode *profile_child(ProfTree *t, ProfNode *parent, int id)
+{
+    for (ProfNode **p = &parent->child; *p; p = &(*p)->sibling)
+    {
+        ProfNode *n = *p;
+        if (n->id == id)
+        {
+            *p = n->sibling;
+            n->sibling = parent->child;
+            parent->child = n;
+            return n;
+        }
+    }
+    if (!t->blocks || t->blocks->nused == PROF_BLOCK_SIZE)
+    {
+        ProfBlock *b = malloc(sizeof(ProfBlock));
+        if (!b)
+            error("Memory exhausted");
+        b->next = t->blocks;
+        b->nused = 0;
+        t->blocks = b;
+    }
+    ProfNode *n = &t->blocks->nodes[t->blocks->nused++];
+    *n = (ProfNode){id, parent, NULL, parent->child, 0, 0, 0};
+    parent->child = n;
+    return n;
+}
+
+static void profile_free(ProfTree *t)
+{
+    while (t->blocks)
+    {
+        ProfBlock *b = t->blocks;
+        t->blocks = b->next;
+        free(b);
+    }
+    t->root.child = NULL;
+}
+
+// Primitives are profiled by their C function, so that the copies that try expands to share the id
+// of the primitive bound to catch. The symbol table is searched for the named one. The lock is only
+// tried, since its holder may be waiting for this thread to stop for GC.
+static int primitive_profile_id(Object *prim)
+{
+    Object *named = NULL;
+    if (pthread_mutex_trylock(&lispy->symbols_lock) != 0)
+        return new_profile_id();
+    for (size_t i = 0; i < lispy->symbols_cap && !named; i++)
+    {
+        Object *sym = lispy->symbols[i];
+        if (sym && sym->global && type_of(sym->global) == PRIMITIVE && sym->global->builtin == prim->builtin)
+            named = sym->global;
+    }
+    pthread_mutex_unlock(&lispy->symbols_lock);
+    if (named && named->prim_prof)
+        return named->prim_prof;
+    int id = new_profile_id();
+    if (named)
+        named->prim_prof = id;
+    return id;
+}
+
+// Returns the profile id of the function, or 0 if it is not a function. Functions that were created
+// before profiling started get an id on their first call.
+static int profile_id(Object *fn)
+{
+    if (type_of(fn) == FUNCTION)
+    {
+        if (!fn->prof)
+            fn->prof = new_profile_id();
+        return fn->prof;
+    }
+    if (type_of(fn) == PRIMITIVE)
+    {
+        if (!fn->prim_prof)
+            fn->prim_prof = primitive_profile_id(fn);
+        return fn->prim_prof;
+    }
+    return 0;
+}
+
+// Records the start of a call of fn. Returns the number of calls in progress before it.
+static int profile_enter(Object *fn)
+{
+    int depth = ctx->prof_depth;
+    if (depth == ctx->prof_cap)
+    {
+        int cap = ctx->prof_cap ? ctx->prof_cap * 2 : 256;
+        ProfFrame *stack = realloc(ctx->prof_stack, sizeof(ProfFrame) * cap);
+        if (!stack)
+            error("Memory exhausted");
+        ctx->prof_stack = stack;
+        ctx->prof_cap = cap;
+    }
+    ProfNode *parent = depth ? ctx->prof_stack[depth - 1].node : &ctx->profile.root;
+    ProfNode *n = profile_child(&ctx->profile, parent, profile_id(fn));
+    n->calls++;
+    ctx->prof_stack[depth] = (ProfFrame){n, now_ns(), 0};
+    ctx->prof_depth++;
+    return depth;
+}
+
+// Records the end of the innermost call in progress.
+static void profile_exit(void)
+{
+    ProfFrame *f = &ctx->prof_stack[--ctx->prof_depth];
+    uint64_t t = now_ns() - f->start;
+    f->node->total_ns += t;
+    f->node->self_ns += t - f->children_ns;
+    if (ctx->prof_depth)
+        ctx->prof_stack[ctx->prof_depth - 1].children_ns += t;
+}
+
+// Ends the calls in progress down to the given depth.
+static void profile_unwind(int depth)
+{
+    while (depth < ctx->prof_depth)
+        profile_exit();
+}
+
+// Records that the function running above depth, if any, has tail-called fn.
+static void profile_tail_call(int depth, Object *fn)
+{
+    if (depth < ctx->prof_depth)
+        profile_exit();
+    profile_enter(fn);
+}
+
+// The trees are walked in pre-order without recursion, following the parent links on the way back,
+// since they are as deep as the deepest recursion of the program.
+static void profile_merge(ProfTree *dst, ProfTree *src)
+{
+    ProfNode *d = &dst->root;
+    for (ProfNode *n = src->root.child; n;)
+    {
+        d = profile_child(dst, d, n->id);
+        d->calls += n->calls;
+        d->total_ns += n->total_ns;
+        d->self_ns += n->self_ns;
+        if (n->child)
+        {
+            n = n->child;
+            continue;
+        }
+        for (;;)
+        {
+            d = d->parent;
+            if (n->sibling)
+            {
+                n = n->sibling;
+                break;
+            }
+            n = n->parent;
+            if (n == &src->root)
+            {
+                n = NULL;
+                break;
+            }
+        }
+    }
+}
+
+typedef struct ProfSum
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t self_ns;
+} ProfSum;
+
+// Adds the numbers of the tree to the sums by function. The time of a recursive call is already
+// part of the total of the outermost call of the same function, so it's not added again.
+static void profile_sum(ProfTree *t, ProfSum *sums, int *active)
+{
+    for (ProfNode *n = t->root.child; n;)
+    {
+        ProfSum *s = &sums[n->id];
+        s->calls += n->calls;
+        s->self_ns += n->self_ns;
+        if (active[n->id]++ == 0)
+            s->total_ns += n->total_ns;
+        if (n->child)
+        {
+            n = n->child;
+            continue;
+        }
+        for (;;)
+        {
+            active[n->id]--;
+            if (n->sibling)
+            {
+                n = n->sibling;
+                break;
+            }
+            n = n->parent;
+            if (n == &t->root)
+            {
+                n = NULL;
+                break;
+            }
+        }
+    }
+}
+
+// Returns the names of the profile ids, taken from the global variables bound to the functions.
+// Functions not bound to any are anonymous, and their names are NULL.
+static char **profile_names(void)
+{
+    char **names = calloc(lispy->nprofiled + 1, sizeof(char *));
+    if (!names)
+        error("Memory exhausted");
+    for (size_t i = 0; i < lispy->symbols_cap; i++)
+    {
+        Object *sym = lispy->symbols[i];
+        if (!sym || !sym->global)
+            continue;
+        int id = type_of(sym->global) == FUNCTION    ? sym->global->prof
+                 : type_of(sym->global) == PRIMITIVE ? sym->global->prim_prof
+                                                     : 0;
+        if (0 < id && id <= lispy->nprofiled && !names[id])
+            names[id] = sym->name;
+    }
+    return names;
+}
+
+static const char *profile_name(char **names, int id, char *buf, size_t size)
+{
+    if (names[id])
+        return names[id];
+    snprintf(buf, size, id ? "lambda-%d" : "?", id);
+    return buf;
+}
+
+static const char *type_names[NTYPES] = {
+    [INTEGER] = "integer",
+    [CELL] = "cell",
+    [SYMBOL] = "symbol",
+    [PRIMITIVE] = "primitive",
+    [FUNCTION] = "function",
+    [MACRO] = "macro",
+    [CONDITION] = "condition",
+    [VECTOR] = "vector",
+    [STRING] = "string",
+    [INTVECTOR] = "intvector",
+    [BIGNUM] = "bignum",
+    [KEYWORD] = "keyword",
+    [ENV] = "env",
+    [LVAR] = "lvar",
+    [CODE] = "code",
+};
+
+// The sums that compare_self() sorts by
+static __thread ProfSum *sorted_sums;
+
+static int compare_self(const void *x, const void *y)
+{
+    uint64_t a = sorted_sums[*(const int *)x].self_ns, b = sorted_sums[*(const int *)y].self_ns;
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+// Writes the calls by function, sorted by self time, and the allocations by type. The calls of
+// the thread that are still in progress are left out. Other threads are included once they have
+// exited.
+static void print_stats(FILE *fp)
+{
+    uint64_t nallocs = lispy->nallocs_exited;
+    for (Context *c = lispy->contexts; c; c = c->next)
+        nallocs += c->nallocs;
+    fprintf(fp, "objects allocated: %" PRIu64 "\n", nallocs);
+    if (!profiling)
+    {
+        fprintf(fp, "run with --profile for calls and allocations by type\n");
+        return;
+    }
+
+    int n = lispy->nprofiled;
+    ProfSum *sums = calloc(n + 1, sizeof(ProfSum));
+    int *active = calloc(n + 1, sizeof(int));
+    int *order = malloc(sizeof(int) * (n + 1));
+    if (!sums || !active || !order)
+        error("Memory exhausted");
+    profile_sum(&ctx->profile, sums, active);
+    profile_sum(&lispy->profile_exited, sums, active);
+    int norder = 0;
+    for (int i = 0; i <= n; i++)
+        if (sums[i].calls)
+            order[norder++] = i;
+    sorted_sums = sums;
+    qsort(order, norder, sizeof(int), compare_self);
+
+    char **names = profile_names();
+    char buf[32];
+    fprintf(fp, "%-32s %12s %14s %14s\n", "function", "calls", "total ms", "self ms");
+    for (int i = 0; i < norder; i++)
+    {
+        ProfSum *s = &sums[order[i]];
+        fprintf(fp, "%-32s %12" PRIu64 " %14.3f %14.3f\n", profile_name(names, order[i], buf, sizeof(buf)),
+                s->calls, s->total_ns / 1e6, s->self_ns / 1e6);
+    }
+    fprintf(fp, "%-32s %12s %14s\n", "type", "objects", "bytes");
+    for (int i = 0; i < NTYPES; i++)
+    {
+        uint64_t objects = ctx->alloc_objects[i] + lispy->alloc_objects_exited[i];
+        uint64_t bytes = ctx->alloc_bytes[i] + lispy->alloc_bytes_exited[i];
+        if (objects)
+            fprintf(fp, "%-32s %12" PRIu64 " %14" PRIu64 "\n", type_names[i], objects, bytes);
+    }
+    fprintf(fp, "%-32s %12s %14s %14s\n", "collection", "count", "total ms", "max ms");
+    for (int i = 0; i < 2; i++)
+        if (lispy->ngcs[i])
+            fprintf(fp, "%-32s %12" PRIu64 " %14.3f %14.3f\n", i ? "major" : "minor", lispy->ngcs[i],
+                    lispy->gc_ns[i] / 1e6, lispy->gc_max_ns[i] / 1e6);
+    free(names);
+    free(order);
+    free(active);
+    free(sums);
+}
+
+//======================================================================
+// Parser
+//======================================================================
+
+static Object *read_expr(void);
+
+static void error(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (ctx && ctx->handler)
+    {
+        Handler *h = ctx->handler;
+        vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+        va_end(ap);
+        if (PROFILING)
+            profile_unwind(h->prof_depth);
+        ctx->nroots = h->nroots;
+        ctx->vm_sp = h->vm_sp;
+        ctx->vm_nframes = h->vm_nframes;
+        ctx->eval_depth = h->eval_depth;
+        longjmp(h->buf, 1);
+    }
+    out_flush();
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+// The reader works on an in-memory buffer. A regular file is mapped into memory as a whole. Any
+// other input, such as a pipe or a terminal, is read in blocks as the reader runs out of
+// characters, so the REPL still evaluates each form as soon as it has been typed.
+#define INPUT_BLOCK_SIZE (1 << 16)
+
+typedef struct Input
+{
+    // The next character and the end of the buffered characters
+    char *p;
+    char *end;
+    // The block buffer, or NULL if the input is mapped
+    char *buf;
+    // The mapped file
+    char *map;
+    size_t map_size;
+    int fd;
+    // True if there is nothing to read beyond end
+    bool eof;
+} Input;
+
+static __thread Input input;
+
+static void open_input(Input *in, int fd)
+{
+    in->fd = fd;
+    in->buf = in->map = NULL;
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && 0 <= off && off < st.st_size)
+    {
+        char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED)
+        {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            in->buf = NULL;
+            in->map = m;
+            in->map_size = st.st_size;
+            in->p = m + off;
+            in->end = m + st.st_size;
+            in->eof = true;
+            return;
+        }
+    }
+    in->buf = malloc(INPUT_BLOCK_SIZE);
+    if (!in->buf)
+        error("Memory exhausted");
+    in->map = NULL;
+    in->p = in->end = in->buf;
+    in->eof = false;
+}
+
+// Reads from a NUL-terminated string.
+static void open_string(const char *src)
+{
+    input.buf = input.map = NULL;
+    input.p = (char *)src;
+    input.end = input.p + strlen(src);
+    input.eof = true;
+}
+
+static void close_input(void)
+{
+    if (input.map)
+        munmap(input.map, input.map_size);
+    free(input.buf);
+    input.buf = input.map = NULL;
+}
+
+// Reads the next block of the input. Returns false at the end of the input.
+static bool refill(Input *in)
+{
+    if (in->eof)
+        return false;
+    ssize_t n;
+    if (lispy->threads_started)
+        enter_safe_region();
+    do
+        n = read(in->fd, in->buf, INPUT_BLOCK_SIZE);
+    while (n < 0 && errno == EINTR);
+    if (lispy->threads_started)
+        leave_safe_region();
+    if (n < 0)
+        error("Read error: %s", strerror(errno));
+    if (n == 0)
+    {
+        in->eof = true;
+        return false;
+    }
+    in->p = in->buf;
+    in->end = in->buf + n;
+    return true;
+}
+
+static inline int peek(void)
+{
+    if (input.p == input.end && !refill(&input))
+        return EOF;
+    return (unsigned char)*input.p;
+}
+
+static inline int next_char(void)
+{
+    int c = peek();
+    if (c != EOF)
+        input.p++;
+    return c;
+}
+
+// Skips the input until newline is found.
+static void skip_line(void)
+{
+    for (;;)
+    {
+        char *p = input.p;
+        while (p < input.end && *p != '\n' && *p != '\r')
+            p++;
+        input.p = p;
+        int c = next_char();
+        if (c == EOF || c == '\n')
+            return;
+        if (c == '\r')
+        {
+            if (peek() == '\n')
+                input.p++;
+            return;
+        }
+    }
+}
+
+// Reads a list
+static Object *read_list(void)
+{
+    check_c_stack();
+    Object *obj = read_expr();
+    if (!obj)
+        error("Unclosed parenthesis");
+    if (obj == Dot)
+        error("Stray dot");
+    if (obj == Paren)
+        return Nil;
+    ROOT_FRAME;
+    Object *head, *tail;
+    head = tail = cons(obj, Nil);
+    ROOT(head);
+    ROOT(tail);
+
+    for (;;)
+    {
+        Object *obj = read_expr();
+        if (!obj)
+            error("Unclosed parenthesis");
+        if (obj == Paren)
+            return head;
+        if (obj == Dot)
+        {
+            Object *last = read_expr();
+            tail->cdr = last;
+            note_store(&tail->cdr);
+            if (read_expr() != Paren)
+                error("Closed parenthesis expected after dot");
+            return head;
+        }
+        Object *cell = cons(obj, Nil);
+        tail->cdr = cell;
+        note_store(&tail->cdr);
+        tail = cell;
+    }
+}
+
+// FNV-1a hash of a symbol name.
+static uint32_t hash_name(char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+// Doubles the capacity of the symbol table. Symbols keep their hashes, so nothing is recomputed.
+static void grow_symbols(void)
+{
+    size_t cap = lispy->symbols_cap ? lispy->symbols_cap * 2 : 256;
+    Object **table = calloc(cap, sizeof(Object *));
+    if (!table)
+        error("Memory exhausted");
+    for (size_t i = 0; i < lispy->symbols_cap; i++)
+    {
+        Object *sym = lispy->symbols[i];
+        if (!sym)
+            continue;
+        size_t j = sym->hash & (cap - 1);
+        while (table[j])
+            j = (j + 1) & (cap - 1);
+        table[j] = sym;
+    }
+    free(lispy->symbols);
+    lispy->symbols = table;
+    lispy->symbols_cap = cap;
+}
+
+// If there's a symbol with the same name, it will not create a new symbol but return the existing one. Otherwise create a new one.
+// The name does not need to be NUL-terminated.
+// Interning takes symbols_lock once the thread pool has started. The lock can be held across GC, so
+// threads wait for it in a safe region.
+static Object *intern_name_locked(char *name, size_t len);
+
+static Object *intern_name(char *name, size_t len)
+{
+    if (!lispy->threads_started)
+        return intern_name_locked(name, len);
+    enter_safe_region();
+    pthread_mutex_lock(&lispy->symbols_lock);
+    leave_safe_region();
+    Object *sym = intern_name_locked(name, len);
+    pthread_mutex_unlock(&lispy->symbols_lock);
+    return sym;
+}
+
+static Object *intern_name_locked(char *name, size_t len)
+{
+    uint32_t hash = hash_name(name, len);
+    size_t i = hash & (lispy->symbols_cap - 1);
+    for (; lispy->symbols[i]; i = (i + 1) & (lispy->symbols_cap - 1))
+    {
+        Object *sym = lispy->symbols[i];
+        if (sym->hash == hash && memcmp(name, sym->name, len) == 0 && sym->name[len] == '\0')
+            return sym;
+    }
+
+    // The slot stays valid across GC because the collector never rehashes the table.
+    Object *sym = make_symbol(name, len, hash);
+    lispy->symbols[i] = sym;
+    arena_note_store();
+
+    // Keep the load factor at or below 3/4.
+    if (++lispy->nsymbols * 4 > lispy->symbols_cap * 3)
+        grow_symbols();
+    return sym;
+}
+
+static Object *intern(char *name)
+{
+    return intern_name(name, strlen(name));
+}
+
+// Reads an expression and returns (quote <expr>).
+static Object *read_quote(void)
+{
+    ROOT_FRAME;
+    Object *sym = intern("quote");
+    ROOT(sym);
+    Object *expr = read_expr();
+    expr = cons(expr, Nil);
+    return cons(sym, expr);
+}
+
+// Reads an integer whose first digit has the value val. The digits are accumulated in an int64_t
+// until it overflows; then they are read into a string and converted to a bignum.
+static Object *read_number(int64_t val, bool neg)
+{
+    while (isdigit(peek()))
+    {
+        int64_t next;
+        int digit = peek() - '0';
+        if (__builtin_mul_overflow(val, 10, &next) || __builtin_add_overflow(next, digit, &next))
+            break;
+        next_char();
+        val = next;
+    }
+    if (!isdigit(peek()))
+        return make_int(neg ? -val : val);
+
+    size_t len = 0, cap = 64;
+    char *digits = malloc(cap);
+    if (!digits)
+        error("Memory exhausted");
+    len = sprintf(digits, "%" PRId64, val);
+    while (isdigit(peek()))
+    {
+        if (len == cap)
+        {
+            char *p = realloc(digits, cap *= 2);
+            if (!p)
+            {
+                free(digits);
+                error("Memory exhausted");
+            }
+            digits = p;
+        }
+        digits[len++] = next_char();
+    }
+    Object *r = parse_integer(digits, len, neg);
+    free(digits);
+    return r;
+}
+
+#define SYMBOL_MAX_LEN 200
+
+static inline bool is_symbol_char(int c)
+{
+    return isalnum(c) || (c > 0 && strchr("-+=!@#$%^&*<>/?_", c));
+}
+
+// Reads a symbol whose first character c has just been read.
+static Object *read_symbol(char c)
+{
+    // If the whole name is in the buffer, intern it right from there.
+    char *start = input.p - 1;
+    char *p = input.p;
+    while (p < input.end && is_symbol_char((unsigned char)*p))
+        p++;
+    if (p < input.end || input.eof)
+    {
+        if (SYMBOL_MAX_LEN < p - start)
+            error("Symbol name too long");
+        input.p = p;
+        return intern_name(start, p - start);
+    }
+
+    // Otherwise the name continues in the next block.
+    char buf[SYMBOL_MAX_LEN + 1];
+    int len = 1;
+    buf[0] = c;
+    while (is_symbol_char(peek()))
+    {
+        if (SYMBOL_MAX_LEN <= len)
+            error("Symbol name too long");
+        buf[len++] = next_char();
+    }
+    return intern_name(buf, len);
+}
+
+static int list_length(Object *list)
+{
+    int len = 0;
+    for (;;)
+    {
+        if (list == Nil)
+            return len;
+        if (type_of(list) != CELL)
+            error("Cannot handle dotted list");
+        list = list->cdr;
+        len++;
+    }
+}
+
+// Reads a string literal whose opening quote has just been read. The escapes are backslash followed
+// by n, t, r, 0, a backslash or a double quote.
+static Object *read_string(void)
+{
+    size_t len = 0, cap = 64;
+    char *buf = malloc(cap);
+    if (!buf)
+        error("Memory exhausted");
+    for (;;)
+    {
+        int c = next_char();
+        if (c == EOF)
+        {
+            free(buf);
+            error("Unterminated string");
+        }
+        if (c == '"')
+            break;
+        if (c == '\\')
+        {
+            c = next_char();
+            switch (c)
+            {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            case '\\':
+            case '"':
+                break;
+            default:
+                free(buf);
+                error("Unknown escape in string: \\%c", c);
+            }
+        }
+        if (len == cap)
+        {
+            char *p = realloc(buf, cap *= 2);
+            if (!p)
+            {
+                free(buf);
+                error("Memory exhausted");
+            }
+            buf = p;
+        }
+        buf[len++] = c;
+    }
+    Object *str = make_string(buf, len);
+    free(buf);
+    return str;
+}
+
+// Reads #(expr ...), whose "#(" has just been read. The elements are not evaluated.
+static Object *read_vector(void)
+{
+    ROOT_FRAME;
+    Object *list = read_list();
+    ROOT(list);
+    Object *v = make_vector(list_length(list), Nil);
+    for (int i = 0; list != Nil; list = list->cdr)
+        v->elems[i++] = list->car;
+    return v;
+}
+
+// Reads #i(<integer> ...), whose "#i(" has just been read.
+static Object *read_int_vector(void)
+{
+    ROOT_FRAME;
+    Object *list = read_list();
+    ROOT(list);
+    Object *v = make_int_vector(list_length(list));
+    for (int i = 0; list != Nil; list = list->cdr)
+    {
+        if (type_of(list->car) == BIGNUM)
+            error("#i(): integer out of range");
+        if (type_of(list->car) != INTEGER)
+            error("#i() takes only numbers");
+        v->ints[i++] = int_value(list->car);
+    }
+    return v;
+}
+
+static Object *read_expr(void)
+{
+    for (;;)
+    {
+        int c = next_char();
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+            continue;
+        if (c == EOF)
+            return NULL;
+        if (c == ';')
+        {
+            skip_line();
+            continue;
+        }
+        if (c == '(')
+            return read_list();
+        if (c == ')')
+            return Paren;
+        if (c == '.')
+            return Dot;
+        if (c == '\'')
+            return read_quote();
+        if (c == '"')
+            return read_string();
+        if (c == '#' && peek() == '(')
+        {
+            next_char();
+            return read_vector();
+        }
+        if (c == '#' && peek() == 'i')
+        {
+            next_char();
+            if (next_char() != '(')
+                error("Malformed #i");
+            return read_int_vector();
+        }
+        if (isdigit(c))
+            return read_number(c - '0', false);
+        if (c == '-' && isdigit(peek()))
+            return read_number(0, true);
+        if (is_symbol_char(c))
+            return read_symbol(c);
+        error("Unknown character: %c", c);
+    }
+}
+
+static void print_atom(Object *obj)
+{
+    switch (type_of(obj))
+    {
+    case INTEGER:
+        out_int(int_value(obj));
+        return;
+    case BIGNUM:
+    {
+        char *digits = decimal_string((Big){obj->limbs, abs(obj->nlimbs), false});
+        if (obj->nlimbs < 0)
+            out_char('-');
+        out_str(digits);
+        free(digits);
+        return;
+    }
+    case SYMBOL:
+        out_str(obj->name);
+        return;
+    case PRIMITIVE:
+        out_str("<primitive>");
+        return;
+    case FUNCTION:
+        out_str("<function>");
+        return;
+    case MACRO:
+        out_str("<macro>");
+        return;
+    case CONDITION:
+        out_str("<error: ");
+        out_str(obj->message);
+        out_char('>');
+        return;
+    case VECTOR:
+        // Only the empty vector; see print().
+        out_str("#()");
+        return;
+    case INTVECTOR:
+        out_str("#i(");
+        for (int i = 0; i < obj->nints; i++)
+        {
+            if (i > 0)
+                out_char(' ');
+            out_int(obj->ints[i]);
+        }
+        out_char(')');
+        return;
+    case STRING:
+        out_char('"');
+        for (int i = 0; i < obj->nbytes; i++)
+        {
+            char c = obj->bytes[i];
+            if (c == '"' || c == '\\')
+                out_char('\\');
+            if (c == '\n')
+                out_str("\\n");
+            else if (c == '\t')
+                out_str("\\t");
+            else if (c == '\r')
+                out_str("\\r");
+            else if (c == '\0')
+                out_str("\\0");
+            else
+                out_char(c);
+        }
+        out_char('"');
+        return;
+    case LVAR:
+        out_str(obj->sym->name);
+        return;
+    case KEYWORD:
+        if (obj == Nil)
+            out_str("()");
+        else if (obj == True)
+            out_char('t');
+        else
+            error("Unknown subtype: %d", obj->subtype);
+        return;
+    default:
+        error("Unknown tag type: %d", obj->type);
+    }
+}
+
+// Makes room for n entries on the print stack.
+static void reserve_print_stack(size_t n)
+{
+    if (n <= ctx->print_stack_cap)
+        return;
+    size_t cap = ctx->print_stack_cap ? ctx->print_stack_cap : 256;
+    while (cap < n)
+        cap *= 2;
+    ctx->print_stack = realloc(ctx->print_stack, sizeof(Object *) * cap);
+    if (!ctx->print_stack)
+        error("Memory exhausted");
+    ctx->print_stack_cap = cap;
+}
+
+static void print_push(size_t depth, Object *obj)
+{
+    if (depth == ctx->print_stack_cap)
+        reserve_print_stack(depth + 1);
+    ctx->print_stack[depth] = obj;
+}
+
+// Prints the given object. Lists and vectors are traversed with an explicit stack, so nesting depth
+// is only limited by memory. A vector takes two entries, the vector and the index of the element
+// being printed as a fixnum. Nothing is allocated on the heap, so the objects don't move.
+static void print(Object *obj)
+{
+    size_t depth = 0;
+    for (;;)
+    {
+        // Descend into the first elements until an atom is found.
+        for (;;)
+        {
+            if (type_of(obj) == CELL)
+            {
+                print_push(depth++, obj);
+                out_char('(');
+                obj = obj->car;
+            }
+            else if (type_of(obj) == VECTOR && obj->nelems > 0)
+            {
+                print_push(depth++, obj);
+                print_push(depth++, make_fixnum(0));
+                out_str("#(");
+                obj = obj->elems[0];
+            }
+            else
+                break;
+        }
+        print_atom(obj);
+
+        // Move on to the next element of the innermost unfinished list, closing the finished ones.
+        for (;;)
+        {
+            if (depth == 0)
+                return;
+            Object *top = ctx->print_stack[depth - 1];
+            if (is_fixnum(top))
+            {
+                Object *v = ctx->print_stack[depth - 2];
+                int i = fixnum_value(top) + 1;
+                if (i < v->nelems)
+                {
+                    out_char(' ');
+                    ctx->print_stack[depth - 1] = make_fixnum(i);
+                    obj = v->elems[i];
+                    break;
+                }
+                out_char(')');
+                depth -= 2;
+                continue;
+            }
+            if (type_of(top->cdr) == CELL)
+            {
+                out_char(' ');
+                ctx->print_stack[depth - 1] = top->cdr;
+                obj = top->cdr->car;
+                break;
+            }
+            if (top->cdr != Nil)
+            {
+                out_str(" . ");
+                print_atom(top->cdr);
+            }
+            out_char(')');
+            depth--;
+        }
+    }
+}
+
+//======================================================================
+// Binary serialization
+//======================================================================
+
+// write-binary and read-binary pass data between processes in a form that is much faster to load
+// than printed text. An object is written as
+//
+//     L B <version> <length> <number of symbols> <symbol>... <object>
+//
+// where length is that of the rest, in bytes, and every number is a varint: 7 bits a byte, least
+// significant first, with the high bit set on all but the last byte. A symbol is the length of its
+// name followed by the name. The object refers to the symbols by their index, so each name is
+// written and interned once however often it occurs. The object is a tag byte followed by its
+// contents; the elements of a list or a vector follow it in order. Since every list and vector is
+// prefixed with its length, the reader knows how much heap the whole object takes before building
+// any of it, and allocates it at once. Circular vectors can't be written.
+enum
+{
+    BIN_NIL,
+    BIN_TRUE,
+    // A zigzag varint; see zigzag()
+    BIN_INT,
+    // The number of limbs, negative for a negative number, as a zigzag varint, and the limbs, least
+    // significant first, in 8 little-endian bytes each
+    BIN_BIGNUM,
+    // The index of the symbol
+    BIN_SYMBOL,
+    // The length and the bytes
+    BIN_STRING,
+    // The length of a proper list and the elements
+    BIN_LIST,
+    // The same as BIN_LIST for a dotted list, followed by the last cdr
+    BIN_DOTTED,
+    // The length and the elements
+    BIN_VECTOR,
+    // The length and the elements as zigzag varints
+    BIN_INTVECTOR,
+    // The tags from here on are the integers from BIN_SMALL_MIN to BIN_SMALL_MAX.
+    BIN_SMALL = 16,
+};
+
+#define BIN_SMALL_MIN (-64)
+#define BIN_SMALL_MAX (BIN_SMALL_MIN + 255 - BIN_SMALL)
+#define BINARY_VERSION 1
+
+// Maps the integers of small magnitude, positive or negative, to small unsigned ones.
+static inline uint64_t zigzag(int64_t v)
+{
+    return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t u)
+{
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+// Stores the varint of v at p and returns its length, which is at most 10.
+static int encode_varint(uint8_t *p, uint64_t v)
+{
+    int n = 0;
+    for (; 0x80 <= v; v >>= 7)
+        p[n++] = (uint8_t)v | 0x80;
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Makes room for n more bytes in b.
+static void bytes_reserve(Bytes *b, size_t n)
+{
+    if (n <= b->cap - b->len)
+        return;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap - b->len < n)
+        cap *= 2;
+    uint8_t *data = realloc(b->data, cap);
+    if (!data)
+        error("Memory exhausted");
+    b->data = data;
+    b->cap = cap;
+}
+
+static inline void put_byte(Bytes *b, int c)
+{
+    if (b->len == b->cap)
+        bytes_reserve(b, 1);
+    b->data[b->len++] = (uint8_t)c;
+}
+
+static void put_bytes(Bytes *b, const void *p, size_t n)
+{
+    bytes_reserve(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static inline void put_varint(Bytes *b, uint64_t v)
+{
+    if (b->cap - b->len < 10)
+        bytes_reserve(b, 10);
+    b->len += encode_varint(b->data + b->len, v);
+}
+
+// Returns the index of the symbol in the symbol table being written, adding it with its name if
+// it's new.
+static uint32_t binary_symbol(Object *sym, uint32_t *nsyms)
+{
+    uint32_t mask = ctx->binary_syms_cap - 1;
+    for (uint32_t i = sym->hash & mask;; i = (i + 1) & mask)
+    {
+        BinarySym *s = &ctx->binary_syms[i];
+        if (s->stamp == ctx->binary_stamp)
+        {
+            if (s->sym == sym)
+                return s->index;
+            continue;
+        }
+        *s = (BinarySym){sym, (*nsyms)++, ctx->binary_stamp};
+        put_varint(&ctx->binary_names, sym->nbytes);
+        put_bytes(&ctx->binary_names, sym->name, sym->nbytes);
+        if (*nsyms * 2 <= ctx->binary_syms_cap)
+            return s->index;
+
+        // Keep the load factor at or below 1/2.
+        uint32_t cap = ctx->binary_syms_cap * 2;
+        BinarySym *syms = calloc(cap, sizeof(BinarySym));
+        if (!syms)
+            error("Memory exhausted");
+        for (uint32_t j = 0; j < ctx->binary_syms_cap; j++)
+        {
+            BinarySym *e = &ctx->binary_syms[j];
+            if (e->stamp != ctx->binary_stamp)
+                continue;
+            uint32_t k = e->sym->hash & (cap - 1);
+            while (syms[k].stamp == ctx->binary_stamp)
+                k = (k + 1) & (cap - 1);
+            syms[k] = *e;
+        }
+        free(ctx->binary_syms);
+        ctx->binary_syms = syms;
+        ctx->binary_syms_cap = cap;
+        return *nsyms - 1;
+    }
+}
+
+// Encodes obj into binary_body, and the names of its symbols into binary_names. Returns the number
+// of symbols. Like print(), it keeps the objects still to be written on the print stack and
+// allocates nothing on the heap, so the objects don't move.
+static uint32_t encode(Object *obj)
+{
+    Bytes *b = &ctx->binary_body;
+    b->len = 0;
+    ctx->binary_names.len = 0;
+    if (!ctx->binary_syms)
+    {
+        ctx->binary_syms = calloc(64, sizeof(BinarySym));
+        if (!ctx->binary_syms)
+            error("Memory exhausted");
+        ctx->binary_syms_cap = 64;
+    }
+    // A new stamp empties the table. When the stamps wrap around, the old ones are cleared.
+    if (++ctx->binary_stamp == 0)
+    {
+        memset(ctx->binary_syms, 0, sizeof(BinarySym) * ctx->binary_syms_cap);
+        ctx->binary_stamp = 1;
+    }
+
+    uint32_t nsyms = 0;
+    size_t depth = 0;
+    print_push(depth++, obj);
+    while (depth)
+    {
+        obj = ctx->print_stack[--depth];
+        switch (type_of(obj))
+        {
+        case INTEGER:
+        {
+            int64_t v = int_value(obj);
+            if (BIN_SMALL_MIN <= v && v <= BIN_SMALL_MAX)
+                put_byte(b, BIN_SMALL + (int)(v - BIN_SMALL_MIN));
+            else
+            {
+                put_byte(b, BIN_INT);
+                put_varint(b, zigzag(v));
+            }
+            break;
+        }
+        case BIGNUM:
+            put_byte(b, BIN_BIGNUM);
+            put_varint(b, zigzag(obj->nlimbs));
+            bytes_reserve(b, sizeof(Limb) * abs(obj->nlimbs));
+            for (int i = 0; i < abs(obj->nlimbs); i++)
+                for (int k = 0; k < 64; k += 8)
+                    b->data[b->len++] = (uint8_t)(obj->limbs[i] >> k);
+            break;
+        case SYMBOL:
+            put_byte(b, BIN_SYMBOL);
+            put_varint(b, binary_symbol(obj, &nsyms));
+            break;
+        case STRING:
+            put_byte(b, BIN_STRING);
+            put_varint(b, obj->nbytes);
+            put_bytes(b, obj->bytes, obj->nbytes);
+            break;
+        case KEYWORD:
+            if (obj != Nil && obj != True)
+                error("Unknown subtype: %d", obj->subtype);
+            put_byte(b, obj == Nil ? BIN_NIL : BIN_TRUE);
+            break;
+        case CELL:
+        {
+            // The elements are pushed in reverse, after the last cdr of a dotted list.
+            size_t n = 0;
+            Object *p = obj;
+            for (; type_of(p) == CELL; p = p->cdr)
+                n++;
+            put_byte(b, p == Nil ? BIN_LIST : BIN_DOTTED);
+            put_varint(b, n);
+            reserve_print_stack(depth + n + 1);
+            if (p != Nil)
+                ctx->print_stack[depth++] = p;
+            depth += n;
+            size_t i = depth;
+            for (p = obj; type_of(p) == CELL; p = p->cdr)
+                ctx->print_stack[--i] = p->car;
+            break;
+        }
+        case VECTOR:
+            put_byte(b, BIN_VECTOR);
+            put_varint(b, obj->nelems);
+            reserve_print_stack(depth + obj->nelems);
+            for (int i = obj->nelems - 1; 0 <= i; i--)
+                ctx->print_stack[depth++] = obj->elems[i];
+            break;
+        case INTVECTOR:
+            put_byte(b, BIN_INTVECTOR);
+            put_varint(b, obj->nints);
+            for (int i = 0; i < obj->nints; i++)
+                put_varint(b, zigzag(obj->ints[i]));
+            break;
+        default:
+            error("Only data can be written in binary");
+        }
+    }
+    return nsyms;
+}
+
+// Writes obj to the standard output.
+static void write_binary(Object *obj)
+{
+    uint32_t nsyms = encode(obj);
+    uint8_t count[10];
+    int ncount = encode_varint(count, nsyms);
+    uint8_t head[13] = {'L', 'B', BINARY_VERSION};
+    int nhead = 3 + encode_varint(head + 3, ncount + ctx->binary_names.len + ctx->binary_body.len);
+    pthread_mutex_lock(&output_lock);
+    out_bytes((char *)head, nhead);
+    out_bytes((char *)count, ncount);
+    out_bytes((char *)ctx->binary_names.data, ctx->binary_names.len);
+    out_bytes((char *)ctx->binary_body.data, ctx->binary_body.len);
+    pthread_mutex_unlock(&output_lock);
+}
+
+// read-binary reads the standard input. If the forms are read from it too, the object is read
+// through the reader's buffer, right after the form being evaluated; otherwise through
+// binary_input, which the threads take turns at.
+static Input binary_input = {.fd = -1};
+static pthread_mutex_t binary_input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set when the forms are read from the standard input
+static bool stdin_forms;
+
+// Returns the next byte of the input, or EOF at its end.
+static int input_byte(Input *in)
+{
+    if (in->p == in->end && !refill(in))
+        return EOF;
+    return (unsigned char)*in->p++;
+}
+
+// Reads the next object from the input into binary_body, skipping the whitespace before it. Returns
+// NULL, or the message of the error if the input has no object.
+static const char *read_payload(Input *in)
+{
+    int c;
+    do
+        c = input_byte(in);
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+    if (c == EOF)
+        return "No binary data left";
+    if (c != 'L' || input_byte(in) != 'B' || input_byte(in) != BINARY_VERSION)
+        return "Not binary data";
+    uint64_t len = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        if (64 <= shift || (c = input_byte(in)) == EOF)
+            return "Truncated binary data";
+        len |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+    }
+    // The length is not trusted: the buffer only grows as the bytes arrive.
+    Bytes *b = &ctx->binary_body;
+    b->len = 0;
+    while (b->len < len)
+    {
+        if (in->p == in->end && !refill(in))
+            return "Truncated binary data";
+        size_t n = in->end - in->p;
+        if (len - b->len < n)
+            n = len - b->len;
+        bytes_reserve(b, n);
+        memcpy(b->data + b->len, in->p, n);
+        in->p += n;
+        b->len += n;
+    }
+    return NULL;
+}
+
+// Reads the next object from the standard input into binary_body.
+static void read_stdin_payload(void)
+{
+    const char *err;
+    if (input.fd == STDIN_FILENO && (input.buf || input.map))
+        err = read_payload(&input);
+    else
+    {
+        if (stdin_forms)
+            error("The standard input is being read as forms");
+        if (lispy->threads_started)
+            enter_safe_region();
+        pthread_mutex_lock(&binary_input_lock);
+        if (lispy->threads_started)
+            leave_safe_region();
+        // The lock is released before an error is passed on.
+        Handler h;
+        if (CATCH(h))
+        {
+            if (binary_input.fd < 0)
+                open_input(&binary_input, STDIN_FILENO);
+            err = read_payload(&binary_input);
+            pop_handler(&h);
+        }
+        else
+        {
+            pop_handler(&h);
+            err = ctx->error;
+        }
+        pthread_mutex_unlock(&binary_input_lock);
+    }
+    if (err)
+    {
+        char msg[sizeof(ctx->error)];
+        snprintf(msg, sizeof(msg), "%s", err);
+        error("%s", msg);
+    }
+}
+
+static uint64_t get_varint(const uint8_t **p, const uint8_t *end)
+{
+    if (*p < end && !(**p & 0x80))
+        return *(*p)++;
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        if (*p == end || 64 <= shift)
+            error("Malformed binary data");
+        uint8_t c = *(*p)++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return v;
+    }
+}
+
+// Returns the limb stored in 8 little-endian bytes at p.
+static Limb get_limb(const uint8_t *p)
+{
+    Limb limb = 0;
+    for (int k = 0; k < 64; k += 8)
+        limb |= (Limb)*p++ << k;
+    return limb;
+}
+
+// Checks the encoded object from p to end, and returns the number of bytes of heap it takes. The
+// most objects that are pending at once while it's read is stored in *npending. Each of them takes
+// at least one more byte, which bounds their number by the length of the data.
+static size_t binary_size(const uint8_t *p, const uint8_t *end, uint64_t nsyms, size_t *npending)
+{
+    size_t size = 0;
+    size_t pending = 1;
+    *npending = 1;
+    while (pending)
+    {
+        if (p == end)
+            error("Malformed binary data");
+        int tag = *p++;
+        pending--;
+        uint64_t n = 0;
+        if (BIN_SMALL <= tag || tag == BIN_NIL || tag == BIN_TRUE)
+            continue;
+        if (tag <= BIN_INTVECTOR)
+            n = get_varint(&p, end);
+        switch (tag)
+        {
+        case BIN_INT:
+            if (unzigzag(n) < FIXNUM_MIN || FIXNUM_MAX < unzigzag(n))
+                size += INTEGER_SIZE;
+            continue;
+        case BIN_BIGNUM:
+        {
+            int64_t nlimbs = unzigzag(n);
+            if (nlimbs == 0 || BIGNUM_MAX < llabs(nlimbs) || (size_t)(end - p) / sizeof(Limb) < (size_t)llabs(nlimbs))
+                error("Malformed binary data");
+            // Only what make_integer() gives is a bignum: no leading zero limb, and a value that
+            // doesn't fit in an int64_t.
+            p += sizeof(Limb) * llabs(nlimbs);
+            Limb top = get_limb(p - sizeof(Limb));
+            bool fits = llabs(nlimbs) == 1 &&
+                        (top <= INT64_MAX || (nlimbs < 0 && top == (Limb)INT64_MAX + 1));
+            if (top == 0 || fits)
+                error("Malformed binary data");
+            size += BIGNUM_SIZE((int)nlimbs);
+            continue;
+        }
+        case BIN_SYMBOL:
+            if (nsyms <= n)
+                error("Malformed binary data");
+            continue;
+        case BIN_STRING:
+            if (STRING_MAX < n || (uint64_t)(end - p) < n)
+                error("Malformed binary data");
+            p += n;
+            size += STRING_SIZE(n);
+            continue;
+        case BIN_LIST:
+        case BIN_DOTTED:
+            if (n == 0)
+                error("Malformed binary data");
+            size += CELL_SIZE * n;
+            pending += n + (tag == BIN_DOTTED);
+            break;
+        case BIN_VECTOR:
+            if (VECTOR_MAX < n)
+                error("Malformed binary data");
+            size += VECTOR_SIZE(n);
+            pending += n;
+            break;
+        case BIN_INTVECTOR:
+            if (INTVECTOR_MAX < n || (uint64_t)(end - p) < n)
+                error("Malformed binary data");
+            for (uint64_t i = 0; i < n; i++)
+                get_varint(&p, end);
+            size += INTVECTOR_SIZE(n);
+            continue;
+        default:
+            error("Malformed binary data");
+        }
+        if ((size_t)(end - p) < pending)
+            error("Malformed binary data");
+        if (*npending < pending)
+            *npending = pending;
+    }
+    if (p != end)
+        error("Malformed binary data");
+    return size;
+}
+
+// Builds the encoded object at p, which binary_size() has checked, in the allocation buffer, which
+// must have the room it takes. Each object is stored into the hole, the field waiting for it, on top
+// of binary_holes. Nothing is collected meanwhile, so the holes don't move and the new objects need
+// no roots.
+static Object *binary_build(const uint8_t *p, const uint8_t *end, Object *syms)
+{
+    Object *r;
+    Object ***holes = ctx->binary_holes;
+    size_t top = 0;
+    holes[top++] = &r;
+    while (top)
+    {
+        Object **dst = holes[--top];
+        int tag = *p++;
+        if (BIN_SMALL <= tag)
+        {
+            *dst = make_fixnum(tag - BIN_SMALL + BIN_SMALL_MIN);
+            continue;
+        }
+        uint64_t n = 0;
+        if (BIN_INT <= tag)
+            n = get_varint(&p, end);
+        switch (tag)
+        {
+        case BIN_NIL:
+            *dst = Nil;
+            break;
+        case BIN_TRUE:
+            *dst = True;
+            break;
+        case BIN_INT:
+        {
+            int64_t v = unzigzag(n);
+            if (FIXNUM_MIN <= v && v <= FIXNUM_MAX)
+                *dst = make_fixnum(v);
+            else
+            {
+                *dst = bump(INTEGER, INTEGER_SIZE);
+                (*dst)->value = v;
+            }
+            break;
+        }
+        case BIN_BIGNUM:
+        {
+            int nlimbs = (int)unzigzag(n);
+            Object *big = bump(BIGNUM, BIGNUM_SIZE(nlimbs));
+            big->nlimbs = nlimbs;
+            for (int i = 0; i < abs(nlimbs); i++, p += sizeof(Limb))
+                big->limbs[i] = get_limb(p);
+            *dst = big;
+            break;
+        }
+        case BIN_SYMBOL:
+            *dst = syms->elems[n];
+            break;
+        case BIN_STRING:
+        {
+            Object *str = bump(STRING, STRING_SIZE(n));
+            str->nbytes = (int)n;
+            memcpy(str->bytes, p, n);
+            p += n;
+            *dst = str;
+            break;
+        }
+        case BIN_LIST:
+        case BIN_DOTTED:
+        {
+            // The holes of the cars go on top of the hole of the last cdr, the first car topmost.
+            size_t base = top + (tag == BIN_DOTTED);
+            Object **link = dst;
+            Object *cell = NULL;
+            for (size_t i = 0; i < n; i++)
+            {
+                cell = bump(CELL, CELL_SIZE);
+                *link = cell;
+                link = &cell->cdr;
+                holes[base + n - 1 - i] = &cell->car;
+            }
+            cell->cdr = Nil;
+            if (tag == BIN_DOTTED)
+                holes[top] = &cell->cdr;
+            top = base + n;
+            break;
+        }
+        case BIN_VECTOR:
+        {
+            Object *v = bump(VECTOR, VECTOR_SIZE(n));
+            v->nelems = (int)n;
+            for (size_t i = n; i > 0; i--)
+                holes[top++] = &v->elems[i - 1];
+            *dst = v;
+            break;
+        }
+        case BIN_INTVECTOR:
+        {
+            Object *v = bump(INTVECTOR, INTVECTOR_SIZE(n));
+            v->nints = (int)n;
+            for (size_t i = 0; i < n; i++)
+                v->ints[i] = unzigzag(get_varint(&p, end));
+            *dst = v;
+            break;
+        }
+        }
+    }
+    return r;
+}
+
+// Reads the next object from the standard input.
+static Object *read_binary(void)
+{
+    read_stdin_payload();
+    const uint8_t *p = ctx->binary_body.data;
+    const uint8_t *end = p + ctx->binary_body.len;
+
+    // Intern the symbols first, since interning may collect.
+    uint64_t nsyms = get_varint(&p, end);
+    if ((uint64_t)(end - p) < nsyms)
+        error("Malformed binary data");
+    ROOT_FRAME;
+    Object *syms = nsyms ? make_vector(nsyms, Nil) : Nil;
+    ROOT(syms);
+    for (uint64_t i = 0; i < nsyms; i++)
+    {
+        // The names are those that read_symbol() accepts.
+        uint64_t len = get_varint(&p, end);
+        if (len == 0 || SYMBOL_MAX_LEN < len || (uint64_t)(end - p) < len)
+            error("Malformed binary data");
+        for (uint64_t k = 0; k < len; k++)
+            if (!is_symbol_char(p[k]))
+                error("Malformed binary data");
+        Object *sym = intern_name((char *)p, len);
+        syms->elems[i] = sym;
+        note_store(&syms->elems[i]);
+        p += len;
+    }
+
+    size_t npending;
+    size_t size = binary_size(p, end, nsyms, &npending);
+    if (ctx->binary_holes_cap < npending)
+    {
+        free(ctx->binary_holes);
+        ctx->binary_holes_cap = 0;
+        ctx->binary_holes = malloc(sizeof(Object **) * npending);
+        if (!ctx->binary_holes)
+            error("Memory exhausted");
+        ctx->binary_holes_cap = npending;
+    }
+    if (!has_room(size))
+        gc(size);
+    uint8_t *start = ctx->alloc_ptr;
+    Object *r = binary_build(p, end, syms);
+    // A buffer in the old generation has been claimed for one object, but it holds many.
+    if ((size_t)(start - lispy->memory) < lispy->mem_size)
+        note_objects(start, ctx->alloc_ptr);
+    return r;
+}
+
+//======================================================================
+// Evaluator
+//======================================================================
+
+static Object *eval(Object *env, Object *obj);
+static Object *run(Object *code, Object *env);
+static Object *primitive_IF(Object *env, Object *list);
+static Object *compile(Object *body);
+static bool is_foldable(Object *obj);
+
+// The version of the global function bindings. It's bumped whenever a global variable bound to a
+// function gets a new value, which invalidates the VM's inline caches of called functions. All
+// interpreters share it; a bump in one merely costs the others a cache miss.
+static intptr_t global_version;
+
+// The version of the bindings of the primitives that constant folding uses. It's bumped whenever a
+// global variable bound to one of them gets a new value, which turns every folded expression back
+// into the call it came from.
+static intptr_t fold_version;
+
+// Must be called before a new value is stored into the variable.
+static inline void rebind(Object *var)
+{
+    if (var->type != SYMBOL || !var->global)
+        return;
+    if (type_of(var->global) == FUNCTION)
+        __atomic_fetch_add(&global_version, 1, __ATOMIC_RELAXED);
+    else if (is_foldable(var->global))
+        __atomic_fetch_add(&fold_version, 1, __ATOMIC_RELAXED);
+}
+
+// Binds the global variable.
+static void add_variable(Object *sym, Object *val)
+{
+    rebind(sym);
+    sym->global = val;
+    note_store(&sym->global);
+}
+
+// Returns a newly created environment frame for a call of fn.
+static Object *push_env(Object *fn, Object *values)
+{
+    if (list_length(values) != fn->nparams)
+        error("Number of argument does not match");
+    ROOT_FRAME;
+    ROOT(values);
+    Object *frame = make_env(fn->nslots, fn->env);
+    for (int i = 0; values != Nil; values = values->cdr)
+        frame->slots[i++] = values->car;
+    return frame;
+}
+
+// Evaluates the list elements from head except the last one, and returns the last one. The caller
+// evaluates it in a tail position.
+static Object *progn_tail(Object *env, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(list);
+    for (; list->cdr != Nil; list = list->cdr)
+        eval(env, list->car);
+    return list->car;
+}
+
+// Evaluates the list elements from head and returns the last return value.
+static Object *progn(Object *env, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(env);
+    Object *last = progn_tail(env, list);
+    return eval(env, last);
+}
+
+// Evaluates the condition of (if expr expr expr ...) and returns the expression of the chosen
+// branch, which the caller evaluates in a tail position.
+static Object *if_tail(Object *env, Object *list)
+{
+    if (list_length(list) < 2)
+        error("Malformed if");
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(list);
+    Object *cond = eval(env, list->car);
+    if (cond != Nil)
+        return list->cdr->car;
+    Object *els = list->cdr->cdr;
+    return els == Nil ? Nil : progn_tail(env, els);
+}
+
+// Evaluates the list elements and pushes the values on the VM stack. Returns the number of values.
+static int eval_args(Object *env, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(list);
+    int n = 0;
+    for (; list != Nil; list = list->cdr, n++)
+    {
+        if (ctx->vm_sp == VM_STACK_SIZE)
+            error("Stack overflow");
+        Object *val = eval(env, list->car);
+        ctx->vm_stack[ctx->vm_sp++] = val;
+    }
+    return n;
+}
+
+static bool is_list(Object *obj)
+{
+    return obj == Nil || type_of(obj) == CELL;
+}
+
+// Returns a newly created environment frame for a call of fn with the n values on top of the VM
+// stack, and pops them.
+static Object *push_frame(Object *fn, int n)
+{
+    if (n != fn->nparams)
+        error("Number of argument does not match");
+    Object *frame = make_env(fn->nslots, fn->env);
+    memcpy(frame->slots, &ctx->vm_stack[ctx->vm_sp - n], sizeof(Object *) * n);
+    ctx->vm_sp -= n;
+    return frame;
+}
+
+// Calls fn with the n values on top of the VM stack as its arguments, and pops them.
+static Object *apply_function(Object *fn, int n)
+{
+    if (type_of(fn) == PRIMITIVE)
+    {
+        if (fn->special)
+            error("Special form cannot be applied to evaluated arguments");
+        Object *r = fn->builtin(n, &ctx->vm_stack[ctx->vm_sp - n]);
+        ctx->vm_sp -= n;
+        return r;
+    }
+    if (type_of(fn) == FUNCTION)
+    {
+        ROOT_FRAME;
+        ROOT(fn);
+        Object *newenv = push_frame(fn, n);
+        if (fn->code)
+            return run(fn->code, newenv);
+        return progn(newenv, fn->body);
+    }
+    error("The head of a list must be a function");
+}
+
+// Like apply_function(), and records the call in the profile.
+static Object *funcall(Object *fn, int n)
+{
+    if (!PROFILING)
+        return apply_function(fn, n);
+    int depth = profile_enter(fn);
+    Object *r = apply_function(fn, n);
+    profile_unwind(depth);
+    return r;
+}
+
+static inline bool is_function(Object *obj)
+{
+    return type_of(obj) == FUNCTION || (type_of(obj) == PRIMITIVE && !obj->special);
+}
+
+// Calls fn with the values, which are pushed on the VM stack.
+static Object *call1(Object *fn, Object *x)
+{
+    if (VM_STACK_SIZE < ctx->vm_sp + 1)
+        error("Stack overflow");
+    ctx->vm_stack[ctx->vm_sp++] = x;
+    return funcall(fn, 1);
+}
+
+static Object *call2(Object *fn, Object *x, Object *y)
+{
+    if (VM_STACK_SIZE < ctx->vm_sp + 2)
+        error("Stack overflow");
+    ctx->vm_stack[ctx->vm_sp++] = x;
+    ctx->vm_stack[ctx->vm_sp++] = y;
+    return funcall(fn, 2);
+}
+
+// Returns the location of the variable, which is either a symbol (for a global variable) or a
+// local variable reference made by the resolver. The location is invalidated by GC.
+static Object **variable_slot(Object *env, Object *var)
+{
+    if (var->type == SYMBOL)
+        return &var->global;
+    for (int i = var->depth; i > 0; i--)
+        env = env->up;
+    return &env->slots[var->index];
+}
+
+static char *variable_name(Object *var)
+{
+    return var->type == SYMBOL ? var->name : var->sym->name;
+}
+
+static bool is_variable(Object *obj)
+{
+    return type_of(obj) == SYMBOL || type_of(obj) == LVAR;
+}
+
+static void leave_eval(int *depth)
+{
+    ctx->eval_depth = *depth - 1;
+}
+
+static void leave_profile(int *depth)
+{
+    if (PROFILING)
+        profile_unwind(*depth);
+}
+
+// Evaluates the S expression. The expressions in tail positions, namely the chosen branch of if and
+// the last expression of a function body, are evaluated within this loop rather than by a
+// recursive call, so that tail calls run in constant space.
+static Object *eval(Object *env, Object *obj)
+{
+    int depth __attribute__((cleanup(leave_eval))) = ++ctx->eval_depth;
+    if (max_depth < depth)
+        error("Stack overflow: maximum depth %d exceeded", max_depth);
+    check_c_stack();
+    // The interpreted functions called in this loop are profiled as a chain of tail calls.
+    int prof_depth __attribute__((cleanup(leave_profile))) = ctx->prof_depth;
+
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(obj);
+    Object *fn = NULL;
+    ROOT(fn);
+    for (;;)
+    {
+        // Fixnums are the most common self-evaluating objects, and need only a bit test.
+        if (is_fixnum(obj))
+            return obj;
+        switch (obj->type)
+        {
+        case INTEGER:
+        case PRIMITIVE:
+        case FUNCTION:
+        case MACRO:
+        case CONDITION:
+        case VECTOR:
+        case STRING:
+        case INTVECTOR:
+        case BIGNUM:
+        case KEYWORD:
+        case CODE:
+            // Self-evaluating objects
+            return obj;
+        case SYMBOL:
+        case LVAR:
+        {
+            // Variable
+            Object *val = *variable_slot(env, obj);
+            if (!val)
+                error("Undefined symbol: %s", variable_name(obj));
+            return val;
+        }
+        case CELL:
+        {
+            // Function application form. Macros have been expanded by the resolver. A variable at
+            // the head, the common case, is looked up here rather than by a recursive call.
+            Object *head = obj->car;
+            if (type_of(head) == SYMBOL || type_of(head) == LVAR)
+            {
+                fn = *variable_slot(env, head);
+                if (!fn)
+                    error("Undefined symbol: %s", variable_name(head));
+            }
+            else
+                fn = eval(env, head);
+            Object *args = obj->cdr;
+            if (type_of(fn) != PRIMITIVE && type_of(fn) != FUNCTION)
+                error("The head of a list must be a function");
+            if (!is_list(args))
+                error("Argument must be a list");
+            if (fn->type == PRIMITIVE && fn->special)
+            {
+                if (fn->fn != primitive_IF)
+                    return fn->fn(env, args);
+                obj = if_tail(env, args);
+                continue;
+            }
+            int n = eval_args(env, args);
+            if (fn->type == PRIMITIVE || fn->code)
+                return funcall(fn, n);
+            env = push_frame(fn, n);
+            if (PROFILING)
+                profile_tail_call(prof_depth, fn);
+            obj = progn_tail(env, fn->body);
+            continue;
+        }
+        default:
+            error("Unknown tag type: %d", obj->type);
+        }
+    }
+}
+
+//======================================================================
+// Integer vector kernels
+//======================================================================
+
+// The loops behind the bulk primitives over integer vectors. Each has a portable version and, on
+// x86-64, an AVX2 version; init_vec_kernels() picks the AVX2 ones if the CPU supports them. The
+// arithmetic kernels return false if a result overflows int64_t.
+
+enum
+{
+    VEC_EQ,
+    VEC_LT,
+    VEC_LE,
+    VEC_GT,
+    VEC_GE,
+};
+
+typedef struct
+{
+    bool (*add)(int64_t *r, const int64_t *a, const int64_t *b, int n);
+    bool (*sum)(int64_t *r, const int64_t *a, int n);
+    bool (*dot)(int64_t *r, const int64_t *a, const int64_t *b, int n);
+    int64_t (*extremum)(const int64_t *a, int n, bool max);
+    void (*compare)(int64_t *r, const int64_t *a, const int64_t *b, int n, int cmp);
+} VecKernels;
+
+// The sum wraps around, and the overflow is detected afterwards from the signs: it overflows
+// exactly when both operands have the same sign and the sum has the other, so that the sign bit of
+// (a ^ s) & (b ^ s) is set. Unlike __builtin_add_overflow, this leaves the loops branch-free.
+static inline int64_t wrapping_add(int64_t a, int64_t b)
+{
+    return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static bool add_scalar(int64_t *r, const int64_t *a, const int64_t *b, int n)
+{
+    int64_t overflow = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int64_t s = wrapping_add(a[i], b[i]);
+        overflow |= (a[i] ^ s) & (b[i] ^ s);
+        r[i] = s;
+    }
+    return overflow >= 0;
+}
+
+// Stores s in *r if it fits in int64_t.
+static inline bool narrow(int64_t *r, __int128 s)
+{
+    if (s < INT64_MIN || INT64_MAX < s)
+        return false;
+    *r = s;
+    return true;
+}
+
+// The sum and the dot product only fail if the result itself is out of range, whatever the partial
+// sums are, so they are computed in 128 bits. A vector has fewer than 2^31 elements, so a sum
+// can't overflow that. A dot product could only do so if the result were far out of range anyway.
+static bool sum_scalar(int64_t *r, const int64_t *a, int n)
+{
+    __int128 s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i];
+    return narrow(r, s);
+}
+
+static bool dot_scalar(int64_t *r, const int64_t *a, const int64_t *b, int n)
+{
+    __int128 s = 0;
+    for (int i = 0; i < n; i++)
+        if (__builtin_add_overflow(s, (__int128)a[i] * b[i], &s))
+            return false;
+    return narrow(r, s);
+}
+
+static int64_t extremum_scalar(const int64_t *a, int n, bool max)
+{
+    int64_t m = a[0];
+    for (int i = 1; i < n; i++)
+        if (max ? m < a[i] : a[i] < m)
+            m = a[i];
+    return m;
+}
+
+static inline bool compare_one(int64_t x, int64_t y, int cmp)
+{
+    switch (cmp)
+    {
+    case VEC_EQ: return x == y;
+    case VEC_LT: return x < y;
+    case VEC_LE: return x <= y;
+    case VEC_GT: return x > y;
+    default: return x >= y;
+    }
+}
+
+static void compare_scalar(int64_t *r, const int64_t *a, const int64_t *b, int n, int cmp)
+{
+    for (int i = 0; i < n; i++)
+        r[i] = compare_one(a[i], b[i], cmp);
+}
+
+static VecKernels vec_kernels = {add_scalar, sum_scalar, dot_scalar, extremum_scalar, compare_scalar};
+
+#if defined(__x86_64__)
+
+// The AVX2 kernels handle four elements at a time and leave the remaining n % 4 to the scalar
+// ones. The sum and the dot product keep four 64-bit partial sums; if one of them overflows, the
+// scalar kernel is run instead, since the total may still fit.
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i load4(const int64_t *p)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+AVX2 static inline bool any_sign(__m256i x)
+{
+    return _mm256_movemask_pd(_mm256_castsi256_pd(x)) != 0;
+}
+
+AVX2 static bool add_avx2(int64_t *r, const int64_t *a, const int64_t *b, int n)
+{
+    __m256i overflow = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = load4(a + i), y = load4(b + i), s = _mm256_add_epi64(x, y);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(x, s), _mm256_xor_si256(y, s)));
+        _mm256_storeu_si256((__m256i *)(r + i), s);
+    }
+    return !any_sign(overflow) && add_scalar(r + i, a + i, b + i, n - i);
+}
+
+// Adds the four partial sums and the sum of the rest.
+static bool finish_sum(int64_t *r, int64_t lanes[4], int64_t rest)
+{
+    return narrow(r, (__int128)lanes[0] + lanes[1] + lanes[2] + lanes[3] + rest);
+}
+
+AVX2 static bool sum_avx2(int64_t *r, const int64_t *a, int n)
+{
+    __m256i acc = _mm256_setzero_si256(), overflow = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = load4(a + i), s = _mm256_add_epi64(acc, x);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(acc, s), _mm256_xor_si256(x, s)));
+        acc = s;
+    }
+    int64_t lanes[4], rest;
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    if (any_sign(overflow) || !sum_scalar(&rest, a + i, n - i))
+        return sum_scalar(r, a, n);
+    return finish_sum(r, lanes, rest);
+}
+
+// AVX2 has no 64-bit multiplication, but _mm256_mul_epi32 multiplies the low 32 bits of each lane
+// into an exact 64-bit product. That is used when all elements fit in 32 bits, which is checked
+// along the way: x does so exactly when the upper half of x + 2^31 is zero. Otherwise the scalar
+// kernel is run.
+AVX2 static bool dot_avx2(int64_t *r, const int64_t *a, const int64_t *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256(), overflow = _mm256_setzero_si256(), wide = _mm256_setzero_si256();
+    __m256i bias = _mm256_set1_epi64x(INT64_C(1) << 31);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = load4(a + i), y = load4(b + i);
+        wide = _mm256_or_si256(wide, _mm256_srli_epi64(_mm256_add_epi64(x, bias), 32));
+        wide = _mm256_or_si256(wide, _mm256_srli_epi64(_mm256_add_epi64(y, bias), 32));
+        __m256i p = _mm256_mul_epi32(x, y), s = _mm256_add_epi64(acc, p);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(acc, s), _mm256_xor_si256(p, s)));
+        acc = s;
+    }
+    int64_t lanes[4], rest;
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    if (!_mm256_testz_si256(wide, wide) || any_sign(overflow) || !dot_scalar(&rest, a + i, b + i, n - i))
+        return dot_scalar(r, a, b, n);
+    return finish_sum(r, lanes, rest);
+}
+
+AVX2 static int64_t extremum_avx2(const int64_t *a, int n, bool max)
+{
+    if (n < 4)
+        return extremum_scalar(a, n, max);
+    __m256i m = load4(a);
+    int i = 4;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = load4(a + i);
+        // Take x in the lanes where it is beyond m.
+        __m256i beyond = max ? _mm256_cmpgt_epi64(x, m) : _mm256_cmpgt_epi64(m, x);
+        m = _mm256_blendv_epi8(m, x, beyond);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, m);
+    int64_t r = extremum_scalar(lanes, 4, max);
+    if (i < n)
+    {
+        int64_t rest = extremum_scalar(a + i, n - i, max);
+        if (max ? r < rest : rest < r)
+            r = rest;
+    }
+    return r;
+}
+
+// The comparisons are built from equality and greater-than, with <= and >= as the negations of >
+// and <. A true lane is all ones, whose top bit is shifted down to make 1.
+AVX2 static void compare_avx2(int64_t *r, const int64_t *a, const int64_t *b, int n, int cmp)
+{
+    __m256i negate = _mm256_set1_epi64x(cmp == VEC_LE || cmp == VEC_GE ? -1 : 0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = load4(a + i), y = load4(b + i), t;
+        if (cmp == VEC_EQ)
+            t = _mm256_cmpeq_epi64(x, y);
+        else if (cmp == VEC_GT || cmp == VEC_LE)
+            t = _mm256_cmpgt_epi64(x, y);
+        else
+            t = _mm256_cmpgt_epi64(y, x);
+        t = _mm256_xor_si256(t, negate);
+        _mm256_storeu_si256((__m256i *)(r + i), _mm256_srli_epi64(t, 63));
+    }
+    compare_scalar(r + i, a + i, b + i, n - i, cmp);
+}
+
+#undef AVX2
+
+#endif
+
+static void init_vec_kernels(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        vec_kernels = (VecKernels){add_avx2, sum_avx2, dot_avx2, extremum_avx2, compare_avx2};
+#endif
+}
+
+//======================================================================
+// Functions and special forms
+//======================================================================
+
+// 'expr
+static Object *primitive_QUOTE(Object *env, Object *list)
+{
+    if (list_length(list) != 1)
+        error("Malformed quote");
+    return list->car;
+}
+
+// (list expr ...)
+static Object *primitive_LIST(int argc, Object **argv)
+{
+    ROOT_FRAME;
+    Object *list = Nil;
+    ROOT(list);
+    for (int i = argc - 1; i >= 0; i--)
+        list = cons(argv[i], list);
+    return list;
+}
+
+// (setvalue <symbol> expr)
+static Object *primitive_SETVALUE(Object *env, Object *list)
+{
+    if (list_length(list) != 2 || !is_variable(list->car))
+        error("Unable to set new value");
+    if (!*variable_slot(env, list->car))
+        error("Unbound variable %s", variable_name(list->car));
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(list);
+    Object *value = eval(env, list->cdr->car);
+    rebind(list->car);
+    Object **slot = variable_slot(env, list->car);
+    *slot = value;
+    note_store(slot);
+    return value;
+}
+
+// Returns the value of an argument of the primitive name, which takes a 64-bit integer.
+static inline int64_t number_arg(Object *obj, char *name)
+{
+    if (type_of(obj) == BIGNUM)
+        error("%s: integer out of range", name);
+    if (type_of(obj) != INTEGER)
+        error("%s takes only numbers", name);
+    return int_value(obj);
+}
+
+// Returns the argument of the arithmetic primitive name, which takes integers of any size.
+static inline Object *integer_arg(Object *obj, char *name)
+{
+    if (!is_integer(obj))
+        error("%s takes only numbers", name);
+    return obj;
+}
+
+// The arithmetic primitives compute in int64_t as long as the arguments and the results fit, and
+// switch to bignums from the first bignum argument or overflow on.
+
+// (+ <integer> ...)
+static Object *primitive_PLUS(int argc, Object **argv)
+{
+    // The sum of two fixnums always fits in int64_t.
+    if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1]))
+        return make_int((int64_t)fixnum_value(argv[0]) + fixnum_value(argv[1]));
+    int64_t sum = 0, next;
+    int i = 0;
+    for (; i < argc; i++)
+    {
+        if (type_of(argv[i]) != INTEGER || __builtin_add_overflow(sum, int_value(argv[i]), &next))
+            break;
+        sum = next;
+    }
+    if (i == argc)
+        return make_int(sum);
+    ROOT_FRAME;
+    Object *r = make_int(sum);
+    ROOT(r);
+    for (; i < argc; i++)
+        r = integer_add(r, integer_arg(argv[i], "+"), false);
+    return r;
+}
+
+// (- <integer>) and (- <integer> <integer> ...)
+static Object *primitive_MINUS(int argc, Object **argv)
+{
+    if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1]))
+        return make_int((int64_t)fixnum_value(argv[0]) - fixnum_value(argv[1]));
+    if (argc == 0)
+        error("Malformed -");
+    if (argc == 1)
+        return integer_add(make_fixnum(0), integer_arg(argv[0], "-"), true);
+    int64_t r = 0, next;
+    int i = 1;
+    if (type_of(argv[0]) == INTEGER)
+    {
+        r = int_value(argv[0]);
+        for (; i < argc; i++)
+        {
+            if (type_of(argv[i]) != INTEGER || __builtin_sub_overflow(r, int_value(argv[i]), &next))
+                break;
+            r = next;
+        }
+        if (i == argc)
+            return make_int(r);
+    }
+    ROOT_FRAME;
+    Object *big = i == 1 ? integer_arg(argv[0], "-") : make_int(r);
+    ROOT(big);
+    for (; i < argc; i++)
+        big = integer_add(big, integer_arg(argv[i], "-"), true);
+    return big;
+}
+
+// (* <integer> ...)
+static Object *primitive_TIMES(int argc, Object **argv)
+{
+    int64_t r = 1, next;
+    int i = 0;
+    for (; i < argc; i++)
+    {
+        if (type_of(argv[i]) != INTEGER || __builtin_mul_overflow(r, int_value(argv[i]), &next))
+            break;
+        r = next;
+    }
+    if (i == argc)
+        return make_int(r);
+    ROOT_FRAME;
+    Object *big = make_int(r);
+    ROOT(big);
+    for (; i < argc; i++)
+        big = integer_mul(big, integer_arg(argv[i], "*"));
+    return big;
+}
+
+// (/ <integer> <integer> ...). The quotient is rounded toward negative infinity, so that
+// (+ (* (/ a b) b) (mod a b)) is a.
+static Object *primitive_DIVIDE(int argc, Object **argv)
+{
+    if (argc < 2)
+        error("Malformed /");
+    ROOT_FRAME;
+    Object *r = integer_arg(argv[0], "/");
+    ROOT(r);
+    for (int i = 1; i < argc; i++)
+    {
+        Object *d = integer_arg(argv[i], "/");
+        if (type_of(r) == INTEGER && type_of(d) == INTEGER)
+        {
+            int64_t x = int_value(r), y = int_value(d);
+            if (y == 0)
+                error("Division by zero");
+            if (!(x == INT64_MIN && y == -1))
+            {
+                r = make_int(x / y - (x % y != 0 && (x < 0) != (y < 0)));
+                continue;
+            }
+        }
+        r = integer_div(r, d, false);
+    }
+    return r;
+}
+
+// (mod <integer> <integer>). The result has the sign of the divisor.
+static Object *primitive_MOD(int argc, Object **argv)
+{
+    if (argc != 2)
+        error("Malformed mod");
+    Object *x = integer_arg(argv[0], "mod");
+    Object *y = integer_arg(argv[1], "mod");
+    if (type_of(x) != INTEGER || type_of(y) != INTEGER)
+        return integer_div(x, y, true);
+    int64_t a = int_value(x), b = int_value(y);
+    if (b == 0)
+        error("Division by zero");
+    if (b == -1)
+        return make_int(0);
+    int64_t r = a % b;
+    if (r != 0 && (r < 0) != (b < 0))
+        r += b;
+    return make_int(r);
+}
+
+// (lambda (<symbol> ...) expr ...)
+//
+// The resolver has already turned the parameters and the body into a function template, which only
+// needs to be closed over the current environment.
+static Object *primitive_LAMBDA(Object *env, Object *list)
+{
+    Object *tmpl = list->car;
+    if (type_of(tmpl) != FUNCTION)
+        error("Unable to create new lambda");
+    return make_closure(tmpl, env);
+}
+
+// (define <symbol> expr)
+// (defmacro <symbol> <template>)
+static Object *primitive_DEFMACRO(Object *env, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(list);
+    Object *macro = make_closure(list->cdr->car, NULL);
+    rebind(list->car);
+    list->car->global = macro;
+    note_store(&list->car->global);
+    return macro;
+}
+
+static Object *primitive_DEFINE(Object *env, Object *list)
+{
+    if (list_length(list) != 2 || !is_variable(list->car))
+        error("Malformed setq");
+    ROOT_FRAME;
+    ROOT(env);
+    ROOT(list);
+    Object *value = eval(env, list->cdr->car);
+    rebind(list->car);
+    Object **slot = variable_slot(env, list->car);
+    *slot = value;
+    note_store(slot);
+    return value;
+}
+
+// (println expr)
+static Object *primitive_PRINTLN(int argc, Object **argv)
+{
+    if (argc != 1)
+        error("Malformed println");
+    pthread_mutex_lock(&output_lock);
+    print(argv[0]);
+    out_char('\n');
+    pthread_mutex_unlock(&output_lock);
+    return Nil;
+}
+
+// (write-binary expr)
+static Object *primitive_WRITE_BINARY(int argc, Object **argv)
+{
+    if (argc != 1)
+        error("Malformed write-binary");
+    write_binary(argv[0]);
+    return Nil;
+}
+
+// (read-binary)
+static Object *primitive_READ_BINARY(int argc, Object **argv)
+{
+    if (argc != 0)
+        error("Malformed read-binary");
+    return read_binary();
+}
+
+// (if expr expr expr ...)
+static Object *primitive_IF(Object *env, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(env);
+    Object *expr = if_tail(env, list);
+    return eval(env, expr);
+}
+
+// (= <integer> <integer>)
+static Object *primitive_EQUAL(int argc, Object **argv)
+{
+    if (argc != 2)
+        error("Malformed =");
+    Object *x = argv[0];
+    Object *y = argv[1];
+    if (is_fixnum(x) && is_fixnum(y))
+        return x == y ? True : Nil;
+    if (!is_integer(x) || !is_integer(y))
+        error("= only takes numbers");
+    return integer_compare(x, y) == 0 ? True : Nil;
+}
+
+// Defines a comparison primitive (op <integer> <integer>). The order of two fixnums is the order of
+// their tagged representations.
+#define DEFINE_COMPARISON(fname, op, name)                                            \
+    static Object *fname(int argc, Object **argv)                                     \
+    {                                                                                 \
+        if (argc != 2)                                                                \
+            error("Malformed " name);                                                 \
+        if (is_fixnum(argv[0]) && is_fixnum(argv[1]))                                 \
+            return (intptr_t)argv[0] op(intptr_t) argv[1] ? True : Nil;               \
+        Object *x = integer_arg(argv[0], name), *y = integer_arg(argv[1], name);       \
+        return integer_compare(x, y) op 0 ? True : Nil;                               \
+    }
+
+// (< <integer> <integer>), (<= <integer> <integer>), (> <integer> <integer>), (>= <integer> <integer>)
+DEFINE_COMPARISON(primitive_LT, <, "<")
+DEFINE_COMPARISON(primitive_LE, <=, "<=")
+DEFINE_COMPARISON(primitive_GT, >, ">")
+DEFINE_COMPARISON(primitive_GE, >=, ">=")
+
+// Returns the vector or integer vector argument of the primitive name.
+static inline Object *vector_arg(Object *obj, char *name)
+{
+    if (type_of(obj) != VECTOR && type_of(obj) != INTVECTOR)
+        error("%s takes a vector", name);
+    return obj;
+}
+
+static inline int vector_length(Object *v)
+{
+    return v->type == VECTOR ? v->nelems : v->nints;
+}
+
+// Returns the index argument of the primitive name, which must be in [0, len).
+static inline int index_arg(Object *obj, int len, char *name)
+{
+    int64_t i = number_arg(obj, name);
+    if (i < 0 || len <= i)
+        error("%s: index out of range: %" PRId64, name, i);
+    return i;
+}
+
+// (make-vector <integer>), (make-vector <integer> expr). The elements are () unless given.
+static Object *primitive_MAKE_VECTOR(int argc, Object **argv)
+{
+    if (argc != 1 && argc != 2)
+        error("Malformed make-vector");
+    return make_vector(number_arg(argv[0], "make-vector"), argc == 2 ? argv[1] : Nil);
+}
+
+// (vector expr ...)
+static Object *primitive_VECTOR(int argc, Object **argv)
+{
+    // argv is on the VM stack or in a rooted array, so it stays valid across GC.
+    Object *v = make_vector(argc, Nil);
+    for (int i = 0; i < argc; i++)
+        v->elems[i] = argv[i];
+    return v;
+}
+
+// (vector-ref <vector> <integer>)
+static Object *primitive_VECTOR_REF(int argc, Object **argv)
+{
+    if (argc != 2)
+        error("Malformed vector-ref");
+    Object *v = vector_arg(argv[0], "vector-ref");
+    int i = index_arg(argv[1], vector_length(v), "vector-ref");
+    return v->type == VECTOR ? v->elems[i] : make_int(v->ints[i]);
+}
+
+// (vector-set! <vector> <integer> expr)
+static Object *primitive_VECTOR_SET(int argc, Object **argv)
+{
+    if (argc != 3)
+        error("Malformed vector-set!");
+    Object *v = vector_arg(argv[0], "vector-set!");
+    int i = index_arg(argv[1], vector_length(v), "vector-set!");
+    if (v->type == INTVECTOR)
+    {
+        v->ints[i] = number_arg(argv[2], "vector-set!");
+        return argv[2];
+    }
+    v->elems[i] = argv[2];
+    note_store(&v->elems[i]);
+    return argv[2];
+}
+
+// (vector-length <vector>)
+static Object *primitive_VECTOR_LENGTH(int argc, Object **argv)
+{
+    if (argc != 1)
+        error("Malformed vector-length");
+    return make_fixnum(vector_length(vector_arg(argv[0], "vector-length")));
+}
+
+// (make-int-vector <integer>), (make-int-vector <integer> <integer>). The elements are 0 unless
+// given.
+static Object *primitive_MAKE_INT_VECTOR(int argc, Object **argv)
+{
+    if (argc != 1 && argc != 2)
+        error("Malformed make-int-vector");
+    int64_t fill = argc == 2 ? number_arg(argv[1], "make-int-vector") : 0;
+    Object *v = make_int_vector(number_arg(argv[0], "make-int-vector"));
+    if (fill != 0)
+        for (int i = 0; i < v->nints; i++)
+            v->ints[i] = fill;
+    return v;
+}
+
+// (int-vector <integer> ...)
+static Object *primitive_INT_VECTOR(int argc, Object **argv)
+{
+    for (int i = 0; i < argc; i++)
+        number_arg(argv[i], "int-vector");
+    Object *v = make_int_vector(argc);
+    for (int i = 0; i < argc; i++)
+        v->ints[i] = int_value(argv[i]);
+    return v;
+}
+
+// Returns the integer vector argument of the bulk primitive name.
+static inline Object *int_vector_arg(Object *obj, char *name)
+{
+    if (type_of(obj) != INTVECTOR)
+        error("%s takes an integer vector", name);
+    return obj;
+}
+
+// Checks the two integer vector arguments of the elementwise primitive name.
+static void int_vector_args(int argc, Object **argv, char *name)
+{
+    if (argc != 2)
+        error("Malformed %s", name);
+    int_vector_arg(argv[0], name);
+    int_vector_arg(argv[1], name);
+    if (argv[0]->nints != argv[1]->nints)
+        error("%s: vector lengths differ", name);
+}
+
+// (vec+ <intvector> <intvector>) returns the elementwise sum.
+static Object *primitive_VEC_PLUS(int argc, Object **argv)
+{
+    int_vector_args(argc, argv, "vec+");
+    Object *r = make_int_vector(argv[0]->nints);
+    if (!vec_kernels.add(r->ints, argv[0]->ints, argv[1]->ints, r->nints))
+        error("Integer overflow");
+    return r;
+}
+
+// Adds s to the bignum *acc.
+static void add_int128(Big *acc, __int128 s)
+{
+    unsigned __int128 m = s < 0 ? -(unsigned __int128)s : (unsigned __int128)s;
+    Limb d[2] = {(Limb)m, (Limb)(m >> 64)};
+    Big sum = big_add(*acc, (Big){d, limbs_len(d, 2), s < 0}, false);
+    free(acc->d);
+    *acc = sum;
+}
+
+// Returns the sum of the n products a[i] b[i], or of the n a[i] if b is NULL, as an integer of any
+// size. Called when the kernels overflow.
+static Object *exact_sum(const int64_t *a, const int64_t *b, int n)
+{
+    Big acc = {alloc_limbs(0), 0, false};
+    __int128 part = 0;
+    for (int i = 0; i < n; i++)
+    {
+        __int128 p = b ? (__int128)a[i] * b[i] : a[i];
+        if (__builtin_add_overflow(part, p, &part))
+        {
+            add_int128(&acc, part - p);
+            part = p;
+        }
+    }
+    add_int128(&acc, part);
+    return make_integer(acc);
+}
+
+// (vec-sum <intvector>)
+static Object *primitive_VEC_SUM(int argc, Object **argv)
+{
+    if (argc != 1)
+        error("Malformed vec-sum");
+    Object *v = int_vector_arg(argv[0], "vec-sum");
+    int64_t r;
+    if (!vec_kernels.sum(&r, v->ints, v->nints))
+        return exact_sum(v->ints, NULL, v->nints);
+    return make_int(r);
+}
+
+// (vec-dot <intvector> <intvector>)
+static Object *primitive_VEC_DOT(int argc, Object **argv)
+{
+    int_vector_args(argc, argv, "vec-dot");
+    int64_t r;
+    if (!vec_kernels.dot(&r, argv[0]->ints, argv[1]->ints, argv[0]->nints))
+        return exact_sum(argv[0]->ints, argv[1]->ints, argv[0]->nints);
+    return make_int(r);
+}
+
+// (vec-min <intvector>), (vec-max <intvector>)
+static Object *vec_extremum(int argc, Object **argv, bool max, char *name)
+{
+    if (argc != 1)
+        error("Malformed %s", name);
+    Object *v = int_vector_arg(argv[0], name);
+    if (v->nints == 0)
+        error("%s: empty vector", name);
+    return make_int(vec_kernels.extremum(v->ints, v->nints, max));
+}
+
+static Object *primitive_VEC_MIN(int argc, Object **argv)
+{
+    return vec_extremum(argc, argv, false, "vec-min");
+}
+
+static Object *primitive_VEC_MAX(int argc, Object **argv)
+{
+    return vec_extremum(argc, argv, true, "vec-max");
+}
+
+// Defines an elementwise comparison (op <intvector> <intvector>), which returns an integer vector
+// of 1 where the comparison holds and 0 elsewhere.
+#define DEFINE_VEC_COMPARISON(fname, cmp, name)                                      \
+    static Object *fname(int argc, Object **argv)                                    \
+    {                                                                                \
+        int_vector_args(argc, argv, name);                                           \
+        Object *r = make_int_vector(argv[0]->nints);                                 \
+        vec_kernels.compare(r->ints, argv[0]->ints, argv[1]->ints, r->nints, cmp);   \
+        return r;                                                                    \
+    }
+
+DEFINE_VEC_COMPARISON(primitive_VEC_EQ, VEC_EQ, "vec=")
+DEFINE_VEC_COMPARISON(primitive_VEC_LT, VEC_LT, "vec<")
+DEFINE_VEC_COMPARISON(primitive_VEC_LE, VEC_LE, "vec<=")
+DEFINE_VEC_COMPARISON(primitive_VEC_GT, VEC_GT, "vec>")
+DEFINE_VEC_COMPARISON(primitive_VEC_GE, VEC_GE, "vec>=")
+
+// (string-length <string>)
+static Object *primitive_STRING_LENGTH(int argc, Object **argv)
+{
+    if (argc != 1 || type_of(argv[0]) != STRING)
+        error("Malformed string-length");
+    return make_fixnum(argv[0]->nbytes);
+}
+
+// (string-ref <string> <integer>) returns the byte at the index as an integer in [0, 255].
+static Object *primitive_STRING_REF(int argc, Object **argv)
+{
+    if (argc != 2 || type_of(argv[0]) != STRING)
+        error("Malformed string-ref");
+    Object *str = argv[0];
+    return make_fixnum((unsigned char)str->bytes[index_arg(argv[1], str->nbytes, "string-ref")]);
+}
+
+// (stats) writes the profile to the standard output; see print_stats().
+static Object *primitive_STATS(int argc, Object **argv)
+{
+    if (argc != 0)
+        error("Malformed stats");
+    pthread_mutex_lock(&output_lock);
+    out_flush();
+    pthread_mutex_unlock(&output_lock);
+    print_stats(stdout);
+    fflush(stdout);
+    return Nil;
+}
+
+// (exit)
+static Object *primitive_EXIT(int argc, Object **argv)
+{
+    out_flush();
+    exit(0);
+}
+
+// (catch fn handler) calls fn with no arguments and returns its value. If an error is raised in the
+// meantime, it returns the value of (handler condition) instead, where the condition describes the
+// error.
+static Object *primitive_CATCH(int argc, Object **argv)
+{
+    if (argc != 2 || !is_function(argv[0]) || !is_function(argv[1]))
+        error("Malformed catch");
+    Handler h;
+    if (CATCH(h))
+    {
+        Object *r = funcall(argv[0], 0);
+        pop_handler(&h);
+        return r;
+    }
+    pop_handler(&h);
+    Object *c = make_condition(ctx->error);
+    return call1(argv[1], c);
+}
+
+// (try expr handler) is (catch (lambda () expr) handler). The resolver expands it; see
+// expand_try().
+static Object *primitive_TRY(Object *env, Object *list)
+{
+    error("Bug: try is not expanded");
+}
+
+//======================================================================
+// Resolver
+//======================================================================
+
+// The resolver runs once over every top-level form before it is evaluated. It replaces the
+// references to local variables with (depth, index) pairs and compiles each lambda into a function
+// template, so that the evaluator never has to look up a variable by name. It also expands the
+// macro calls, so a macro runs once per call site rather than every time the code is evaluated, and
+// folds the constant expressions in lambdas.
+
+// A frame of a lambda being resolved. vars lists the symbols of the frame's slots in reverse order.
+// Once a frame has more than SCOPE_HASH_MIN slots, syms also has them by index, and table is an
+// open-addressing hash table of their indices plus one, keyed by the symbols' hashes, so that a
+// frame with thousands of definitions is searched in constant time. Both are objects, so that the
+// collector can move the symbols.
+#define SCOPE_HASH_MIN 16
+
+typedef struct Scope
+{
+    Object *vars;
+    int nslots;
+    struct Scope *up;
+    Object *syms;
+    Object *table;
+} Scope;
+
+static Object *resolve(Scope *scope, Object *obj);
+
+// Returns the index of the symbol's slot in the frame, or -1 if it has none. If the symbol names
+// more than one slot, the last one wins.
+static int scope_index(Scope *scope, Object *sym)
+{
+    if (scope->table)
+    {
+        int64_t mask = scope->table->nints - 1;
+        for (int64_t h = sym->hash & mask;; h = (h + 1) & mask)
+        {
+            int64_t i = scope->table->ints[h];
+            if (!i)
+                return -1;
+            if (scope->syms->elems[i - 1] == sym)
+                return i - 1;
+        }
+    }
+    int i = scope->nslots - 1;
+    for (Object *p = scope->vars; p != Nil; p = p->cdr, i--)
+        if (p->car == sym)
+            return i;
+    return -1;
+}
+
+static bool in_frame(Scope *scope, Object *sym)
+{
+    return scope_index(scope, sym) >= 0;
+}
+
+static bool lookup(Scope *scope, Object *sym, int *depth, int *index)
+{
+    for (int d = 0; scope; scope = scope->up, d++)
+    {
+        int i = scope_index(scope, sym);
+        if (i >= 0)
+        {
+            *depth = d;
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Enters slot i, whose symbol is in syms, into the hash table.
+static void scope_insert(Scope *scope, int i)
+{
+    Object *sym = scope->syms->elems[i];
+    int64_t mask = scope->table->nints - 1;
+    int64_t h = sym->hash & mask;
+    while (scope->table->ints[h] && scope->syms->elems[scope->table->ints[h] - 1] != sym)
+        h = (h + 1) & mask;
+    scope->table->ints[h] = i + 1;
+}
+
+// Rebuilds syms and the table with room for twice as many slots as the frame has.
+static void scope_rehash(Scope *scope)
+{
+    int cap = SCOPE_HASH_MIN;
+    while (cap < scope->nslots * 2)
+        cap *= 2;
+    // The fields of the scope are roots.
+    scope->syms = make_vector(cap, Nil);
+    scope->table = make_int_vector(cap * 2);
+    int i = scope->nslots - 1;
+    for (Object *p = scope->vars; p != Nil; p = p->cdr, i--)
+        scope->syms->elems[i] = p->car;
+    for (i = 0; i < scope->nslots; i++)
+        scope_insert(scope, i);
+}
+
+static void add_slot(Scope *scope, Object *sym)
+{
+    scope->vars = cons(sym, scope->vars);
+    int i = scope->nslots++;
+    if (scope->nslots <= SCOPE_HASH_MIN)
+        return;
+    if (!scope->syms || scope->syms->nelems <= i)
+        scope_rehash(scope);
+    else
+    {
+        scope->syms->elems[i] = scope->vars->car;
+        note_store(&scope->syms->elems[i]);
+        scope_insert(scope, i);
+    }
+}
+
+// Returns the primitive function if the head of a form names a global special form that is not
+// shadowed by a local variable. Returns NULL otherwise.
+static Primitive *special_form(Scope *scope, Object *head)
+{
+    int depth, index;
+    if (type_of(head) != SYMBOL || lookup(scope, head, &depth, &index))
+        return NULL;
+    if (!head->global || type_of(head->global) != PRIMITIVE || !head->global->special)
+        return NULL;
+    return head->global->fn;
+}
+
+// Returns (<catch> (lambda () expr) handler) for (try expr handler). The primitive is put into the
+// form itself, so that redefining catch doesn't change try.
+static Object *expand_try(Object *obj)
+{
+    if (list_length(obj) != 3)
+        error("Malformed try");
+    ROOT_FRAME;
+    ROOT(obj);
+    Object *fn = NULL;
+    Object *prim = NULL;
+    ROOT(fn);
+    ROOT(prim);
+    fn = cons(obj->cdr->car, Nil);
+    fn = cons(Nil, fn);
+    prim = intern("lambda");
+    fn = cons(prim, fn);
+    prim = make_primitive(NULL, primitive_CATCH);
+    Object *r = cons(fn, obj->cdr->cdr);
+    return cons(prim, r);
+}
+
+// Expands the form while its head names a global macro that is not shadowed by a local variable.
+// The macro is applied to the unevaluated arguments by the interpreter. try is expanded here too.
+static Object *macroexpand(Scope *scope, Object *obj)
+{
+    ROOT_FRAME;
+    ROOT(obj);
+    Object *env = NULL;
+    Object *macro = NULL;
+    ROOT(env);
+    ROOT(macro);
+    for (;;)
+    {
+        int depth, index;
+        if (type_of(obj) != CELL || type_of(obj->car) != SYMBOL ||
+            lookup(scope, obj->car, &depth, &index))
+            return obj;
+        if (special_form(scope, obj->car) == primitive_TRY)
+            return expand_try(obj);
+        macro = obj->car->global;
+        if (!macro || type_of(macro) != MACRO)
+            return obj;
+        if (!is_list(obj->cdr))
+            error("Argument must be a list");
+        env = push_env(macro, obj->cdr);
+        obj = progn(env, macro->body);
+    }
+}
+
+// Adds the variables defined in the body to the frame, so that they get slots in it. Quoted data
+// and nested lambdas are not searched. Macro calls among the subforms are expanded in place first,
+// so that the definitions they produce are found, and so that resolve() sees each expansion
+// without running the macro again.
+static void collect_defines(Scope *scope, Object *obj)
+{
+    check_c_stack();
+    if (type_of(obj) != CELL)
+        return;
+    ROOT_FRAME;
+    ROOT(obj);
+    Primitive *fn = special_form(scope, obj->car);
+    if (fn == primitive_QUOTE || fn == primitive_LAMBDA || fn == primitive_DEFMACRO)
+        return;
+    if (fn == primitive_DEFINE && type_of(obj->cdr) == CELL && type_of(obj->cdr->car) == SYMBOL &&
+        !in_frame(scope, obj->cdr->car))
+        add_slot(scope, obj->cdr->car);
+    for (; type_of(obj) == CELL; obj = obj->cdr)
+    {
+        Object *expanded = macroexpand(scope, obj->car);
+        obj->car = expanded;
+        note_store(&obj->car);
+        collect_defines(scope, expanded);
+    }
+}
+
+// Resolves the elements of the list and returns them as a new list.
+static Object *resolve_list(Scope *scope, Object *list)
+{
+    ROOT_FRAME;
+    ROOT(list);
+    Object *head = Nil;
+    Object *tail = NULL;
+    ROOT(head);
+    ROOT(tail);
+    for (; type_of(list) == CELL; list = list->cdr)
+    {
+        Object *tmp = resolve(scope, list->car);
+        tmp = cons(tmp, Nil);
+        if (tail)
+        {
+            tail->cdr = tmp;
+            note_store(&tail->cdr);
+        }
+        else
+            head = tmp;
+        tail = tmp;
+    }
+    if (list != Nil)
+    {
+        if (tail)
+        {
+            tail->cdr = list;
+            note_store(&tail->cdr);
+        }
+        else
+            head = list;
+    }
+    return head;
+}
+
+// Returns true if obj is the primitive fn that takes evaluated arguments.
+static inline bool is_builtin(Object *obj, Builtin *fn)
+{
+    return obj && !is_fixnum(obj) && obj->type == PRIMITIVE && !obj->special && obj->builtin == fn;
+}
+
+// Constant folding. Within a lambda, a call of an arithmetic or comparison primitive on numbers is
+// computed when the lambda is resolved, so that it isn't evaluated on every call, and an if with a
+// literal condition is replaced by the branch it takes. A folded call becomes
+// (<folded> version value call), which gives the value as long as fold_version is the version, and
+// evaluates the call otherwise, so that redefining a primitive is seen by the bodies folded before.
+// A variable never counts as a constant, not even t, since setvalue may change it.
+
+// The primitives that have no side effects and return a number or a boolean for numbers
+static Builtin *const foldable[] = {
+    primitive_PLUS, primitive_MINUS, primitive_TIMES, primitive_DIVIDE, primitive_MOD,
+    primitive_EQUAL, primitive_LT, primitive_LE, primitive_GT, primitive_GE,
+};
+
+static bool is_foldable(Object *obj)
+{
+    for (size_t i = 0; i < sizeof(foldable) / sizeof(foldable[0]); i++)
+        if (is_builtin(obj, foldable[i]))
+            return true;
+    return false;
+}
+
+// (<folded> version value call)
+static Object *primitive_FOLDED(Object *env, Object *list)
+{
+    if (list->car == make_fixnum(fold_version))
+        return list->cdr->car;
+    return eval(env, list->cdr->cdr->car);
+}
+
+// Returns true if the resolved expression is a folded call.
+static inline bool is_folded(Object *obj)
+{
+    return type_of(obj) == CELL && type_of(obj->car) == PRIMITIVE && obj->car->special &&
+           obj->car->fn == primitive_FOLDED;
+}
+
+// Returns the value of the resolved expression if it is an integer, or a call folded at the version,
+// or NULL.
+static Object *folded_integer(Object *obj, Object *version)
+{
+    if (is_folded(obj) && obj->cdr->car == version)
+        obj = obj->cdr->cdr->car;
+    return is_integer(obj) ? obj : NULL;
+}
+
+// Returns true if the value of the resolved expression is known, and stores it in *value.
+static bool constant_value(Scope *scope, Object *obj, Object **value)
+{
+    switch (type_of(obj))
+    {
+    case INTEGER:
+    case BIGNUM:
+    case STRING:
+        *value = obj;
+        return true;
+    case KEYWORD:
+        *value = obj;
+        return obj == Nil;
+    case CELL:
+        // (quote x)
+        if (special_form(scope, obj->car) != primitive_QUOTE || type_of(obj->cdr) != CELL ||
+            obj->cdr->cdr != Nil)
+            return false;
+        *value = obj->cdr->car;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns the folded form of the resolved call if its value can be computed now, or NULL. If the
+// call raises an error, it is left to raise it when it is evaluated.
+static Object *fold_call(Object *form)
+{
+    // The version is read first, so that a primitive rebound meanwhile makes the result stale.
+    Object *version = make_fixnum(__atomic_load_n(&fold_version, __ATOMIC_RELAXED));
+    Object *fn = type_of(form->car) == SYMBOL ? form->car->global : NULL;
+    if (!is_foldable(fn))
+        return NULL;
+    int n = 0;
+    for (Object *p = form->cdr; p != Nil; p = p->cdr, n++)
+        if (type_of(p) != CELL || !folded_integer(p->car, version) || VM_STACK_SIZE <= ctx->vm_sp + n)
+            return NULL;
+    for (Object *p = form->cdr; p != Nil; p = p->cdr)
+        ctx->vm_stack[ctx->vm_sp++] = folded_integer(p->car, version);
+    ROOT_FRAME;
+    ROOT(form);
+    Handler h;
+    Object *r;
+    if (CATCH(h))
+    {
+        r = funcall(fn, n);
+        pop_handler(&h);
+    }
+    else
+    {
+        pop_handler(&h);
+        return NULL;
+    }
+    ROOT(r);
+    Object *head = make_primitive(primitive_FOLDED, NULL);
+    ROOT(head);
+    Object *tail = cons(form, Nil);
+    tail = cons(r, tail);
+    tail = cons(version, tail);
+    return cons(head, tail);
+}
+
+// Returns the expression that the resolved (if expr expr expr ...) comes down to if its condition
+// is constant, or NULL. A folded condition doesn't count, as the branch would be wrong once the
+// call is evaluated again.
+static Object *fold_if(Scope *scope, Object *form)
+{
+    Object *value;
+    Object *args = form->cdr;
+    if (!is_list(args) || list_length(args) < 2 || !constant_value(scope, args->car, &value))
+        return NULL;
+    if (value != Nil)
+        return args->cdr->car;
+    Object *rest = args->cdr->cdr;
+    if (rest == Nil)
+        return Nil;
+    // There is no form that evaluates several others, so such an else branch stays.
+    return rest->cdr == Nil ? rest->car : NULL;
+}
+
+// Folds the resolved form, whose head names the special form fn if fn is not NULL.
+static Object *fold(Scope *scope, Object *form, Primitive *fn)
+{
+    ROOT_FRAME;
+    ROOT(form);
+    Object *r = fn == primitive_IF ? fold_if(scope, form) : fn ? NULL : fold_call(form);
+    return r ? r : form;
+}
+
+// Compiles ((<symbol> ...) expr ...) into a function template.
+static Object *handle_function(Scope *scope, Object *list, int type)
+{
+    if (type_of(list) != CELL || !is_list(list->car) || type_of(list->cdr) != CELL)
+        error("Unable to create new lambda");
+    for (Object *p = list->car; p != Nil; p = p->cdr)
+    {
+        if (type_of(p->car) != SYMBOL)
+            error("Parameter must be a symbol");
+        if (!is_list(p->cdr))
+            error("Parameter list is not a flat list");
+    }
+    ROOT_FRAME;
+    ROOT(list);
+    Scope frame = {Nil, 0, scope, NULL, NULL};
+    ROOT(frame.vars);
+    ROOT(frame.syms);
+    ROOT(frame.table);
+    Object *p = list->car;
+    ROOT(p);
+    for (; p != Nil; p = p->cdr)
+        add_slot(&frame, p->car);
+    int nparams = frame.nslots;
+    collect_defines(&frame, list->cdr);
+    Object *body = resolve_list(&frame, list->cdr);
+    return make_function(type, list->car, body, NULL, nparams, frame.nslots);
+}
+
+static Object *resolve(Scope *scope, Object *obj)
+{
+    check_c_stack();
+    switch (type_of(obj))
+    {
+    case SYMBOL:
+    {
+        int depth, index;
+        if (!lookup(scope, obj, &depth, &index))
+            return obj;
+        return make_lvar(obj, depth, index);
+    }
+    case CELL:
+    {
+        obj = macroexpand(scope, obj);
+        if (type_of(obj) != CELL)
+            return resolve(scope, obj);
+        Primitive *fn = special_form(scope, obj->car);
+        if (fn == primitive_QUOTE)
+            return obj;
+        if (fn == primitive_DEFMACRO)
+        {
+            // (defmacro <symbol> <template>). A macro runs at resolve time, when no frame exists,
+            // so it can only be defined at the top level.
+            if (scope)
+                error("defmacro must be at the top level");
+            if (type_of(obj->cdr) != CELL || type_of(obj->cdr->car) != SYMBOL)
+                error("Malformed defmacro");
+            ROOT_FRAME;
+            ROOT(obj);
+            Object *tmpl = handle_function(scope, obj->cdr->cdr, MACRO);
+            tmpl = cons(tmpl, Nil);
+            tmpl = cons(obj->cdr->car, tmpl);
+            return cons(obj->car, tmpl);
+        }
+        if (fn == primitive_LAMBDA)
+        {
+            // (lambda <template>)
+            ROOT_FRAME;
+            ROOT(obj);
+            Object *tmpl = handle_function(scope, obj->cdr, FUNCTION);
+            tmpl = cons(tmpl, Nil);
+            return cons(obj->car, tmpl);
+        }
+        if (!scope)
+            return resolve_list(scope, obj);
+        return fold(scope, resolve_list(scope, obj), fn);
+    }
+    default:
+        return obj;
+    }
+}
+
+//======================================================================
+// Compiler
+//======================================================================
+
+// The compiler turns a resolved form into bytecode for a stack machine. A function's bytecode
+// computes its body on the VM stack and returns the value on top. Each instruction is one 32-bit
+// word with the opcode in the low 8 bits and the operand in the upper 24 bits.
+enum
+{
+    OP_CONST,       // Push consts[arg]
+    OP_GLOBAL,      // Push the value of the global variable consts[arg]
+    OP_LOCAL,       // Push a slot; arg is depth << 16 | index, the next word the LVAR's constant index
+    OP_DEFGLOBAL,   // Bind the global variable consts[arg] to the value on top
+    OP_SETGLOBAL,   // Same as OP_DEFGLOBAL but the variable must be bound
+    OP_DEFLOCAL,    // Store the value on top into a slot, encoded as in OP_LOCAL
+    OP_SETLOCAL,    // Same as OP_DEFLOCAL but the slot must be bound
+    OP_POP,         // Discard the value on top
+    OP_JUMP,        // Jump to the instruction at arg
+    OP_JUMP_IF_NIL, // Pop a value and jump to the instruction at arg if it is ()
+    OP_CLOSURE,     // Push a closure of the function template consts[arg] over the current frame
+    OP_CALL,        // Call the function below the top arg values with those values as arguments
+    OP_TAILCALL,    // Same as OP_CALL followed by OP_RETURN, but reusing the current VM frame
+    OP_CALL_GLOBAL, // Call the global function consts[k] with the top arg values, k being the next
+                    // word; consts[k + 1] and consts[k + 2] are the call site's inline cache
+    OP_TAILCALL_GLOBAL, // Same as OP_CALL_GLOBAL followed by OP_RETURN, like OP_TAILCALL
+    OP_RETURN,      // Return the value on top to the caller
+    OP_EVAL,        // Push the value of consts[arg] computed by the interpreter
+    OP_FOLDED,      // If fold_version is consts[k], k being the next word, push consts[k + 1] and
+                    // jump to the instruction at arg
+
+    // Calls of the arithmetic primitives and vector-ref with two arguments. Each replaces the
+    // arguments on top by the result, computed inline if the arguments are fixnums (a vector and a
+    // fixnum index in range for OP_VREF) and the global variable consts[arg] is still bound to the
+    // primitive. Otherwise the function bound to the variable is called.
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_EQ,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_VREF,
+};
+
+// The primitives compiled to the intrinsic opcodes
+static Builtin *intrinsics[] = {
+    [OP_ADD] = primitive_PLUS,
+    [OP_SUB] = primitive_MINUS,
+    [OP_MUL] = primitive_TIMES,
+    [OP_EQ] = primitive_EQUAL,
+    [OP_LT] = primitive_LT,
+    [OP_LE] = primitive_LE,
+    [OP_GT] = primitive_GT,
+    [OP_GE] = primitive_GE,
+    [OP_VREF] = primitive_VECTOR_REF,
+};
+
+// Returns the intrinsic opcode for a call of the global variable, or -1 if there is none.
+static int intrinsic_op(Object *head, int nargs)
+{
+    if (type_of(head) != SYMBOL || nargs != 2)
+        return -1;
+    for (int op = OP_ADD; op <= OP_VREF; op++)
+        if (is_builtin(head->global, intrinsics[op]))
+            return op;
+    return -1;
+}
+
+#define INSN(op, arg) ((uint32_t)(op) | (uint32_t)(arg) << 8)
+#define MAX_OPERAND ((1 << 24) - 1)
+
+typedef struct Compiler
+{
+    uint32_t *insns;
+    int ninsns;
+    int cap;
+    // The constants in reverse order
+    Object *consts;
+    int nconsts;
+    // The current and the maximum depth of the VM stack
+    int depth;
+    int maxdepth;
+} Compiler;
+
+static void compile_expr(Compiler *c, Object *obj, bool tail);
+
+static void emit_word(Compiler *c, uint32_t word)
+{
+    if (c->ninsns == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->insns = realloc(c->insns, sizeof(uint32_t) * c->cap);
+        if (!c->insns)
+            error("Memory exhausted");
+    }
+    c->insns[c->ninsns++] = word;
+}
+
+// Emits an instruction. effect is the change of the VM stack depth caused by the instruction.
+static void emit(Compiler *c, int op, int arg, int effect)
+{
+    if (arg < 0 || MAX_OPERAND < arg)
+        error("Function too large to compile");
+    emit_word(c, INSN(op, arg));
+    c->depth += effect;
+    if (c->maxdepth < c->depth)
+        c->maxdepth = c->depth;
+}
+
+// Sets the target of the jump instruction at pos to the current position.
+static void patch_jump(Compiler *c, int pos)
+{
+    c->insns[pos] |= (uint32_t)c->ninsns << 8;
+}
+
+#define CONST_WINDOW 64
+
+// Adds a constant and returns its index. A constant among the last CONST_WINDOW ones is shared, so
+// that a long body doesn't take time quadratic in its number of constants.
+static int add_const(Compiler *c, Object *obj)
+{
+    int i = c->nconsts - 1;
+    for (Object *p = c->consts; p != Nil && c->nconsts - i <= CONST_WINDOW; p = p->cdr, i--)
+        if (p->car == obj)
+            return i;
+    c->consts = cons(obj, c->consts);
+    return c->nconsts++;
+}
+
+// Adds an inline cache for a call of the global function sym, and returns the index of sym. The
+// cache is a pair of the global version and the function that was bound to sym at that version,
+// which is known to be compiled and to take the number of arguments given at the call site.
+static int add_cache(Compiler *c, Object *sym)
+{
+    c->consts = cons(sym, c->consts);
+    c->consts = cons(Nil, c->consts);
+    c->consts = cons(Nil, c->consts);
+    c->nconsts += 3;
+    return c->nconsts - 3;
+}
+
+// Emits an instruction that refers to a variable, which is either a global symbol or an LVAR.
+static void emit_variable(Compiler *c, int global_op, int local_op, Object *var, int effect)
+{
+    ROOT_FRAME;
+    ROOT(var);
+    int k = add_const(c, var);
+    if (var->type == SYMBOL)
+    {
+        emit(c, global_op, k, effect);
+        return;
+    }
+    if (255 < var->depth || 65535 < var->index)
+        error("Function too large to compile");
+    emit(c, local_op, var->depth << 16 | var->index, effect);
+    emit_word(c, k);
+}
+
+// Compiles the list of forms. If tail is true, the last form is in a tail position.
+static void compile_body(Compiler *c, Object *list, bool tail)
+{
+    ROOT_FRAME;
+    ROOT(list);
+    if (list == Nil)
+    {
+        emit(c, OP_CONST, add_const(c, Nil), 1);
+        return;
+    }
+    for (; list->cdr != Nil; list = list->cdr)
+    {
+        compile_expr(c, list->car, false);
+        emit(c, OP_POP, 0, -1);
+    }
+    compile_expr(c, list->car, tail);
+}
+
+// (<folded> version value call). The call is compiled after the instruction that skips it.
+static void compile_folded(Compiler *c, Object *list, bool tail)
+{
+    ROOT_FRAME;
+    ROOT(list);
+    c->consts = cons(list->car, c->consts);
+    c->consts = cons(list->cdr->car, c->consts);
+    c->nconsts += 2;
+    int jump_end = c->ninsns;
+    emit(c, OP_FOLDED, 0, 0);
+    emit_word(c, c->nconsts - 2);
+    compile_expr(c, list->cdr->cdr->car, tail);
+    patch_jump(c, jump_end);
+}
+
+// (if expr expr expr ...)
+static void compile_if(Compiler *c, Object *list, bool tail)
+{
+    if (list_length(list) < 2)
+        error("Malformed if");
+    ROOT_FRAME;
+    ROOT(list);
+    compile_expr(c, list->car, false);
+    int jump_else = c->ninsns;
+    emit(c, OP_JUMP_IF_NIL, 0, -1);
+    compile_expr(c, list->cdr->car, tail);
+    int jump_end = c->ninsns;
+    emit(c, OP_JUMP, 0, 0);
+    c->depth--;
+    patch_jump(c, jump_else);
+    compile_body(c, list->cdr->cdr, tail);
+    patch_jump(c, jump_end);
+}
+
+// (define <symbol> expr) and (setvalue <symbol> expr)
+static void compile_assign(Compiler *c, Object *list, bool define)
+{
+    if (list_length(list) != 2 || !is_variable(list->car))
+        error(define ? "Malformed setq" : "Unable to set new value");
+    ROOT_FRAME;
+    ROOT(list);
+    compile_expr(c, list->cdr->car, false);
+    if (define)
+        emit_variable(c, OP_DEFGLOBAL, OP_DEFLOCAL, list->car, 0);
+    else
+        emit_variable(c, OP_SETGLOBAL, OP_SETLOCAL, list->car, 0);
+}
+
+static void compile_call(Compiler *c, Object *obj, bool tail)
+{
+    if (!is_list(obj->cdr))
+        error("Argument must be a list");
+    ROOT_FRAME;
+    ROOT(obj);
+    Object *p = obj->cdr;
+    ROOT(p);
+    int nargs = 0;
+    int op = intrinsic_op(obj->car, list_length(obj->cdr));
+    bool global = type_of(obj->car) == SYMBOL;
+    if (op < 0 && !global)
+        compile_expr(c, obj->car, false);
+    for (; p != Nil; p = p->cdr, nargs++)
+    {
+        if (type_of(p) != CELL)
+            error("Cannot handle dotted list");
+        compile_expr(c, p->car, false);
+    }
+    if (0 <= op)
+        emit(c, op, add_const(c, obj->car), -1);
+    else if (global)
+    {
+        int k = add_cache(c, obj->car);
+        emit(c, tail ? OP_TAILCALL_GLOBAL : OP_CALL_GLOBAL, nargs, 1 - nargs);
+        emit_word(c, k);
+    }
+    else
+        emit(c, tail ? OP_TAILCALL : OP_CALL, nargs, -nargs);
+}
+
+// Compiles the expression. If tail is true, the expression is in a tail position, and the value it
+// leaves on the stack is returned right away.
+static void compile_expr(Compiler *c, Object *obj, bool tail)
+{
+    check_c_stack();
+    switch (type_of(obj))
+    {
+    case SYMBOL:
+    case LVAR:
+        emit_variable(c, OP_GLOBAL, OP_LOCAL, obj, 1);
+        return;
+    case CELL:
+        break;
+    default:
+        // Self-evaluating objects
+        emit(c, OP_CONST, add_const(c, obj), 1);
+        return;
+    }
+
+    ROOT_FRAME;
+    ROOT(obj);
+    Primitive *fn = special_form(NULL, obj->car);
+    if (is_folded(obj))
+        compile_folded(c, obj->cdr, tail);
+    else if (!fn)
+        compile_call(c, obj, tail);
+    else if (fn == primitive_QUOTE)
+    {
+        if (list_length(obj->cdr) != 1)
+            error("Malformed quote");
+        emit(c, OP_CONST, add_const(c, obj->cdr->car), 1);
+    }
+    else if (fn == primitive_IF)
+        compile_if(c, obj->cdr, tail);
+    else if (fn == primitive_DEFINE || fn == primitive_SETVALUE)
+        compile_assign(c, obj->cdr, fn == primitive_DEFINE);
+    else if (fn == primitive_LAMBDA)
+    {
+        // (lambda <template>)
+        Object *tmpl = obj->cdr->car;
+        if (!tmpl->code)
+        {
+            ROOT(tmpl);
+            Object *code = compile(tmpl->body);
+            tmpl->code = code;
+            note_store(&tmpl->code);
+        }
+        emit(c, OP_CLOSURE, add_const(c, tmpl), 1);
+    }
+    else
+        // Any other special form is left to the interpreter.
+        emit(c, OP_EVAL, add_const(c, obj), 1);
+}
+
+// Compiles the list of forms into a code object that evaluates them in order and returns the value
+// of the last one.
+static Object *compile(Object *body)
+{
+    ROOT_FRAME;
+    ROOT(body);
+    Compiler c = {0};
+    c.consts = Nil;
+    ROOT(c.consts);
+    compile_body(&c, body, true);
+    emit(&c, OP_RETURN, 0, -1);
+
+    // One more slot for the callee that the VM pushes while it enters a function.
+    Object *code = make_code(c.nconsts, c.ninsns, c.maxdepth + 1);
+    int i = c.nconsts - 1;
+    for (Object *p = c.consts; p != Nil; p = p->cdr)
+        code->consts[i--] = p->car;
+    memcpy(code_insns(code), c.insns, sizeof(uint32_t) * c.ninsns);
+    free(c.insns);
+    return code;
+}
+
+//======================================================================
+// Native code
+//======================================================================
+
+// Once the VM has entered a code object JIT_THRESHOLD times, the code is compiled to x86-64 machine
+// code, instruction by instruction. The native code works on the VM stack and frames just like the
+// VM does, with the stack pointer, the frame and the code object in registers. It runs from a given
+// instruction until it reaches one that it doesn't handle or whose guard fails, and returns the pc
+// of that instruction for the VM to execute it. So the native code never holds a state that the VM
+// can't take over, and falling back to the VM is just a return.
+//
+// The constants, the variables, the jumps and the intrinsics on fixnums and vectors, under the
+// same guards as in the VM, are handled natively, as are the tail calls of a function to itself if
+// it creates no closures, which reuse the frame. Calls, returns and anything else are left to the
+// VM. The native code never allocates, so GC can't run in it, and it doesn't refer to the
+// interpreter, so copies of an interpreter share it.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// The number of instructions that must run natively from a point on for the VM to switch there
+#define JIT_MIN_RUN 3
+
+// The limit of the memory of all native code, which is never freed. Once it is reached, no more
+// code is compiled.
+#define JIT_MEMORY_LIMIT (64 << 20)
+
+// Cleared by --no-jit
+static bool jit_enabled = true;
+
+static inline Native *native_code(Object *code)
+{
+    return __atomic_load_n(&code->native, __ATOMIC_ACQUIRE);
+}
+
+#if defined(__x86_64__)
+
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t jit_memory_used;
+
+// The registers. The native code keeps the VM stack pointer in SP_REG, the frame in ENV_REG, the
+// code object in CODE_REG and the address of gc_pending in PENDING_REG; the others are scratch.
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+};
+#define SP_REG RBX
+#define ENV_REG R12
+#define CODE_REG R13
+#define PENDING_REG R14
+
+// The condition codes
+enum
+{
+    CC_O = 0x0,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+};
+
+// A rel32 field to be filled in once the code is laid out: a jump to the native code of the
+// instruction at pc, or to an exit to the VM at pc.
+typedef struct Fixup
+{
+    int pos;
+    int pc;
+    bool exit;
+} Fixup;
+
+typedef struct Jit
+{
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    // The offset of the code of each instruction, or -1 for the operand words
+    int *labels;
+    Fixup *fixups;
+    int nfixups;
+    int fixups_cap;
+    // Set when memory ran out, in which case the code is dropped
+    bool failed;
+} Jit;
+
+static void jit_byte(Jit *j, int b)
+{
+    if (j->len == j->cap)
+    {
+        size_t cap = j->cap ? j->cap * 2 : 4096;
+        uint8_t *buf = realloc(j->buf, cap);
+        if (!buf)
+        {
+            j->failed = true;
+            return;
+        }
+        j->buf = buf;
+        j->cap = cap;
+    }
+    j->buf[j->len++] = b;
+}
+
+static void jit_u32(Jit *j, uint32_t v)
+{
+    for (int i = 0; i < 32; i += 8)
+        jit_byte(j, v >> i & 0xff);
+}
+
+static void jit_u64(Jit *j, uint64_t v)
+{
+    jit_u32(j, (uint32_t)v);
+    jit_u32(j, (uint32_t)(v >> 32));
+}
+
+// Emits the REX prefix if the instruction needs one: for 64-bit operands, or for the registers
+// from R8 on as reg or as the base.
+static void jit_rex(Jit *j, bool wide, int reg, int base)
+{
+    int rex = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+    if (rex != 0x40)
+        jit_byte(j, rex);
+}
+
+static void jit_opcode(Jit *j, int op)
+{
+    if (0xff < op)
+        jit_byte(j, op >> 8);
+    jit_byte(j, op & 0xff);
+}
+
+// Emits the instruction op that takes reg, or an opcode extension, and the memory at base + disp.
+static void jit_mem(Jit *j, bool wide, int op, int reg, int base, int32_t disp)
+{
+    jit_rex(j, wide, reg, base);
+    jit_opcode(j, op);
+    bool short_disp = disp == (int8_t)disp;
+    jit_byte(j, (short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        jit_byte(j, 0x24);
+    if (short_disp)
+        jit_byte(j, disp & 0xff);
+    else
+        jit_u32(j, disp);
+}
+
+// Emits the instruction op that takes reg, or an opcode extension, and the register rm.
+static void jit_reg(Jit *j, bool wide, int op, int reg, int rm)
+{
+    jit_rex(j, wide, reg, rm);
+    jit_opcode(j, op);
+    jit_byte(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// mov dst, [base + disp]
+static void jit_load(Jit *j, int dst, int base, int32_t disp)
+{
+    jit_mem(j, true, 0x8b, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void jit_store(Jit *j, int base, int32_t disp, int src)
+{
+    jit_mem(j, true, 0x89, src, base, disp);
+}
+
+// mov dst, imm
+static void jit_imm(Jit *j, int dst, uint64_t imm)
+{
+    jit_rex(j, true, 0, dst);
+    jit_byte(j, 0xb8 | (dst & 7));
+    jit_u64(j, imm);
+}
+
+// add reg, imm or sub reg, imm
+static void jit_add(Jit *j, int reg, int32_t imm)
+{
+    jit_reg(j, true, imm == (int8_t)imm ? 0x83 : 0x81, imm < 0 ? 5 : 0, reg);
+    if (imm == (int8_t)imm)
+        jit_byte(j, abs(imm));
+    else
+        jit_u32(j, abs(imm));
+}
+
+// test reg, 1, which clears ZF for a fixnum
+static void jit_test_fixnum(Jit *j, int reg)
+{
+    jit_reg(j, true, 0xf7, 0, reg);
+    jit_u32(j, 1);
+}
+
+// cmp dword [base + disp], imm
+static void jit_cmp_int(Jit *j, int base, int32_t disp, int32_t imm)
+{
+    jit_mem(j, false, 0x81, 7, base, disp);
+    jit_u32(j, imm);
+}
+
+// Fills in the rel32 field at pos to refer to target.
+static void jit_patch(Jit *j, size_t pos, size_t target)
+{
+    int32_t rel = (int32_t)(target - (pos + 4));
+    memcpy(j->buf + pos, &rel, sizeof(rel));
+}
+
+// Emits a jump, conditional unless cc is -1, to the instruction at pc, or to an exit at pc if exit
+// is set.
+static void jit_jump(Jit *j, int cc, int pc, bool exit)
+{
+    if (cc < 0)
+        jit_byte(j, 0xe9);
+    else
+        jit_opcode(j, 0x0f80 | cc);
+    if (j->nfixups == j->fixups_cap)
+    {
+        int cap = j->fixups_cap ? j->fixups_cap * 2 : 256;
+        Fixup *fixups = realloc(j->fixups, sizeof(Fixup) * cap);
+        if (!fixups)
+        {
+            j->failed = true;
+            return;
+        }
+        j->fixups = fixups;
+        j->fixups_cap = cap;
+    }
+    j->fixups[j->nfixups++] = (Fixup){j->len, pc, exit};
+    jit_u32(j, 0);
+}
+
+// The helper for the write barrier
+static void jit_note_store(Object **field)
+{
+    note_store(field);
+}
+
+// Emits the write barrier for the store of val to [base + disp]. Fixnums need none.
+static void jit_barrier(Jit *j, int val, int base, int32_t disp)
+{
+    jit_test_fixnum(j, val);
+    jit_byte(j, 0x75); // jnz
+    size_t skip = j->len;
+    jit_byte(j, 0);
+    jit_mem(j, true, 0x8d, RDI, base, disp);
+    jit_imm(j, RAX, (uintptr_t)jit_note_store);
+    jit_reg(j, false, 0xff, 2, RAX); // call rax
+    if (!j->failed)
+        j->buf[skip] = j->len - skip - 1;
+}
+
+// Loads the frame depth levels up into RAX, and returns the register that holds it.
+static int jit_frame(Jit *j, int depth)
+{
+    if (depth == 0)
+        return ENV_REG;
+    jit_load(j, RAX, ENV_REG, offsetof(Object, up));
+    for (int d = 1; d < depth; d++)
+        jit_load(j, RAX, RAX, offsetof(Object, up));
+    return RAX;
+}
+
+static void jit_push(Jit *j, int reg)
+{
+    jit_store(j, SP_REG, 0, reg);
+    jit_add(j, SP_REG, sizeof(Object *));
+}
+
+static void jit_load_const(Jit *j, int dst, int k)
+{
+    jit_load(j, dst, CODE_REG, offsetof(Object, consts) + sizeof(Object *) * k);
+}
+
+// Exits at pc unless the global variable consts[k] is bound to the primitive fn.
+static void jit_guard_builtin(Jit *j, int k, Builtin *fn, int pc)
+{
+    jit_load_const(j, RDX, k);
+    jit_load(j, RDX, RDX, offsetof(Object, global));
+    jit_reg(j, true, 0x85, RDX, RDX); // test rdx, rdx
+    jit_jump(j, CC_E, pc, true);
+    jit_test_fixnum(j, RDX);
+    jit_jump(j, CC_NE, pc, true);
+    jit_cmp_int(j, RDX, offsetof(Object, type), PRIMITIVE);
+    jit_jump(j, CC_NE, pc, true);
+    jit_mem(j, false, 0x80, 7, RDX, offsetof(Object, special)); // cmp byte [rdx + special], 0
+    jit_byte(j, 0);
+    jit_jump(j, CC_NE, pc, true);
+    jit_imm(j, RSI, (uintptr_t)fn);
+    jit_mem(j, true, 0x39, RSI, RDX, offsetof(Object, builtin));
+    jit_jump(j, CC_NE, pc, true);
+}
+
+// Loads the two arguments of an intrinsic into RAX and RCX, and exits at pc unless both are
+// fixnums and the intrinsic is still bound to its primitive.
+static void jit_fixnum_args(Jit *j, int op, int k, int pc)
+{
+    jit_load(j, RAX, SP_REG, -2 * (int)sizeof(Object *));
+    jit_load(j, RCX, SP_REG, -(int)sizeof(Object *));
+    jit_reg(j, true, 0x89, RAX, RDX); // mov rdx, rax
+    jit_reg(j, true, 0x21, RCX, RDX); // and rdx, rcx
+    jit_test_fixnum(j, RDX);
+    jit_jump(j, CC_E, pc, true);
+    jit_guard_builtin(j, k, intrinsics[op], pc);
+}
+
+// Emits the tail call at pc of the global function consts[k] with nargs arguments, as a jump to
+// the start if it calls the function being run. The frame is reused: the arguments go to its
+// first slots and the other slots are cleared.
+static void jit_self_call(Jit *j, int pc, int nargs, int k, int nslots)
+{
+    jit_load_const(j, RAX, k);
+    jit_load(j, RAX, RAX, offsetof(Object, global));
+    jit_reg(j, true, 0x85, RAX, RAX);
+    jit_jump(j, CC_E, pc, true);
+    jit_test_fixnum(j, RAX);
+    jit_jump(j, CC_NE, pc, true);
+    jit_cmp_int(j, RAX, offsetof(Object, type), FUNCTION);
+    jit_jump(j, CC_NE, pc, true);
+    jit_mem(j, true, 0x39, CODE_REG, RAX, offsetof(Object, code));
+    jit_jump(j, CC_NE, pc, true);
+    jit_load(j, RDX, ENV_REG, offsetof(Object, up));
+    jit_mem(j, true, 0x39, RDX, RAX, offsetof(Object, env));
+    jit_jump(j, CC_NE, pc, true);
+    jit_cmp_int(j, RAX, offsetof(Object, nparams), nargs);
+    jit_jump(j, CC_NE, pc, true);
+    jit_cmp_int(j, ENV_REG, offsetof(Object, nvars), nslots);
+    jit_jump(j, CC_NE, pc, true);
+    // A thread waiting to collect must get to run.
+    jit_mem(j, false, 0x80, 7, PENDING_REG, 0);
+    jit_byte(j, 0);
+    jit_jump(j, CC_NE, pc, true);
+
+    for (int i = 0; i < nslots; i++)
+    {
+        int32_t disp = offsetof(Object, slots) + sizeof(Object *) * i;
+        if (i < nargs)
+        {
+            jit_load(j, RCX, SP_REG, -(int)sizeof(Object *) * (nargs - i));
+            jit_store(j, ENV_REG, disp, RCX);
+            jit_barrier(j, RCX, ENV_REG, disp);
+        }
+        else
+        {
+            jit_mem(j, true, 0xc7, 0, ENV_REG, disp); // mov qword [env + disp], NULL
+            jit_u32(j, 0);
+        }
+    }
+    jit_add(j, SP_REG, -(int)sizeof(Object *) * nargs);
+    jit_jump(j, -1, 0, false);
+}
+
+// Returns the number of words of the instruction.
+static int insn_length(uint32_t insn)
+{
+    switch (insn & 0xff)
+    {
+    case OP_LOCAL:
+    case OP_DEFLOCAL:
+    case OP_SETLOCAL:
+    case OP_CALL_GLOBAL:
+    case OP_TAILCALL_GLOBAL:
+    case OP_FOLDED:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+// Returns true if the instruction runs natively. self_calls is set if the code's self tail calls do.
+static bool jit_handles(uint32_t insn, bool self_calls)
+{
+    switch (insn & 0xff)
+    {
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_CALL_GLOBAL:
+    case OP_RETURN:
+    case OP_CLOSURE:
+    case OP_EVAL:
+    case OP_DEFGLOBAL:
+    case OP_SETGLOBAL:
+        return false;
+    case OP_TAILCALL_GLOBAL:
+        return self_calls;
+    default:
+        return true;
+    }
+}
+
+// Emits the native code of the instruction at pc, and returns the pc of the next one.
+static int jit_insn(Jit *j, uint32_t *insns, int ninsns, int pc, int nslots, bool self_calls)
+{
+    static const int conditions[] = {
+        [OP_EQ] = CC_E, [OP_LT] = CC_L, [OP_LE] = CC_LE, [OP_GT] = CC_G, [OP_GE] = CC_GE,
+    };
+    uint32_t insn = insns[pc];
+    int op = insn & 0xff;
+    int arg = insn >> 8;
+    switch (op)
+    {
+    case OP_CONST:
+        jit_load_const(j, RAX, arg);
+        jit_push(j, RAX);
+        return pc + 1;
+    case OP_GLOBAL:
+        jit_load_const(j, RAX, arg);
+        jit_load(j, RAX, RAX, offsetof(Object, global));
+        jit_reg(j, true, 0x85, RAX, RAX);
+        jit_jump(j, CC_E, pc, true);
+        jit_push(j, RAX);
+        return pc + 1;
+    case OP_LOCAL:
+    {
+        int base = jit_frame(j, arg >> 16);
+        jit_load(j, RAX, base, offsetof(Object, slots) + sizeof(Object *) * (arg & 0xffff));
+        jit_reg(j, true, 0x85, RAX, RAX);
+        jit_jump(j, CC_E, pc, true);
+        jit_push(j, RAX);
+        return pc + 2;
+    }
+    case OP_SETLOCAL:
+    case OP_DEFLOCAL:
+    {
+        int base = jit_frame(j, arg >> 16);
+        int32_t disp = offsetof(Object, slots) + sizeof(Object *) * (arg & 0xffff);
+        if (op == OP_SETLOCAL)
+        {
+            jit_mem(j, true, 0x83, 7, base, disp); // cmp qword [base + disp], NULL
+            jit_byte(j, 0);
+            jit_jump(j, CC_E, pc, true);
+        }
+        jit_load(j, RCX, SP_REG, -(int)sizeof(Object *));
+        jit_store(j, base, disp, RCX);
+        jit_barrier(j, RCX, base, disp);
+        return pc + 2;
+    }
+    case OP_POP:
+        jit_add(j, SP_REG, -(int)sizeof(Object *));
+        return pc + 1;
+    case OP_JUMP:
+        jit_jump(j, -1, arg, false);
+        return pc + 1;
+    case OP_JUMP_IF_NIL:
+        jit_add(j, SP_REG, -(int)sizeof(Object *));
+        jit_load(j, RAX, SP_REG, 0);
+        jit_imm(j, RCX, (uintptr_t)Nil);
+        jit_reg(j, true, 0x39, RCX, RAX); // cmp rax, rcx
+        jit_jump(j, CC_E, arg, false);
+        return pc + 1;
+    case OP_FOLDED:
+        jit_load_const(j, RAX, insns[pc + 1]);
+        jit_reg(j, true, 0xd1, 7, RAX); // sar rax, 1
+        jit_imm(j, RDX, (uintptr_t)&fold_version);
+        jit_load(j, RDX, RDX, 0);
+        jit_reg(j, true, 0x39, RDX, RAX); // cmp rax, rdx
+        jit_jump(j, CC_NE, pc, true);
+        jit_load_const(j, RAX, insns[pc + 1] + 1);
+        jit_push(j, RAX);
+        jit_jump(j, -1, arg, false);
+        return pc + 2;
+    case OP_TAILCALL_GLOBAL:
+        if (!jit_handles(insn, self_calls))
+            break;
+        jit_self_call(j, pc, arg, insns[pc + 1], nslots);
+        return pc + 2;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        // As in the VM, on the tagged representations
+        jit_fixnum_args(j, op, arg, pc);
+        jit_mem(j, true, 0x8d, RDX, RCX, -1); // lea rdx, [rcx - 1]
+        if (op == OP_MUL)
+        {
+            jit_reg(j, true, 0xd1, 7, RAX);     // sar rax, 1
+            jit_reg(j, true, 0x0faf, RAX, RDX); // imul rax, rdx
+            jit_jump(j, CC_O, pc, true);
+            jit_add(j, RAX, 1);
+        }
+        else
+            jit_reg(j, true, op == OP_ADD ? 0x01 : 0x29, RDX, RAX);
+        jit_jump(j, CC_O, pc, true);
+        jit_store(j, SP_REG, -2 * (int)sizeof(Object *), RAX);
+        jit_add(j, SP_REG, -(int)sizeof(Object *));
+        return pc + 1;
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+        jit_fixnum_args(j, op, arg, pc);
+        if (pc + 1 < ninsns && (insns[pc + 1] & 0xff) == OP_JUMP_IF_NIL)
+        {
+            // Branch on the flags instead of on a boolean when a conditional jump follows. The
+            // jump still gets its own code below, in case the VM resumes there.
+            jit_add(j, SP_REG, -2 * (int)sizeof(Object *));
+            jit_reg(j, true, 0x39, RCX, RAX); // cmp rax, rcx
+            jit_jump(j, conditions[op] ^ 1, insns[pc + 1] >> 8, false);
+            jit_jump(j, -1, pc + 2, false);
+            return pc + 1;
+        }
+        jit_reg(j, true, 0x39, RCX, RAX);
+        jit_imm(j, RAX, (uintptr_t)Nil);
+        jit_imm(j, RDX, (uintptr_t)True);
+        jit_reg(j, true, 0x0f40 | conditions[op], RAX, RDX); // cmovcc rax, rdx
+        jit_store(j, SP_REG, -2 * (int)sizeof(Object *), RAX);
+        jit_add(j, SP_REG, -(int)sizeof(Object *));
+        return pc + 1;
+    case OP_VREF:
+        jit_load(j, RAX, SP_REG, -2 * (int)sizeof(Object *));
+        jit_load(j, RCX, SP_REG, -(int)sizeof(Object *));
+        jit_test_fixnum(j, RCX);
+        jit_jump(j, CC_E, pc, true);
+        jit_test_fixnum(j, RAX);
+        jit_jump(j, CC_NE, pc, true);
+        jit_cmp_int(j, RAX, offsetof(Object, type), VECTOR);
+        jit_jump(j, CC_NE, pc, true);
+        jit_guard_builtin(j, arg, primitive_VECTOR_REF, pc);
+        jit_reg(j, true, 0xd1, 7, RCX);                         // sar rcx, 1
+        jit_mem(j, true, 0x63, RDX, RAX, offsetof(Object, nelems)); // movsxd rdx, [rax + nelems]
+        jit_reg(j, true, 0x39, RDX, RCX);                       // cmp rcx, rdx
+        jit_jump(j, CC_AE, pc, true);
+        // mov rax, [rax + rcx * 8 + elems]
+        jit_byte(j, 0x48);
+        jit_byte(j, 0x8b);
+        jit_byte(j, 0x84);
+        jit_byte(j, 0xc8);
+        jit_u32(j, offsetof(Object, elems));
+        jit_store(j, SP_REG, -2 * (int)sizeof(Object *), RAX);
+        jit_add(j, SP_REG, -(int)sizeof(Object *));
+        return pc + 1;
+    }
+    // Left to the VM
+    jit_jump(j, -1, pc, true);
+    return pc + insn_length(insn);
+}
+
+// Sets the entry points of the native code of the n instructions. run[pc] is the number of
+// instructions from the one at pc on that run natively, up to JIT_MIN_RUN; jumps only go forward.
+static void jit_entries(Native *native, uint32_t *insns, int n, bool self_calls)
+{
+    int *starts = malloc(sizeof(int) * n);
+    uint8_t *run = malloc(n);
+    int nstarts = 0;
+    memset(native->entry, 0, n);
+    if (!starts || !run)
+    {
+        free(starts);
+        free(run);
+        return;
+    }
+    for (int pc = 0; pc < n; pc += insn_length(insns[pc]))
+        starts[nstarts++] = pc;
+    memset(run, 0, n);
+    for (int i = nstarts - 1; 0 <= i; i--)
+    {
+        int pc = starts[i];
+        int op = insns[pc] & 0xff;
+        int next = op == OP_JUMP ? (int)(insns[pc] >> 8) : pc + insn_length(insns[pc]);
+        if (!jit_handles(insns[pc], self_calls))
+            run[pc] = 0;
+        else if (op == OP_TAILCALL_GLOBAL || n <= next)
+            run[pc] = JIT_MIN_RUN;
+        else
+            run[pc] = run[next] < JIT_MIN_RUN ? run[next] + 1 : JIT_MIN_RUN;
+        native->entry[pc] = run[pc] == JIT_MIN_RUN;
+    }
+    free(starts);
+    free(run);
+}
+
+// Lays out the native code of the code object, whose functions have frames of nslots slots, and
+// returns it, or NULL if it can't be compiled. The function starts with the prologue, which loads
+// the registers and jumps to the code of the instruction at pc through a table of offsets at the
+// end. Exits load the pc into eax and go to the epilogue, which stores back the stack pointer.
+static Native *jit_code(Object *code, int nslots)
+{
+    uint32_t *insns = code_insns(code);
+    int n = code->ninsns;
+    bool self_calls = true;
+    for (int pc = 0; pc < n; pc += insn_length(insns[pc]))
+        if ((insns[pc] & 0xff) == OP_CLOSURE || (insns[pc] & 0xff) == OP_EVAL)
+            self_calls = false;
+
+    Jit j = {0};
+    j.labels = malloc(sizeof(int) * n);
+    int *exits = malloc(sizeof(int) * n);
+    if (!j.labels || !exits)
+        j.failed = true;
+    for (int pc = 0; !j.failed && pc < n; pc++)
+        j.labels[pc] = exits[pc] = -1;
+
+    // Prologue
+    static const uint8_t prologue[] = {
+        0x53,             // push rbx
+        0x41, 0x54,       // push r12
+        0x41, 0x55,       // push r13
+        0x41, 0x56,       // push r14
+        0x41, 0x57,       // push r15
+        0x49, 0x89, 0xff, // mov r15, rdi
+        0x48, 0x8b, 0x1f, // mov rbx, [rdi]
+        0x49, 0x89, 0xf4, // mov r12, rsi
+        0x49, 0x89, 0xd5, // mov r13, rdx
+        0x4d, 0x89, 0xc6, // mov r14, r8
+        0x89, 0xc8,       // mov eax, ecx
+        0x48, 0x8d, 0x15, // lea rdx, [rip + table]
+    };
+    for (size_t i = 0; i < sizeof(prologue); i++)
+        jit_byte(&j, prologue[i]);
+    size_t table_ref = j.len;
+    jit_u32(&j, 0);
+    static const uint8_t dispatch[] = {
+        0x48, 0x63, 0x04, 0x82, // movsxd rax, [rdx + rax * 4]
+        0x48, 0x01, 0xd0,       // add rax, rdx
+        0xff, 0xe0,             // jmp rax
+    };
+    for (size_t i = 0; i < sizeof(dispatch); i++)
+        jit_byte(&j, dispatch[i]);
+
+    for (int pc = 0; !j.failed && pc < n;)
+    {
+        j.labels[pc] = j.len;
+        pc = jit_insn(&j, insns, n, pc, nslots, self_calls);
+    }
+
+    // Epilogue
+    size_t epilogue = j.len;
+    static const uint8_t restore[] = {
+        0x49, 0x89, 0x1f, // mov [r15], rbx
+        0x41, 0x5f,       // pop r15
+        0x41, 0x5e,       // pop r14
+        0x41, 0x5d,       // pop r13
+        0x41, 0x5c,       // pop r12
+        0x5b,             // pop rbx
+        0xc3,             // ret
+        0x0f, 0x0b,       // ud2, for the operand words in the table
+    };
+    for (size_t i = 0; i < sizeof(restore); i++)
+        jit_byte(&j, restore[i]);
+    size_t trap = j.len - 2;
+
+    // The exits, one per pc that needs one
+    for (int i = 0; !j.failed && i < j.nfixups; i++)
+    {
+        int pc = j.fixups[i].pc;
+        if (!j.fixups[i].exit || 0 <= exits[pc])
+            continue;
+        exits[pc] = j.len;
+        jit_byte(&j, 0xb8); // mov eax, pc
+        jit_u32(&j, pc);
+        jit_byte(&j, 0xe9); // jmp epilogue
+        jit_u32(&j, 0);
+        if (!j.failed)
+            jit_patch(&j, j.len - 4, epilogue);
+    }
+
+    while (j.len % 4)
+        jit_byte(&j, 0xcc);
+    size_t table = j.len;
+    for (int pc = 0; !j.failed && pc < n; pc++)
+        jit_u32(&j, (j.labels[pc] < 0 ? trap : (size_t)j.labels[pc]) - table);
+
+    Native *r = NULL;
+    if (!j.failed)
+    {
+        jit_patch(&j, table_ref, table);
+        for (int i = 0; i < j.nfixups; i++)
+        {
+            Fixup *f = &j.fixups[i];
+            jit_patch(&j, f->pos, f->exit ? exits[f->pc] : j.labels[f->pc]);
+        }
+
+        // The code follows the entry points. It is written and then made executable, never both.
+        size_t header = (sizeof(Native) + n + 15) & ~(size_t)15;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (header + j.len + page - 1) / page * page;
+        pthread_mutex_lock(&jit_lock);
+        bool room = jit_memory_used + size <= JIT_MEMORY_LIMIT;
+        if (room)
+            jit_memory_used += size;
+        pthread_mutex_unlock(&jit_lock);
+        void *m = room ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+        if (m != MAP_FAILED)
+        {
+            Native *native = m;
+            native->fn = (NativeCode *)((uint8_t *)m + header);
+            jit_entries(native, insns, n, self_calls);
+            memcpy(native->fn, j.buf, j.len);
+            if (mprotect(m, size, PROT_READ | PROT_EXEC) == 0)
+                r = native;
+            else
+                munmap(m, size);
+        }
+    }
+    free(j.buf);
+    free(j.labels);
+    free(j.fixups);
+    free(exits);
+    return r;
+}
+
+// Counts a call that enters the code, a function's body with frames of nslots slots, and compiles
+// the code to native once the call is the JIT_THRESHOLD-th.
+static inline void count_call(Object *code, int nslots)
+{
+    if (!jit_enabled || PROFILING || native_code(code))
+        return;
+    if (__atomic_add_fetch(&code->ncalls, 1, __ATOMIC_RELAXED) != JIT_THRESHOLD)
+        return;
+    Native *native = jit_code(code, nslots);
+    if (native)
+        __atomic_store_n(&code->native, native, __ATOMIC_RELEASE);
+}
+
+#else
+
+static inline void count_call(Object *code, int nslots)
+{
+}
+
+#endif
+
+//======================================================================
+// Virtual machine
+//======================================================================
+
+// Calls the function below the top n values of the VM stack with those values as its arguments, and
+// pops them all. Used for everything but compiled functions.
+static Object *call_from_stack(int n)
+{
+    Object *r = funcall(ctx->vm_stack[ctx->vm_sp - n - 1], n);
+    ctx->vm_sp--;
+    return r;
+}
+
+static void check_stack(Object *code)
+{
+    if (VM_STACK_SIZE < ctx->vm_sp + code->maxstack)
+        error("Stack overflow");
+}
+
+// Runs the code in the environment and returns the result. Calls between compiled functions are
+// handled within this loop without growing the C stack. Code that has native code runs in it from
+// the points marked by RESUME() on, until it gets back to an instruction left to the VM.
+static Object *run(Object *code, Object *env)
+{
+    static void *dispatch[] = {
+        [OP_CONST] = &&op_const,
+        [OP_GLOBAL] = &&op_global,
+        [OP_LOCAL] = &&op_local,
+        [OP_DEFGLOBAL] = &&op_defglobal,
+        [OP_SETGLOBAL] = &&op_setglobal,
+        [OP_DEFLOCAL] = &&op_deflocal,
+        [OP_SETLOCAL] = &&op_setlocal,
+        [OP_POP] = &&op_pop,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_IF_NIL] = &&op_jump_if_nil,
+        [OP_CLOSURE] = &&op_closure,
+        [OP_CALL] = &&op_call,
+        [OP_TAILCALL] = &&op_tailcall,
+        [OP_CALL_GLOBAL] = &&op_call_global,
+        [OP_TAILCALL_GLOBAL] = &&op_tailcall_global,
+        [OP_RETURN] = &&op_return,
+        [OP_EVAL] = &&op_eval,
+        [OP_FOLDED] = &&op_folded,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul,
+        [OP_EQ] = &&op_eq,
+        [OP_LT] = &&op_lt,
+        [OP_LE] = &&op_le,
+        [OP_GT] = &&op_gt,
+        [OP_GE] = &&op_ge,
+        [OP_VREF] = &&op_vref,
+    };
+
+    check_c_stack();
+    ROOT_FRAME;
+    ROOT(code);
+    ROOT(env);
+    int entry = ctx->vm_nframes;
+    check_stack(code);
+    uint32_t *ip = code_insns(code);
+    uint32_t insn;
+    Object **slot;
+    Object *r;
+    int pc;
+    // The function being entered, the number of values below the arguments to pop with them, and
+    // whether it's a tail call
+    Object *callee;
+    int below;
+    bool tail;
+    // The calls in the profile above this depth are those of the frames run here.
+    int prof_depth = ctx->prof_depth;
+
+#define NEXT()                        \
+    do                                \
+    {                                 \
+        insn = *ip++;                 \
+        goto *dispatch[insn & 0xff];  \
+    } while (0)
+#define RESUME()                                                                \
+    do                                                                          \
+    {                                                                           \
+        Native *n = native_code(code);                                          \
+        if (n && n->entry[ip - code_insns(code)])                               \
+            goto native;                                                        \
+        NEXT();                                                                 \
+    } while (0)
+#define ARG (insn >> 8)
+#define PUSH(x) (ctx->vm_stack[ctx->vm_sp++] = (x))
+#define POP() (ctx->vm_stack[--ctx->vm_sp])
+#define TOP() (ctx->vm_stack[ctx->vm_sp - 1])
+// The instruction pointer must be saved in pc around anything that may run GC.
+#define SAVE_PC() (pc = ip - code_insns(code))
+#define RESTORE_PC() (ip = code_insns(code) + pc)
+#define LOCAL_SLOT()                                  \
+    do                                                \
+    {                                                 \
+        Object *e = env;                              \
+        for (int d = ARG >> 16; d > 0; d--)           \
+            e = e->up;                                \
+        slot = &e->slots[ARG & 0xffff];               \
+    } while (0)
+#define LOCAL_NAME() (code->consts[ip[-1]]->sym->name)
+
+    RESUME();
+
+native:
+{
+    Object **sp = &ctx->vm_stack[ctx->vm_sp];
+    pc = native_code(code)->fn(&sp, env, code, ip - code_insns(code), &lispy->gc_pending);
+    ctx->vm_sp = sp - ctx->vm_stack;
+    RESTORE_PC();
+    NEXT();
+}
+
+op_const:
+    PUSH(code->consts[ARG]);
+    NEXT();
+op_global:
+    slot = &code->consts[ARG]->global;
+    if (!*slot)
+        error("Undefined symbol: %s", code->consts[ARG]->name);
+    PUSH(*slot);
+    NEXT();
+op_local:
+    LOCAL_SLOT();
+    ip++;
+    if (!*slot)
+        error("Undefined symbol: %s", LOCAL_NAME());
+    PUSH(*slot);
+    NEXT();
+op_setglobal:
+    if (!code->consts[ARG]->global)
+        error("Unbound variable %s", code->consts[ARG]->name);
+    // fall through
+op_defglobal:
+    rebind(code->consts[ARG]);
+    code->consts[ARG]->global = TOP();
+    note_store(&code->consts[ARG]->global);
+    RESUME();
+op_setlocal:
+    LOCAL_SLOT();
+    ip++;
+    if (!*slot)
+        error("Unbound variable %s", LOCAL_NAME());
+    *slot = TOP();
+    note_store(slot);
+    NEXT();
+op_deflocal:
+    LOCAL_SLOT();
+    ip++;
+    *slot = TOP();
+    note_store(slot);
+    NEXT();
+op_pop:
+    ctx->vm_sp--;
+    NEXT();
+op_jump:
+    ip = code_insns(code) + ARG;
+    NEXT();
+op_jump_if_nil:
+    if (POP() == Nil)
+        ip = code_insns(code) + ARG;
+    NEXT();
+op_closure:
+{
+    SAVE_PC();
+    Object *fn = make_closure(code->consts[ARG], env);
+    RESTORE_PC();
+    PUSH(fn);
+    RESUME();
+}
+op_call:
+{
+    int nargs = ARG;
+    Object *fn = ctx->vm_stack[ctx->vm_sp - nargs - 1];
+    SAVE_PC();
+    if (type_of(fn) != FUNCTION || !fn->code)
+    {
+        Object *r = call_from_stack(nargs);
+        RESTORE_PC();
+        PUSH(r);
+        RESUME();
+    }
+    if (nargs != fn->nparams)
+        error("Number of argument does not match");
+    if (max_depth <= ctx->vm_nframes)
+        error("Stack overflow: maximum depth %d exceeded", max_depth);
+    ctx->vm_frames[ctx->vm_nframes++] = (VMFrame){code, env, pc};
+    callee = fn;
+    below = 1;
+    tail = false;
+    goto enter;
+}
+op_tailcall:
+{
+    int nargs = ARG;
+    Object *fn = ctx->vm_stack[ctx->vm_sp - nargs - 1];
+    if (type_of(fn) != FUNCTION || !fn->code)
+    {
+        r = call_from_stack(nargs);
+        goto leave;
+    }
+    if (nargs != fn->nparams)
+        error("Number of argument does not match");
+    callee = fn;
+    below = 1;
+    tail = true;
+    goto enter;
+}
+op_call_global:
+op_tailcall_global:
+{
+    // A hit in the inline cache costs one comparison. On a miss, the function is looked up and
+    // checked, and cached if it can be entered directly.
+    int nargs = ARG;
+    Object **cache = &code->consts[*ip++];
+    tail = (insn & 0xff) == OP_TAILCALL_GLOBAL;
+    if (__atomic_load_n(&cache[1], __ATOMIC_ACQUIRE) == make_fixnum(global_version))
+        callee = cache[2];
+    else
+    {
+        callee = cache[0]->global;
+        if (!callee)
+            error("Undefined symbol: %s", cache[0]->name);
+        if (type_of(callee) != FUNCTION || !callee->code)
+        {
+            SAVE_PC();
+            r = funcall(callee, nargs);
+            if (tail)
+                goto leave;
+            RESTORE_PC();
+            PUSH(r);
+            RESUME();
+        }
+        if (nargs != callee->nparams)
+            error("Number of argument does not match");
+        // Another thread may be reading the cache; the version is written last.
+        cache[2] = callee;
+        __atomic_store_n(&cache[1], make_fixnum(global_version), __ATOMIC_RELEASE);
+        note_store(&cache[2]);
+    }
+    if (!tail)
+    {
+        if (max_depth <= ctx->vm_nframes)
+            error("Stack overflow: maximum depth %d exceeded", max_depth);
+        SAVE_PC();
+        ctx->vm_frames[ctx->vm_nframes++] = (VMFrame){code, env, pc};
+    }
+    below = 0;
+    goto enter;
+}
+enter:
+{
+    // Enters the callee with the arguments on top of the stack. The callee is pushed while the new
+    // frame is allocated, so that GC can find it.
+    int nargs = ARG;
+    PUSH(callee);
+    Object *frame = make_env(callee->nslots, callee->env);
+    callee = POP();
+    if (PROFILING)
+    {
+        if (tail)
+            profile_tail_call(prof_depth, callee);
+        else
+            profile_enter(callee);
+    }
+    memcpy(frame->slots, &ctx->vm_stack[ctx->vm_sp - nargs], sizeof(Object *) * nargs);
+    ctx->vm_sp -= nargs + below;
+    env = frame;
+    code = callee->code;
+    check_stack(code);
+    ip = code_insns(code);
+    count_call(code, callee->nslots);
+    RESUME();
+}
+op_return:
+    r = POP();
+leave:
+{
+    if (ctx->vm_nframes == entry)
+    {
+        if (PROFILING)
+            profile_unwind(prof_depth);
+        return r;
+    }
+    if (PROFILING)
+        profile_exit();
+    VMFrame *f = &ctx->vm_frames[--ctx->vm_nframes];
+    code = f->code;
+    env = f->env;
+    ip = code_insns(code) + f->pc;
+    PUSH(r);
+    RESUME();
+}
+op_eval:
+{
+    SAVE_PC();
+    Object *r = eval(env, code->consts[ARG]);
+    RESTORE_PC();
+    PUSH(r);
+    RESUME();
+}
+op_folded:
+{
+    Object **k = &code->consts[*ip++];
+    if (k[0] == make_fixnum(fold_version))
+    {
+        PUSH(k[1]);
+        ip = code_insns(code) + ARG;
+    }
+    NEXT();
+}
+
+// The intrinsics work on the tagged representations. For fixnums a and b tagged as 2a+1 and 2b+1,
+// x + (y - 1) and x - (y - 1) are the tagged sum and difference, and (x >> 1) * (y - 1) + 1 the
+// tagged product; the operations overflow exactly when the result is out of the fixnum range.
+#define INTRINSIC_OK(op)                                                          \
+    (is_fixnum(ctx->vm_stack[ctx->vm_sp - 2]) && is_fixnum(TOP()) &&                        \
+     is_builtin(code->consts[ARG]->global, intrinsics[op]))
+#define ARITHMETIC(op, expr)                                                      \
+    do                                                                            \
+    {                                                                             \
+        intptr_t x = (intptr_t)ctx->vm_stack[ctx->vm_sp - 2], y = (intptr_t)TOP(), v;       \
+        if (!INTRINSIC_OK(op) || (expr))                                          \
+            goto intrinsic_call;                                                  \
+        ctx->vm_sp--;                                                                  \
+        TOP() = (Object *)v;                                                      \
+        NEXT();                                                                   \
+    } while (0)
+#define COMPARISON(op, cmp)                                                       \
+    do                                                                            \
+    {                                                                             \
+        if (!INTRINSIC_OK(op))                                                    \
+            goto intrinsic_call;                                                  \
+        intptr_t x = (intptr_t)ctx->vm_stack[ctx->vm_sp - 2], y = (intptr_t)TOP();          \
+        ctx->vm_sp--;                                                                  \
+        TOP() = x cmp y ? True : Nil;                                             \
+        NEXT();                                                                   \
+    } while (0)
+
+op_add:
+    ARITHMETIC(OP_ADD, __builtin_add_overflow(x, y - 1, &v));
+op_sub:
+    ARITHMETIC(OP_SUB, __builtin_sub_overflow(x, y - 1, &v));
+op_mul:
+    ARITHMETIC(OP_MUL, __builtin_mul_overflow(x >> 1, y - 1, &v) || __builtin_add_overflow(v, 1, &v));
+op_eq:
+    COMPARISON(OP_EQ, ==);
+op_lt:
+    COMPARISON(OP_LT, <);
+op_le:
+    COMPARISON(OP_LE, <=);
+op_gt:
+    COMPARISON(OP_GT, >);
+op_ge:
+    COMPARISON(OP_GE, >=);
+op_vref:
+{
+    Object *v = ctx->vm_stack[ctx->vm_sp - 2];
+    intptr_t i = fixnum_value(TOP());
+    if (!is_fixnum(TOP()) || type_of(v) != VECTOR || i < 0 || v->nelems <= i ||
+        !is_builtin(code->consts[ARG]->global, primitive_VECTOR_REF))
+        goto intrinsic_call;
+    ctx->vm_sp--;
+    TOP() = v->elems[i];
+    NEXT();
+}
+intrinsic_call:
+{
+    // The slow path: call whatever the variable is bound to now.
+    Object *sym = code->consts[ARG];
+    if (!sym->global)
+        error("Undefined symbol: %s", sym->name);
+    SAVE_PC();
+    Object *r = funcall(sym->global, 2);
+    RESTORE_PC();
+    PUSH(r);
+    RESUME();
+}
+
+#undef INTRINSIC_OK
+#undef ARITHMETIC
+#undef COMPARISON
+#undef NEXT
+#undef RESUME
+#undef ARG
+#undef PUSH
+#undef POP
+#undef TOP
+#undef SAVE_PC
+#undef RESTORE_PC
+#undef LOCAL_SLOT
+#undef LOCAL_NAME
+}
+
+//======================================================================
+// Threads
+//======================================================================
+
+// (spawn fn expr ...) adds a task that calls fn with the arguments to the thread pool, and (join
+// task) waits for it and returns its value. The pool is started by the first spawn.
+//
+// Every thread has a queue of tasks. A thread pushes the tasks it spawns onto its own queue and
+// takes the newest one from it when it's free; a thread whose queue is empty steals the oldest
+// task from another queue. The main thread has a queue but doesn't run tasks except while it is
+// waiting in join, which every thread does by running other tasks until the one it waits for is
+// done. A task can be joined once. If a task fails with an error, join raises the error again.
+
+// The number of threads in the pool. Set by --threads; the number of CPUs by default.
+static int nworkers;
+
+typedef struct Queue
+{
+    pthread_mutex_t lock;
+    int *buf;
+    int cap;
+    // The tasks are buf[head % cap] to buf[(tail - 1) % cap], oldest first.
+    unsigned head;
+    unsigned tail;
+} Queue;
+
+static void push_task(Queue *q, int task)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == (unsigned)q->cap)
+    {
+        int cap = q->cap ? q->cap * 2 : 64;
+        int *buf = malloc(sizeof(int) * cap);
+        if (!buf)
+        {
+            pthread_mutex_unlock(&q->lock);
+            error("Memory exhausted");
+        }
+        for (unsigned i = q->head; i != q->tail; i++)
+            buf[i - q->head] = q->buf[i % q->cap];
+        free(q->buf);
+        q->buf = buf;
+        q->cap = cap;
+        q->tail -= q->head;
+        q->head = 0;
+    }
+    q->buf[q->tail++ % q->cap] = task;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&lispy->pool_lock);
+    lispy->npending++;
+    pthread_cond_broadcast(&lispy->pool_cond);
+    pthread_mutex_unlock(&lispy->pool_lock);
+}
+
+// Takes the newest task from the queue if own, the oldest otherwise. Returns -1 if it's empty.
+static int take_task(Queue *q, bool own)
+{
+    int task = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail)
+        task = own ? q->buf[--q->tail % q->cap] : q->buf[q->head++ % q->cap];
+    pthread_mutex_unlock(&q->lock);
+    if (task < 0)
+        return -1;
+    pthread_mutex_lock(&lispy->pool_lock);
+    lispy->npending--;
+    pthread_mutex_unlock(&lispy->pool_lock);
+    return task;
+}
+
+static int find_task(void)
+{
+    int task = take_task(&lispy->queues[ctx->queue], true);
+    for (int i = 1; task < 0 && i < lispy->nqueues; i++)
+        task = take_task(&lispy->queues[(ctx->queue + i) % lispy->nqueues], false);
+    return task;
+}
+
+static void run_task(int i)
+{
+    Task *t = task_at(i);
+    __atomic_store_n(&t->state, TASK_RUNNING, __ATOMIC_RELAXED);
+
+    Handler h;
+    Object *r;
+    char *err = NULL;
+    if (CATCH(h))
+    {
+        int n = 0;
+        for (Object *p = t->args; p != Nil; p = p->cdr, n++)
+        {
+            if (ctx->vm_sp == VM_STACK_SIZE)
+                error("Stack overflow");
+            ctx->vm_stack[ctx->vm_sp++] = p->car;
+        }
+        r = funcall(t->fn, n);
+    }
+    else
+    {
+        r = Nil;
+        err = strdup(ctx->error);
+    }
+    pop_handler(&h);
+
+    pthread_mutex_lock(&lispy->pool_lock);
+    t->result = r;
+    t->error = err;
+    t->fn = t->args = Nil;
+    __atomic_store_n(&t->state, TASK_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&lispy->pool_cond);
+    pthread_mutex_unlock(&lispy->pool_lock);
+}
+
+// Blocks until a task is pending or, if t is given, t is done.
+static void wait_for_task(Task *t)
+{
+    enter_safe_region();
+    pthread_mutex_lock(&lispy->pool_lock);
+    while (lispy->npending == 0 && !lispy->shutdown &&
+           (!t || __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != TASK_DONE))
+        pthread_cond_wait(&lispy->pool_cond, &lispy->pool_lock);
+    pthread_mutex_unlock(&lispy->pool_lock);
+    leave_safe_region();
+}
+
+// The argument is the thread's context, with the interpreter and the queue filled in.
+static void *worker_main(void *arg)
+{
+    ctx = arg;
+    lispy = ctx->lispy;
+    init_context(__builtin_frame_address(0));
+    while (!__atomic_load_n(&lispy->shutdown, __ATOMIC_ACQUIRE))
+    {
+        int task = find_task();
+        if (task < 0)
+            wait_for_task(NULL);
+        else
+            run_task(task);
+    }
+    unregister_thread();
+    free_context(ctx);
+    free(ctx);
+    return NULL;
+}
+
+static void start_threads(void)
+{
+    lispy->nqueues = nworkers + 1;
+    lispy->queues = calloc(lispy->nqueues, sizeof(Queue));
+    if (!lispy->queues)
+        error("Memory exhausted");
+    for (int i = 0; i < lispy->nqueues; i++)
+        pthread_mutex_init(&lispy->queues[i].lock, NULL);
+    ctx->queue = nworkers;
+
+    // From now on the nursery is handed out in small buffers. The main thread gives back the rest
+    // of its buffer, which is the end of the nursery.
+    pthread_mutex_lock(&lispy->heap_lock);
+    lispy->threads_started = true;
+    release_buffer();
+    pthread_mutex_unlock(&lispy->heap_lock);
+
+    lispy->workers = calloc(nworkers, sizeof(pthread_t));
+    if (!lispy->workers)
+        error("Memory exhausted");
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, c_stack_size);
+    for (int i = 0; i < nworkers; i++)
+    {
+        Context *c = calloc(1, sizeof(Context));
+        if (!c)
+            error("Memory exhausted");
+        c->lispy = lispy;
+        c->queue = i;
+        if (pthread_create(&lispy->workers[i], &attr, worker_main, c) != 0)
+            error("Cannot create a thread");
+        lispy->nworkers++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Lets the threads of the pool finish their tasks and waits until they have exited.
+static void stop_threads(void)
+{
+    pthread_mutex_lock(&lispy->pool_lock);
+    __atomic_store_n(&lispy->shutdown, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&lispy->pool_cond);
+    pthread_mutex_unlock(&lispy->pool_lock);
+    enter_safe_region();
+    for (int i = 0; i < lispy->nworkers; i++)
+        pthread_join(lispy->workers[i], NULL);
+    leave_safe_region();
+}
+
+// Adds a task that calls fn with the list of arguments, and returns its handle.
+static intptr_t spawn_task(Object *fn, Object *args)
+{
+    if (!lispy->threads_started)
+    {
+        ROOT_FRAME;
+        ROOT(fn);
+        ROOT(args);
+        start_threads();
+    }
+
+    pthread_mutex_lock(&lispy->pool_lock);
+    int i = lispy->free_task;
+    if (0 <= i)
+        lispy->free_task = task_at(i)->next;
+    else
+    {
+        if (lispy->ntasks == TASK_CHUNK_SIZE * MAX_TASK_CHUNKS)
+        {
+            pthread_mutex_unlock(&lispy->pool_lock);
+            error("Too many tasks");
+        }
+        if (lispy->ntasks % TASK_CHUNK_SIZE == 0)
+        {
+            lispy->task_chunks[lispy->ntasks / TASK_CHUNK_SIZE] = calloc(TASK_CHUNK_SIZE, sizeof(Task));
+            if (!lispy->task_chunks[lispy->ntasks / TASK_CHUNK_SIZE])
+            {
+                pthread_mutex_unlock(&lispy->pool_lock);
+                error("Memory exhausted");
+            }
+        }
+        i = lispy->ntasks;
+        __atomic_store_n(&lispy->ntasks, i + 1, __ATOMIC_RELEASE);
+    }
+    Task *t = task_at(i);
+    t->fn = fn;
+    t->args = args;
+    t->result = Nil;
+    t->state = TASK_PENDING;
+    intptr_t handle = (intptr_t)t->gen << TASK_INDEX_BITS | i;
+    pthread_mutex_unlock(&lispy->pool_lock);
+
+    push_task(&lispy->queues[ctx->queue], i);
+    return handle;
+}
+
+// Waits for the task with the handle and returns its value.
+static Object *join_task(intptr_t handle)
+{
+    int i = handle & ((1 << TASK_INDEX_BITS) - 1);
+    if (!lispy->threads_started || __atomic_load_n(&lispy->ntasks, __ATOMIC_ACQUIRE) <= i)
+        error("Malformed join");
+    Task *t = task_at(i);
+    pthread_mutex_lock(&lispy->pool_lock);
+    // The runner sets the state without the lock.
+    bool stale = __atomic_load_n(&t->state, __ATOMIC_RELAXED) == TASK_FREE ||
+                 t->gen != (uint32_t)(handle >> TASK_INDEX_BITS) || t->joined;
+    if (!stale)
+        t->joined = true;
+    pthread_mutex_unlock(&lispy->pool_lock);
+    if (stale)
+        error("Task %ld has already been joined", (long)handle);
+    while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != TASK_DONE)
+    {
+        int task = find_task();
+        if (task < 0)
+            wait_for_task(t);
+        else
+            run_task(task);
+    }
+    pthread_mutex_lock(&lispy->pool_lock);
+    Object *r = t->result;
+    char *err = t->error;
+    t->result = NULL;
+    t->error = NULL;
+    t->state = TASK_FREE;
+    t->gen++;
+    t->joined = false;
+    t->next = lispy->free_task;
+    lispy->free_task = i;
+    pthread_mutex_unlock(&lispy->pool_lock);
+    if (err)
+    {
+        char msg[sizeof(ctx->error)];
+        snprintf(msg, sizeof(msg), "%s", err);
+        free(err);
+        error("%s", msg);
+    }
+    return r;
+}
+
+// (spawn fn expr ...)
+static Object *primitive_SPAWN(int argc, Object **argv)
+{
+    if (argc < 1 || !is_function(argv[0]))
+        error("Malformed spawn");
+    ROOT_FRAME;
+    Object *args = Nil;
+    ROOT(args);
+    for (int i = argc - 1; i > 0; i--)
+        args = cons(argv[i], args);
+    return make_fixnum(spawn_task(argv[0], args));
+}
+
+// (join task)
+static Object *primitive_JOIN(int argc, Object **argv)
+{
+    if (argc != 1 || !is_fixnum(argv[0]) || fixnum_value(argv[0]) < 0 ||
+        (uint32_t)(fixnum_value(argv[0]) >> TASK_INDEX_BITS) != fixnum_value(argv[0]) >> TASK_INDEX_BITS)
+        error("Malformed join");
+    return join_task(fixnum_value(argv[0]));
+}
+
+// The data-parallel primitives split a list into chunks and run a chunk function on each chunk as a
+// task. A chunk function takes (fn list count) and works on the first count elements of the list.
+// Lists shorter than PARALLEL_MIN elements are handled by one call of the chunk function in the
+// calling thread, as starting tasks costs more than it gains there.
+#define PARALLEL_MIN 256
+#define CHUNK_MIN 64
+
+// Returns the list of (fn x) for the elements x of the chunk.
+static Object *map_chunk(int argc, Object **argv)
+{
+    ROOT_FRAME;
+    Object *p = argv[1];
+    Object *head = Nil;
+    Object *tail = NULL;
+    ROOT(p);
+    ROOT(head);
+    ROOT(tail);
+    for (intptr_t n = fixnum_value(argv[2]); n > 0; n--, p = p->cdr)
+    {
+        Object *v = call1(argv[0], p->car);
+        v = cons(v, Nil);
+        if (tail)
+        {
+            tail->cdr = v;
+            note_store(&tail->cdr);
+        }
+        else
+            head = v;
+        tail = v;
+    }
+    return head;
+}
+
+// Returns the elements of the chunk combined with fn from the left.
+static Object *reduce_chunk(int argc, Object **argv)
+{
+    ROOT_FRAME;
+    Object *p = argv[1];
+    Object *acc = p->car;
+    ROOT(p);
+    ROOT(acc);
+    for (intptr_t n = fixnum_value(argv[2]) - 1; n > 0; n--)
+    {
+        p = p->cdr;
+        acc = call2(argv[0], acc, p->car);
+    }
+    return acc;
+}
+
+static Object *for_each_chunk(int argc, Object **argv)
+{
+    ROOT_FRAME;
+    Object *p = argv[1];
+    ROOT(p);
+    for (intptr_t n = fixnum_value(argv[2]); n > 0; n--, p = p->cdr)
+        call1(argv[0], p->car);
+    return Nil;
+}
+
+// Runs the chunk function on the chunks of the list, and returns the list of the results in order.
+static Object *run_chunks(char *name, Builtin *chunk_fn, Object *fn, Object *list)
+{
+    if (!is_function(fn))
+        error("Malformed %s", name);
+    ROOT_FRAME;
+    ROOT(fn);
+    ROOT(list);
+    Object *prim = NULL;
+    Object *args = NULL;
+    Object *head = Nil;
+    Object *tail = NULL;
+    ROOT(prim);
+    ROOT(args);
+    ROOT(head);
+    ROOT(tail);
+
+    int len = list_length(list);
+    int nchunks = 1;
+    if (PARALLEL_MIN <= len)
+    {
+        nchunks = nworkers * 4;
+        if (len / CHUNK_MIN < nchunks)
+            nchunks = len / CHUNK_MIN;
+    }
+    if (nchunks == 1)
+    {
+        if (VM_STACK_SIZE < ctx->vm_sp + 3)
+            error("Stack overflow");
+        Object **argv = &ctx->vm_stack[ctx->vm_sp];
+        argv[0] = fn;
+        argv[1] = list;
+        argv[2] = make_fixnum(len);
+        ctx->vm_sp += 3;
+        Object *r = chunk_fn(3, argv);
+        ctx->vm_sp -= 3;
+        return cons(r, Nil);
+    }
+
+    prim = make_primitive(NULL, chunk_fn);
+    intptr_t *tasks = malloc(sizeof(intptr_t) * nchunks);
+    if (!tasks)
+        error("Memory exhausted");
+    for (int i = 0; i < nchunks; i++)
+    {
+        // The first len % nchunks chunks get one more element.
+        int n = len / nchunks + (i < len % nchunks);
+        args = make_fixnum(n);
+        args = cons(args, Nil);
+        args = cons(list, args);
+        args = cons(fn, args);
+        tasks[i] = spawn_task(prim, args);
+        for (; n > 0; n--)
+            list = list->cdr;
+    }
+    for (int i = 0; i < nchunks; i++)
+    {
+        Object *r = join_task(tasks[i]);
+        r = cons(r, Nil);
+        if (tail)
+        {
+            tail->cdr = r;
+            note_store(&tail->cdr);
+        }
+        else
+            head = r;
+        tail = r;
+    }
+    free(tasks);
+    return head;
+}
+
+// (pmap fn list)
+static Object *primitive_PMAP(int argc, Object **argv)
+{
+    if (argc != 2)
+        error("Malformed pmap");
+    ROOT_FRAME;
+    Object *chunks = run_chunks("pmap", map_chunk, argv[0], argv[1]);
+    ROOT(chunks);
+
+    // Concatenate the mapped chunks, which are fresh lists.
+    Object *head = Nil;
+    Object *last = NULL;
+    for (Object *p = chunks; p != Nil; p = p->cdr)
+    {
+        if (p->car == Nil)
+            continue;
+        if (last)
+        {
+            last->cdr = p->car;
+            note_store(&last->cdr);
+        }
+        else
+            head = p->car;
+        for (last = p->car; last->cdr != Nil; last = last->cdr)
+            ;
+    }
+    return head;
+}
+
+// (preduce fn init list). fn must be associative: the chunks are reduced in parallel, and then the
+// initial value and the results of the chunks are combined from the left.
+static Object *primitive_PREDUCE(int argc, Object **argv)
+{
+    if (argc != 3)
+        error("Malformed preduce");
+    if (argv[2] == Nil)
+        return argv[1];
+    ROOT_FRAME;
+    Object *chunks = run_chunks("preduce", reduce_chunk, argv[0], argv[2]);
+    Object *acc = argv[1];
+    ROOT(chunks);
+    ROOT(acc);
+    for (; chunks != Nil; chunks = chunks->cdr)
+        acc = call2(argv[0], acc, chunks->car);
+    return acc;
+}
+
+// (pfor-each fn list)
+static Object *primitive_PFOR_EACH(int argc, Object **argv)
+{
+    if (argc != 2)
+        error("Malformed pfor-each");
+    run_chunks("pfor-each", for_each_chunk, argv[0], argv[1]);
+    return Nil;
+}
+
+static void add_builtin(char *name, Primitive *fn, Builtin *builtin)
+{
+    ROOT_FRAME;
+    Object *sym = intern(name);
+    ROOT(sym);
+    Object *prim = make_primitive(fn, builtin);
+    add_variable(sym, prim);
+}
+
+// Registers a primitive that is called with the evaluated arguments in an array.
+static void add_primitive(char *name, Builtin *fn)
+{
+    add_builtin(name, NULL, fn);
+}
+
+// Registers a special form that is called with the environment and the unevaluated arguments.
+static void add_special_form(char *name, Primitive *fn)
+{
+    add_builtin(name, fn, NULL);
+}
+
+static void define_constants(void)
+{
+    Object *sym = intern("t");
+    add_variable(sym, True);
+}
+
+static void define_primitives(void)
+{
+    add_special_form("quote", primitive_QUOTE);
+    add_primitive("list", primitive_LIST);
+    add_special_form("setvalue", primitive_SETVALUE);
+    add_primitive("+", primitive_PLUS);
+    add_primitive("-", primitive_MINUS);
+    add_primitive("*", primitive_TIMES);
+    add_primitive("/", primitive_DIVIDE);
+    add_primitive("mod", primitive_MOD);
+    add_special_form("define", primitive_DEFINE);
+    add_special_form("lambda", primitive_LAMBDA);
+    add_special_form("defmacro", primitive_DEFMACRO);
+    add_special_form("if", primitive_IF);
+    add_primitive("=", primitive_EQUAL);
+    add_primitive("<", primitive_LT);
+    add_primitive("<=", primitive_LE);
+    add_primitive(">", primitive_GT);
+    add_primitive(">=", primitive_GE);
+    add_primitive("make-vector", primitive_MAKE_VECTOR);
+    add_primitive("vector", primitive_VECTOR);
+    add_primitive("vector-ref", primitive_VECTOR_REF);
+    add_primitive("vector-set!", primitive_VECTOR_SET);
+    add_primitive("vector-length", primitive_VECTOR_LENGTH);
+    add_primitive("make-int-vector", primitive_MAKE_INT_VECTOR);
+    add_primitive("int-vector", primitive_INT_VECTOR);
+    add_primitive("vec+", primitive_VEC_PLUS);
+    add_primitive("vec-sum", primitive_VEC_SUM);
+    add_primitive("vec-dot", primitive_VEC_DOT);
+    add_primitive("vec-min", primitive_VEC_MIN);
+    add_primitive("vec-max", primitive_VEC_MAX);
+    add_primitive("vec=", primitive_VEC_EQ);
+    add_primitive("vec<", primitive_VEC_LT);
+    add_primitive("vec<=", primitive_VEC_LE);
+    add_primitive("vec>", primitive_VEC_GT);
+    add_primitive("vec>=", primitive_VEC_GE);
+    add_primitive("string-length", primitive_STRING_LENGTH);
+    add_primitive("string-ref", primitive_STRING_REF);
+    add_primitive("println", primitive_PRINTLN);
+    add_primitive("write-binary", primitive_WRITE_BINARY);
+    add_primitive("read-binary", primitive_READ_BINARY);
+    add_primitive("stats", primitive_STATS);
+    add_primitive("exit", primitive_EXIT);
+    add_primitive("catch", primitive_CATCH);
+    add_special_form("try", primitive_TRY);
+    add_primitive("spawn", primitive_SPAWN);
+    add_primitive("join", primitive_JOIN);
+    add_primitive("pmap", primitive_PMAP);
+    add_primitive("preduce", primitive_PREDUCE);
+    add_primitive("pfor-each", primitive_PFOR_EACH);
+}
+
+// Run the tree-walking interpreter instead of compiling to bytecode. Set by --interp.
+static bool interpret;
+
+// Resolves and evaluates a top-level form.
+static Object *eval_toplevel(Object *expr)
+{
+    if (expr == Paren)
+        error("Stray parenthesis");
+    if (expr == Dot)
+        error("Stray dot");
+    expr = resolve(NULL, expr);
+    if (interpret)
+        return eval(NULL, expr);
+    expr = compile(cons(expr, Nil));
+    return run(expr, NULL);
+}
+
+// Evaluates a top-level form, and prints the result if echo is set.
+static void eval_form(Object *expr, bool echo)
+{
+    ROOT_FRAME;
+    ROOT(expr);
+    arena_begin();
+    expr = eval_toplevel(expr);
+    if (echo)
+    {
+        pthread_mutex_lock(&output_lock);
+        print(expr);
+        out_char('\n');
+        pthread_mutex_unlock(&output_lock);
+    }
+    arena_reset();
+}
+
+// Reads the forms from the input and evaluates them in order. The result of each is printed if echo
+// is set.
+static void eval_input(bool echo)
+{
+    for (;;)
+    {
+        Object *expr = read_expr();
+        if (!expr)
+            break;
+        eval_form(expr, echo);
+    }
+}
+
+// Calls fn with arg. Returns 0, or -1 if fn has failed with an error, whose message is in
+// ctx->error.
+static int catch_errors(void (*fn)(const void *), const void *arg)
+{
+    Handler h;
+    int status = 0;
+    if (CATCH(h))
+        fn(arg);
+    else
+        status = -1;
+    pop_handler(&h);
+    return status;
+}
+
+//======================================================================
+// Embedding API
+//======================================================================
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Sets up what all interpreters share.
+static void init_process(void)
+{
+    always_gc = getenv("LISPY_ALWAYS_GC");
+    init_vec_kernels();
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_STACK, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY)
+        c_stack_size = lim.rlim_cur;
+    if (nworkers == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = n < 1 ? 1 : n;
+    }
+}
+
+// The old generation of the source is copied to the start of the new one, followed by the
+// nursery.
+static Object *relocate(Object *obj)
+{
+    if (is_fixnum(obj))
+        return obj;
+    if ((uintptr_t)obj - (uintptr_t)from_space < from_size)
+        return (Object *)(lispy->memory + ((uint8_t *)obj - from_space));
+    if ((uintptr_t)obj - (uintptr_t)from_nursery < from_nursery_size)
+        return (Object *)(lispy->memory + from_size + ((uint8_t *)obj - from_nursery));
+    return obj;
+}
+
+// Replaces the heap and the symbol table with a copy of those of src, which must not be in use.
+// Until the thread pool starts, the objects of an interpreter are packed from the start of its old
+// generation up to mem_nused, and from the start of its nursery up to the allocation pointer of
+// the main thread, so both are copied as one block into the old generation and relocated like an
+// image. src is only read.
+static void copy_interpreter(const Lispy *src)
+{
+    if (src->threads_started)
+        error("Cannot copy an interpreter whose thread pool has started");
+    size_t old = src->mem_nused;
+    size_t young = src->main.alloc_end && src->main.alloc_end == src->nursery + src->nursery_nused
+                       ? (size_t)(src->main.alloc_ptr - src->nursery)
+                       : src->nursery_nused;
+    size_t size = src->mem_size;
+    while (size < old + young)
+        size *= 2;
+    uint32_t *starts;
+    uint8_t *mem = malloc(size);
+    uint8_t *cards = mem ? new_cards(size, &starts) : NULL;
+    Object **table = calloc(src->symbols_cap, sizeof(Object *));
+    if (!cards || !table)
+    {
+        if (cards)
+            free(starts);
+        free(mem);
+        free(cards);
+        free(table);
+        error("Memory exhausted");
+    }
+    free(lispy->memory);
+    free(lispy->symbols);
+    lispy->memory = mem;
+    lispy->mem_size = size;
+    lispy->mem_nused = old + young;
+    lispy->nursery_nused = 0;
+    lispy->symbols = table;
+    lispy->symbols_cap = src->symbols_cap;
+    lispy->nsymbols = src->nsymbols;
+    lispy->nprofiled = src->nprofiled;
+    ctx->alloc_ptr = ctx->alloc_end = NULL;
+
+    memcpy(mem, src->memory, old);
+    memcpy(mem + old, src->nursery, young);
+    from_space = src->memory;
+    from_size = old;
+    from_nursery = src->nursery;
+    from_nursery_size = young;
+    for (uint8_t *p = mem; p < mem + old + young; p += object_size((Object *)p))
+        update_pointers((Object *)p, relocate);
+    for (size_t i = 0; i < src->symbols_cap; i++)
+        if (src->symbols[i])
+            table[i] = relocate(src->symbols[i]);
+    from_space = from_nursery = NULL;
+    from_size = from_nursery_size = 0;
+    set_cards(cards, starts);
+}
+
+// Each API function makes the interpreter the calling thread's one for the duration of the call.
+// The calling thread's C stack is only known at this point.
+#define ENTER(L)                                  \
+    Lispy *saved_lispy_ = lispy;                  \
+    Context *saved_ctx_ = ctx;                    \
+    lispy = (L);                                  \
+    ctx = &lispy->main;                           \
+    set_c_stack_base(__builtin_frame_address(0))
+
+#define LEAVE()               \
+    do                        \
+    {                         \
+        lispy = saved_lispy_; \
+        ctx = saved_ctx_;     \
+    } while (0)
+
+
+static void init_interpreter(const void *tmpl)
+{
+    init_heap();
+    init_context(ctx->c_stack_base);
+    grow_symbols();
+    if (tmpl)
+        copy_interpreter(tmpl);
+    else
+    {
+        define_constants();
+        define_primitives();
+    }
+}
+
+Lispy *lispy_new(const Lispy *tmpl)
+{
+    pthread_once(&init_once, init_process);
+    Lispy *L = calloc(1, sizeof(Lispy));
+    if (!L)
+        return NULL;
+    pthread_mutex_init(&L->symbols_lock, NULL);
+    pthread_mutex_init(&L->heap_lock, NULL);
+    pthread_cond_init(&L->heap_cond, NULL);
+    pthread_mutex_init(&L->pool_lock, NULL);
+    pthread_cond_init(&L->pool_cond, NULL);
+    L->free_task = -1;
+
+    ENTER(L);
+    int status = catch_errors(init_interpreter, tmpl);
+    LEAVE();
+    if (status < 0)
+    {
+        lispy_free(L);
+        return NULL;
+    }
+    return L;
+}
+
+static void eval_string(const void *src)
+{
+    open_string(src);
+    eval_input(false);
+}
+
+// The output of println is flushed at the end of every call.
+static void flush_output(void)
+{
+    pthread_mutex_lock(&output_lock);
+    out_flush();
+    pthread_mutex_unlock(&output_lock);
+}
+
+int lispy_eval_string(Lispy *L, const char *src)
+{
+    ENTER(L);
+    int status = catch_errors(eval_string, src);
+    flush_output();
+    LEAVE();
+    return status;
+}
+
+static void eval_file(const void *fd)
+{
+    open_input(&input, *(int *)fd);
+    eval_input(false);
+}
+
+int lispy_load_file(Lispy *L, const char *path)
+{
+    ENTER(L);
+    int status = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        snprintf(ctx->error, sizeof(ctx->error), "Cannot open %s: %s", path, strerror(errno));
+    else
+    {
+        status = catch_errors(eval_file, &fd);
+        close_input();
+        close(fd);
+    }
+    flush_output();
+    LEAVE();
+    return status;
+}
+
+const char *lispy_error(const Lispy *L)
+{
+    return L->main.error;
+}
+
+unsigned long long lispy_allocations(Lispy *L)
+{
+    pthread_mutex_lock(&L->heap_lock);
+    uint64_t n = L->nallocs_exited;
+    for (Context *c = L->contexts; c; c = c->next)
+        n += c->nallocs;
+    pthread_mutex_unlock(&L->heap_lock);
+    return n;
+}
+
+void lispy_free(Lispy *L)
+{
+    ENTER(L);
+    if (L->threads_started)
+        stop_threads();
+    for (int i = 0; i < L->ntasks; i++)
+        free(task_at(i)->error);
+    for (int i = 0; i < MAX_TASK_CHUNKS; i++)
+        free(L->task_chunks[i]);
+    for (int i = 0; i < L->nqueues; i++)
+    {
+        free(L->queues[i].buf);
+        pthread_mutex_destroy(&L->queues[i].lock);
+    }
+    free(L->queues);
+    free(L->workers);
+    free_context(&L->main);
+    profile_free(&L->profile_exited);
+    free(L->memory);
+    free(L->nursery);
+    free(L->cards);
+    free(L->card_starts);
+    free(L->symbols);
+    pthread_mutex_destroy(&L->symbols_lock);
+    pthread_mutex_destroy(&L->heap_lock);
+    pthread_cond_destroy(&L->heap_cond);
+    pthread_mutex_destroy(&L->pool_lock);
+    pthread_cond_destroy(&L->pool_cond);
+    free(L);
+    LEAVE();
+}
+
+#ifndef LISPY_LIBRARY
+
+//======================================================================
+// Image
+//======================================================================
+
+// An image is a snapshot of the heap after the startup files have been loaded. It is written right
+// after a collection, so it contains exactly the objects reachable from the symbol table, which
+// holds every global variable.
+//
+// Pointers are stored in a relocatable form: a heap pointer as its offset from the start of the heap
+// plus 16, one of the constants as 2, 4, 6 or 8, NULL as 0, and a fixnum as is. Primitives store the
+// offset of their C function from primitive_QUOTE, so an image can only be loaded by the binary
+// that wrote it; the header records a few values to check that.
+#define IMAGE_MAGIC "LISPYIMG"
+#define IMAGE_VERSION 10
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t object_size;
+    int64_t code_check;
+    int64_t global_version;
+    int64_t fold_version;
+    uint64_t heap_size;
+    uint64_t nsymbols;
+} ImageHeader;
+
+static __thread uint8_t *image_base;
+
+static Object *constant_table(int i)
+{
+    Object *constants[] = {NULL, Nil, True, Dot, Paren};
+    return constants[i];
+}
+
+static Object *encode_pointer(Object *obj)
+{
+    if (!obj || is_fixnum(obj))
+        return obj;
+    for (int i = 1; i <= 4; i++)
+        if (obj == constant_table(i))
+            return (Object *)(uintptr_t)(i * 2);
+    return (Object *)((uint8_t *)obj - image_base + 16);
+}
+
+static Object *decode_pointer(Object *obj)
+{
+    uintptr_t v = (uintptr_t)obj;
+    if (!obj || is_fixnum(obj))
+        return obj;
+    if (v < 16)
+        return constant_table(v / 2);
+    return (Object *)(image_base + v - 16);
+}
+
+static int64_t code_check(void)
+{
+    return (int64_t)((uintptr_t)primitive_EXIT - (uintptr_t)primitive_QUOTE);
+}
+
+static void write_all(int fd, void *buf, size_t len)
+{
+    for (uint8_t *p = buf; len;)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            error("Write error: %s", strerror(errno));
+        p += n;
+        len -= n;
+    }
+}
+
+// Writes the heap to the file. Local variables referring to objects must be dead at this point.
+static void dump_image(char *path)
+{
+    stop_the_world();
+    size_t size = lispy->mem_size;
+    while (size < lispy->mem_nused + lispy->nursery_nused)
+        size *= 2;
+    if (!collect(size))
+    {
+        resume_the_world();
+        error("Memory exhausted");
+    }
+
+    // Encode a copy of the heap; the objects' types and lengths stay intact, so it can be walked.
+    uint8_t *copy = malloc(lispy->mem_nused);
+    uint64_t *syms = malloc(sizeof(uint64_t) * (lispy->nsymbols + 1));
+    if (!copy || !syms)
+    {
+        free(copy);
+        free(syms);
+        resume_the_world();
+        error("Memory exhausted");
+    }
+    memcpy(copy, lispy->memory, lispy->mem_nused);
+    image_base = lispy->memory;
+    for (uint8_t *p = copy; p < copy + lispy->mem_nused; p += object_size((Object *)p))
+    {
+        Object *obj = (Object *)p;
+        if (obj->type == PRIMITIVE)
+            obj->fn = (Primitive *)((uintptr_t)obj->fn - (uintptr_t)primitive_QUOTE);
+        // Native code is not saved; it's compiled again once the code gets hot.
+        if (obj->type == CODE)
+        {
+            obj->ncalls = 0;
+            obj->native = NULL;
+        }
+        update_pointers(obj, encode_pointer);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < lispy->symbols_cap; i++)
+        if (lispy->symbols[i])
+            syms[n++] = (uint64_t)(uintptr_t)encode_pointer(lispy->symbols[i]);
+
+    ImageHeader h = {IMAGE_MAGIC, IMAGE_VERSION, sizeof(Object), code_check(), global_version, fold_version,
+                     lispy->mem_nused, n};
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        int e = errno;
+        free(copy);
+        free(syms);
+        resume_the_world();
+        error("Cannot open %s: %s", path, strerror(e));
+    }
+    // The world is resumed and the buffers are freed before a write error is passed on.
+    const char *err = NULL;
+    Handler eh;
+    if (CATCH(eh))
+    {
+        write_all(fd, &h, sizeof(h));
+        write_all(fd, copy, lispy->mem_nused);
+        write_all(fd, syms, sizeof(uint64_t) * n);
+        pop_handler(&eh);
+    }
+    else
+    {
+        pop_handler(&eh);
+        err = ctx->error;
+    }
+    close(fd);
+    free(copy);
+    free(syms);
+    resume_the_world();
+    if (err)
+    {
+        char msg[sizeof(ctx->error)];
+        snprintf(msg, sizeof(msg), "%s", err);
+        error("%s", msg);
+    }
+}
+
+// Replaces the heap and the symbol table with the contents of the image. The file is mapped and
+// relocated into the heap in a single pass.
+static void load_image(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        error("Cannot open %s: %s", path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(ImageHeader))
+        error("Invalid image: %s", path);
+    uint8_t *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        error("Cannot map %s: %s", path, strerror(errno));
+
+    ImageHeader *h = (ImageHeader *)m;
+    if (memcmp(h->magic, IMAGE_MAGIC, 8) != 0 || h->version != IMAGE_VERSION ||
+        h->object_size != sizeof(Object) || h->code_check != code_check() ||
+        st.st_size != (off_t)(sizeof(ImageHeader) + h->heap_size + sizeof(uint64_t) * h->nsymbols))
+        error("Image %s was not written by this binary", path);
+
+    // Make the heap large enough that loading leaves half of it free.
+    size_t size = lispy->mem_size;
+    while (size < h->heap_size * 2)
+        size *= 2;
+    uint32_t *starts;
+    uint8_t *cards = new_cards(size, &starts);
+    free(lispy->memory);
+    lispy->memory = malloc(size);
+    if (!lispy->memory || !cards)
+        error("Memory exhausted");
+    lispy->mem_size = size;
+    lispy->mem_nused = h->heap_size;
+    lispy->nursery_nused = 0;
+    ctx->alloc_ptr = ctx->alloc_end = NULL;
+    // The versions are shared by all interpreters, and must never go back.
+    if (global_version < h->global_version)
+        global_version = h->global_version;
+    if (fold_version < h->fold_version)
+        fold_version = h->fold_version;
+
+    memcpy(lispy->memory, m + sizeof(ImageHeader), h->heap_size);
+    image_base = lispy->memory;
+    for (uint8_t *p = lispy->memory; p < lispy->memory + lispy->mem_nused; p += object_size((Object *)p))
+    {
+        Object *obj = (Object *)p;
+        if (obj->type == PRIMITIVE)
+            obj->fn = (Primitive *)((uintptr_t)obj->fn + (uintptr_t)primitive_QUOTE);
+        update_pointers(obj, decode_pointer);
+    }
+    set_cards(cards, starts);
+
+    uint64_t *syms = (uint64_t *)(m + sizeof(ImageHeader) + h->heap_size);
+    memset(lispy->symbols, 0, sizeof(Object *) * lispy->symbols_cap);
+    lispy->nsymbols = 0;
+    for (size_t i = 0; i < h->nsymbols; i++)
+    {
+        Object *sym = decode_pointer((Object *)(uintptr_t)syms[i]);
+        size_t j = sym->hash & (lispy->symbols_cap - 1);
+        while (lispy->symbols[j])
+            j = (j + 1) & (lispy->symbols_cap - 1);
+        lispy->symbols[j] = sym;
+        if (++lispy->nsymbols * 4 > lispy->symbols_cap * 3)
+            grow_symbols();
+    }
+    munmap(m, st.st_size);
+}
+
+//======================================================================
+// Command line
+//======================================================================
+
+// Cleared by --no-echo
+static bool echo = true;
+
+// Set by --pipeline
+static bool pipelined;
+
+static void echo_input(const void *unused)
+{
+    eval_input(echo);
+}
+
+// The reader and the evaluator of --pipeline sleep only when the ring is full or empty. The side
+// that sleeps counts itself in nsleeping before it checks the ring again, and the other side checks
+// nsleeping after it has moved its count, so one of them sees the other and no wakeup is missed.
+// Waking up costs a switch of threads, so the sleeper is woken once a batch of forms or free
+// slots is ready, or when the reader may block on the input.
+#define PIPELINE_BATCH (PIPELINE_SIZE / 4)
+
+// Wakes the other side if it's sleeping.
+static void pipeline_wake(Pipeline *p)
+{
+    if (__atomic_load_n(&p->nsleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Sleeps until *count is no longer seen or the reader is done. Local variables holding objects must
+// be rooted.
+static void pipeline_wait(Pipeline *p, unsigned *count, unsigned seen)
+{
+    enter_safe_region();
+    pthread_mutex_lock(&p->lock);
+    __atomic_add_fetch(&p->nsleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(count, __ATOMIC_SEQ_CST) == seen && !__atomic_load_n(&p->done, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&p->cond, &p->lock);
+    __atomic_sub_fetch(&p->nsleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+    leave_safe_region();
+}
+
+// Whether the reader has no more buffered input to read the next form from, so that it may block.
+// The blanks are skipped on the way.
+static bool input_may_block(void)
+{
+    if (input.map)
+        return false;
+    while (input.p < input.end && (*input.p == ' ' || *input.p == '\n' || *input.p == '\r' || *input.p == '\t'))
+        input.p++;
+    return input.p == input.end || *input.p == ';';
+}
+
+static void pipeline_push(Pipeline *p, Object *expr)
+{
+    ROOT_FRAME;
+    ROOT(expr);
+    unsigned popped;
+    while (p->pushed - (popped = __atomic_load_n(&p->popped, __ATOMIC_SEQ_CST)) == PIPELINE_SIZE)
+        pipeline_wait(p, &p->popped, popped);
+    p->forms[p->pushed % PIPELINE_SIZE] = expr;
+    __atomic_store_n(&p->pushed, p->pushed + 1, __ATOMIC_SEQ_CST);
+    if (p->pushed - popped >= PIPELINE_BATCH || input_may_block())
+        pipeline_wake(p);
+}
+
+// Returns the next form, or NULL at the end of the input.
+static Object *pipeline_pop(Pipeline *p)
+{
+    for (;;)
+    {
+        bool done = __atomic_load_n(&p->done, __ATOMIC_SEQ_CST);
+        unsigned pushed = __atomic_load_n(&p->pushed, __ATOMIC_SEQ_CST);
+        if (p->popped != pushed)
+        {
+            Object **slot = &p->forms[p->popped % PIPELINE_SIZE];
+            Object *expr = *slot;
+            *slot = NULL;
+            __atomic_store_n(&p->popped, p->popped + 1, __ATOMIC_SEQ_CST);
+            if (pushed - p->popped <= PIPELINE_SIZE - PIPELINE_BATCH)
+                pipeline_wake(p);
+            return expr;
+        }
+        if (done)
+            return NULL;
+        pipeline_wait(p, &p->pushed, pushed);
+    }
+}
+
+// The argument is the thread's context, with the interpreter filled in. Reads the forms from the
+// file descriptor of the pipeline into the ring until the end of the input or an error.
+static void *reader_main(void *arg)
+{
+    ctx = arg;
+    lispy = ctx->lispy;
+    init_context(__builtin_frame_address(0));
+    Pipeline *p = lispy->pipeline;
+    Handler h;
+    if (CATCH(h))
+    {
+        open_input(&input, p->fd);
+        for (;;)
+        {
+            Object *expr = read_expr();
+            if (!expr)
+                break;
+            pipeline_push(p, expr);
+        }
+    }
+    else
+        p->error = strdup(ctx->error);
+    pop_handler(&h);
+    close_input();
+    __atomic_store_n(&p->done, true, __ATOMIC_SEQ_CST);
+    pipeline_wake(p);
+    unregister_thread();
+    free_context(ctx);
+    free(ctx);
+    return NULL;
+}
+
+// Evaluates the forms of the file descriptor like eval_input(), while a thread reads ahead. An
+// error in the input is raised once the forms before it have been evaluated.
+static void eval_pipelined(int fd)
+{
+    if (!lispy->threads_started)
+        start_threads();
+    Pipeline *p = calloc(1, sizeof(Pipeline));
+    Context *c = calloc(1, sizeof(Context));
+    if (!p || !c)
+        error("Memory exhausted");
+    p->fd = fd;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    c->lispy = lispy;
+    lispy->pipeline = p;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, c_stack_size);
+    if (pthread_create(&p->thread, &attr, reader_main, c) != 0)
+        error("Cannot create a thread");
+    pthread_attr_destroy(&attr);
+
+    Object *expr;
+    while ((expr = pipeline_pop(p)))
+        eval_form(expr, echo);
+
+    enter_safe_region();
+    pthread_join(p->thread, NULL);
+    leave_safe_region();
+    lispy->pipeline = NULL;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    char *err = p->error;
+    free(p);
+    if (err)
+    {
+        char msg[sizeof(ctx->error)];
+        snprintf(msg, sizeof(msg), "%s", err);
+        free(err);
+        error("%s", msg);
+    }
+}
+
+// Reads the forms from the file descriptor, evaluates them and prints the result of each unless
+// --no-echo is given. At a terminal, an error doesn't exit: it's reported, the rest of the line is dropped, and the REPL
+// goes on with the next line.
+static void load(int fd)
+{
+    if (fd == STDIN_FILENO)
+        stdin_forms = true;
+    if (pipelined && !isatty(fd))
+    {
+        eval_pipelined(fd);
+        return;
+    }
+    open_input(&input, fd);
+    if (!isatty(fd))
+        eval_input(echo);
+    else
+        while (catch_errors(echo_input, NULL) < 0)
+        {
+            flush_output();
+            fprintf(stderr, "%s\n", ctx->error);
+            input.p = input.end;
+        }
+    close_input();
+}
+
+static void load_file(char *path)
+{
+    if (strcmp(path, "-") == 0)
+    {
+        load(STDIN_FILENO);
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        error("Cannot open %s: %s", path, strerror(errno));
+    load(fd);
+    close(fd);
+}
+
+static void usage(void)
+{
+    error("Usage: lispy [--interp] [--no-jit] [--max-depth N] [--threads N] [--flush line|block] [--no-echo] [--pipeline] [--profile FILE] [--load-image FILE] [--dump-image FILE] [FILE ...]");
+}
+
+// Writes the tree in the folded format of flame graph tools: one line per stack, the names from
+// the outermost call inwards separated by semicolons, followed by the self time in nanoseconds.
+// The calls deeper than FOLDED_MAX_DEPTH are added up into one line per stack at that depth,
+// ending in "...". Otherwise a deep recursion would take space quadratic in its depth.
+#define FOLDED_MAX_DEPTH 256
+
+static void write_folded(FILE *fp, ProfTree *t, char **names)
+{
+    size_t lens[FOLDED_MAX_DEPTH + 1];
+    size_t cap = 4096;
+    char *path = malloc(cap), buf[32];
+    if (!path)
+        error("Memory exhausted");
+    int depth = 0;
+    uint64_t deep_ns = 0;
+    for (ProfNode *n = t->root.child; n;)
+    {
+        if (deep_ns && depth < FOLDED_MAX_DEPTH)
+        {
+            fprintf(fp, "%.*s;... %" PRIu64 "\n", (int)lens[FOLDED_MAX_DEPTH], path, deep_ns);
+            deep_ns = 0;
+        }
+        if (depth < FOLDED_MAX_DEPTH)
+        {
+            const char *name = profile_name(names, n->id, buf, sizeof(buf));
+            size_t len = lens[depth], namelen = strlen(name);
+            if (cap < len + namelen + 2)
+            {
+                cap = (len + namelen + 2) * 2;
+                path = realloc(path, cap);
+                if (!path)
+                    error("Memory exhausted");
+            }
+            if (depth)
+                path[len++] = ';';
+            memcpy(path + len, name, namelen);
+            len += namelen;
+            lens[depth + 1] = len;
+            if (n->self_ns)
+                fprintf(fp, "%.*s %" PRIu64 "\n", (int)len, path, n->self_ns);
+        }
+        else
+            deep_ns += n->self_ns;
+        if (n->child)
+        {
+            n = n->child;
+            depth++;
+            continue;
+        }
+        for (;;)
+        {
+            if (n->sibling)
+            {
+                n = n->sibling;
+                break;
+            }
+            n = n->parent;
+            depth--;
+            if (n == &t->root)
+            {
+                n = NULL;
+                break;
+            }
+        }
+    }
+    if (deep_ns)
+        fprintf(fp, "%.*s;... %" PRIu64 "\n", (int)lens[FOLDED_MAX_DEPTH], path, deep_ns);
+    free(path);
+}
+
+// The file that --profile writes the folded stacks to
+static char *profile_path;
+
+// Writes the profile at exit: the summary to the standard error, and the folded stacks of all
+// threads to profile_path.
+static void write_profile(void)
+{
+    if (ctx == &lispy->main)
+    {
+        profile_unwind(0);
+        if (lispy->threads_started)
+            stop_threads();
+    }
+    pthread_mutex_lock(&output_lock);
+    out_flush();
+    pthread_mutex_unlock(&output_lock);
+    print_stats(stderr);
+    FILE *fp = fopen(profile_path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", profile_path, strerror(errno));
+        return;
+    }
+    char **names = profile_names();
+    write_folded(fp, &ctx->profile, names);
+    write_folded(fp, &lispy->profile_exited, names);
+    free(names);
+    fclose(fp);
+}
+
+// Usage: lispy [options] [FILE ...]
+//
+// Evaluates the files in order, or the standard input if no file is given. "-" stands for the
+// standard input. With --dump-image, the state after evaluating the files is written to an image
+// instead of reading the standard input; --load-image starts from such an image instead of from
+// the built-in primitives. --profile records the calls and allocations; they are summarized at exit
+// and by (stats). --no-echo doesn't print the values of the top-level forms. --pipeline reads the
+// forms of a file in a thread of their own, ahead of their evaluation. --no-jit keeps hot functions
+// in bytecode instead of compiling them to native code.
+int main(int argc, char **argv)
+{
+    char *dump = NULL;
+    char *image = NULL;
+    int flush = -1;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        if (strcmp(argv[i], "--interp") == 0)
+            interpret = true;
+        else if (strcmp(argv[i], "--no-jit") == 0)
+            jit_enabled = false;
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+        {
+            max_depth = atoi(argv[++i]);
+            if (max_depth <= 0)
+                error("Invalid maximum depth: %s", argv[i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            nworkers = atoi(argv[++i]);
+            if (nworkers <= 0)
+                error("Invalid number of threads: %s", argv[i]);
+        }
+        else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "line") == 0)
+                flush = 1;
+            else if (strcmp(argv[i], "block") == 0)
+                flush = 0;
+            else
+                usage();
+        }
+        else if (strcmp(argv[i], "--no-echo") == 0)
+            echo = false;
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            pipelined = true;
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profiling = true;
+            profile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc)
+            dump = argv[++i];
+        else if (strcmp(argv[i], "--load-image") == 0 && i + 1 < argc)
+            image = argv[++i];
+        else
+            usage();
+    }
+
+    output.line = flush < 0 ? isatty(STDOUT_FILENO) : flush;
+
+    // The main thread uses the interpreter directly, so errors exit as usual.
+    Lispy *L = lispy_new(NULL);
+    if (!L)
+        error("Memory exhausted");
+    lispy = L;
+    ctx = &L->main;
+    set_c_stack_base(__builtin_frame_address(0));
+    if (profiling)
+        atexit(write_profile);
+    if (image)
+        load_image(image);
+
+    if (i == argc && !dump)
+        load(STDIN_FILENO);
+    for (; i < argc; i++)
+        load_file(argv[i]);
+    if (dump)
+        dump_image(dump);
+    out_flush();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,44 @@
+// The embedding API of lispy. Build lispy.c with -DLISPY_LIBRARY to leave out main().
+//
+// Each interpreter has a heap, a symbol table and a thread pool of its own, so different threads
+// can use different interpreters at the same time. One interpreter must not be used by two threads
+// at once.
+#ifndef LISPY_H
+#define LISPY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Lispy Lispy;
+
+// Creates an interpreter. If tmpl is NULL, the interpreter starts with the built-in primitives
+// only; otherwise it starts as a copy of the global state of tmpl, which is much cheaper than
+// evaluating the same definitions again. Any number of threads may copy the same template at the
+// same time, as long as nobody evaluates anything in it. A template can't be copied once it has
+// spawned a task. Returns NULL if the interpreter can't be created.
+Lispy *lispy_new(const Lispy *tmpl);
+
+// Evaluates the forms in the NUL-terminated string in order. Returns 0 on success. On an error,
+// evaluation stops and -1 is returned; the definitions made before the error stay in effect, and
+// lispy_error() returns the error message.
+int lispy_eval_string(Lispy *L, const char *src);
+
+// Like lispy_eval_string(), but reads the forms from the file.
+int lispy_load_file(Lispy *L, const char *path);
+
+// Returns the message of the last error of lispy_eval_string() or lispy_load_file().
+const char *lispy_error(const Lispy *L);
+
+// Returns the number of objects the interpreter has allocated so far. The count is exact once the
+// interpreter's tasks have finished.
+unsigned long long lispy_allocations(Lispy *L);
+
+// Waits for the interpreter's threads to finish their tasks and frees the interpreter.
+void lispy_free(Lispy *L);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
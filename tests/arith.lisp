@@ -0,0 +1,25 @@
+; / rounds the quotient toward negative infinity and mod gives the remainder with the sign of the
+; divisor, so that (+ (* (/ a b) b) (mod a b)) is a, for fixnums and bignums alike.
+(define qr (lambda (a b) (list (/ a b) (mod a b) (= (+ (* (/ a b) b) (mod a b)) a))))
+(qr 7 2)
+(qr -7 2)
+(qr 7 -2)
+(qr -7 -2)
+(qr 6 -3)
+(qr -1 5)
+(qr 0 -5)
+(qr -9223372036854775807 2)
+(qr (- -9223372036854775807 1) -1)
+(define big 1000000000000000000000000000007)
+(qr big 10)
+(qr (- 0 big) 10)
+(qr big -10)
+(qr (- 0 big) -10)
+(qr (- 0 big) (* big big))
+(qr (* big big) (- 0 big))
+(qr (+ (* big big) 1) (- 0 big))
+(qr -9223372036854775809 4611686018427387904)
+(/ -100 3 2)
+(/ 100 -3 -2)
+; Folded when the lambda is resolved
+((lambda () (list (/ -7 2) (mod -7 2) (/ (- 0 big) 10))))
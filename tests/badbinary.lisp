@@ -0,0 +1,16 @@
+; read-binary rejects damaged data without trusting the lengths it claims, integers that aren't
+; in their canonical form, and symbol names that the reader doesn't read.
+(define h (lambda (c) c))
+(read-binary)
+(read-binary)
+(try (read-binary) h)
+(try (read-binary) h)
+(try (read-binary) h)
+(try (read-binary) h)
+(read-binary)
+(try (read-binary) h)
+(try (read-binary) h)
+(try (read-binary) h)
+(read-binary)
+(try (read-binary) h)
+(try (read-binary) h)
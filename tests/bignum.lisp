@@ -0,0 +1,25 @@
+; Integers that leave the fixnum range become bignums, and come back when they fit again.
+(define h (lambda (c) c))
+(define f (lambda (n) (if (= n 0) 1 (* n (f (- n 1))))))
+(+ 4611686018427387903 1)
+(- -4611686018427387904 1)
+(- (+ 4611686018427387903 1) 1)
+(+ 9223372036854775807 1)
+(- -9223372036854775808 1)
+(- -9223372036854775808)
+(* 4294967296 4294967296)
+(* -4294967296 4294967296)
+(f 30)
+(f 100)
+(/ (f 100) (f 98))
+(mod (f 100) 1000007)
+(- (f 25) (f 25))
+(* (f 30) 0)
+(= (f 40) (* (f 20) (/ (f 40) (f 20))))
+(list (< (f 30) (f 31)) (> (- 0 (f 30)) 5) (<= (f 20) (f 20)) (>= 1 (f 20)))
+123456789012345678901234567890
+-123456789012345678901234567890
+-9223372036854775808
+(try (/ (f 30) 0) h)
+(try (mod (f 30) 0) h)
+(try (vector-ref #(1 2) (f 30)) h)
@@ -0,0 +1,15 @@
+; Writes the objects that binary.lisp reads back.
+(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (list n acc)))))
+(define deep (lambda (n acc) (if (= n 0) acc (deep (- n 1) (list acc)))))
+(write-binary ())
+(write-binary t)
+(write-binary (list -64 175 -65 176 0 -1))
+(write-binary (list 4611686018427387903 -4611686018427387904 4611686018427387904))
+(write-binary -123456789012345678901234567890)
+(write-binary "a \"quoted\"\nstring")
+(write-binary "")
+(write-binary (list 'sym 'other 'sym (list 'sym)))
+(write-binary (vector 1 "two" 'three (vector) #i(4 5)))
+(write-binary #i(9223372036854775807 -9223372036854775808 0))
+(write-binary (build 1000 ()))
+(write-binary (deep 1000 'bottom))
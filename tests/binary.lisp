@@ -0,0 +1,15 @@
+; Reads back the objects written by binary.in.lisp.
+(define h (lambda (c) c))
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(read-binary)
+(try (read-binary) h)
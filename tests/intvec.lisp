@@ -0,0 +1,37 @@
+; Integer vectors hold int64_t elements. An element-wise result that doesn't fit raises an error
+; instead of wrapping around; sums and dot products that overflow are computed with bignums.
+(define h (lambda (c) c))
+(define min64 (- -9223372036854775807 1))
+(define a #i(1 2 3 4 5 6 7 8 9))
+(define b (make-int-vector 9 10))
+a
+(vec+ a b)
+(vec-sum a)
+(vec-dot a b)
+(vec-min #i(5 -3 9 2 7 -8 4))
+(vec-max #i(5 -3 9 2 7 -8 4))
+(vec= a #i(1 0 3 0 5 0 7 0 9))
+(vec< a #i(5 5 5 5 5 5 5 5 5))
+(vec>= a #i(5 5 5 5 5 5 5 5 5))
+(int-vector 1 2 (+ 1 2))
+#i()
+(vec-sum #i(9223372036854775807 1 -1))
+(try (vec-sum #i(9223372036854775807 1)) h)
+(try (vec-sum (int-vector min64 -1)) h)
+(try (vec+ #i(9223372036854775807 0 0 0 0 0 0 0 0) #i(1 0 0 0 0 0 0 0 0)) h)
+(try (vec+ (int-vector 0 0 0 0 0 0 0 0 min64) #i(0 0 0 0 0 0 0 0 -1)) h)
+(vec-dot #i(3000000000 1 1 1) #i(3000000000 1 1 1))
+(try (vec-dot #i(4000000000 1 1 1) #i(4000000000 1 1 1)) h)
+(try (vec-dot (int-vector min64) #i(-1)) h)
+(vec-min (int-vector 5 -3 9 min64 7))
+(vec-max #i(5 -3 9223372036854775807 2 7))
+(vector-set! b 0 4611686018427387904)
+(vector-set! b 1 min64)
+b
+(vector-ref b 0)
+(try (vector-set! b 2 9223372036854775808) h)
+(try (vector-set! b 2 'x) h)
+(try (vec+ a #i(1)) h)
+(try (vec-min #i()) h)
+; A literal element that doesn't fit in an int64_t is a reader error, which ends the file.
+#i(1 9223372036854775808)
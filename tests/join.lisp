@@ -0,0 +1,22 @@
+; spawn runs a call on the thread pool, and join waits for it and returns its value.
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(join (spawn fib 20))
+(join (spawn + 1 2 3))
+((lambda (a b) (+ (join a) (join b))) (spawn fib 15) (spawn fib 16))
+; Tasks that spawn and join tasks themselves
+(define pfib (lambda (n) (if (< n 12) (fib n) ((lambda (t) (+ (pfib (- n 2)) (join t))) (spawn pfib (- n 1))))))
+(pfib 20)
+; The results are shared with the thread that joins.
+(define mk (lambda (n) (if (= n 0) () (list n (mk (- n 1))))))
+((lambda (x y z) (list (join x) (join y) (join z))) (spawn mk 3) (spawn mk 4) (spawn mk 5))
+; A task can be joined once. A stale handle, or a second join, raises an error instead of returning
+; the result of another task.
+(define failed (lambda (c) 'failed))
+((lambda (t1) (list (join t1) ((lambda (t2) (list (try (join t1) failed) (join t2) (try (join t2) failed))) (spawn fib 10)))) (spawn fib 20))
+(try (join 12345) failed)
+(try (join -1) failed)
+(try (join 'x) failed)
+(try (join (spawn (lambda () (nope)))) (lambda (c) (list 'caught c)))
+; Three threads join the same task, and exactly one of them gets its value.
+(define claimer (lambda (t) (lambda () (try (if (= (join t) 17711) 1 0) (lambda (c) 0)))))
+((lambda (claim) ((lambda (a b) (+ (claim) (join a) (join b))) (spawn claim) (spawn claim))) (claimer (spawn fib 22)))
@@ -0,0 +1,8 @@
+; pmap, preduce and pfor-each split the list into chunks that run as tasks.
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(pmap fib (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20))
+(pmap fib ())
+(pmap fib (list 20))
+(preduce + 0 (list 1 2 3 4 5 6 7 8 9 10))
+(preduce + 0 ())
+(pmap (lambda (x) (* x x)) (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25))
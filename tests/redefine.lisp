@@ -0,0 +1,24 @@
+; Calls of the arithmetic primitives are compiled to intrinsics, and folded when their arguments
+; are constant. Both have to follow a redefinition of the primitive.
+(define add (lambda (a b) (+ a b)))
+(define less (lambda (a b) (< a b)))
+(define three (lambda () (+ 1 2)))
+(define nested (lambda () (* (+ 1 2) (- 10 4))))
+(define pick (lambda () (if (< 1 2) 'yes 'no)))
+(define truth (lambda () (if t 'yes 'no)))
+(define sum (lambda (i n acc) (if (= i n) acc (sum (+ i 1) n (+ acc (add i (three)))))))
+(list (add 1 2) (less 1 2) (three) (nested) (pick) (truth))
+; Run often enough to be compiled to native code
+(sum 0 5000 0)
+(define plus +)
+(define + -)
+(list (add 1 2) (three) (nested))
+(setvalue + plus)
+(list (add 1 2) (three) (nested))
+(sum 0 5000 0)
+(define < >)
+(list (less 1 2) (pick))
+(define < (lambda (a b) 'never))
+(list (less 1 2) (pick))
+(setvalue t ())
+(truth)
@@ -0,0 +1,22 @@
+; Vectors and strings store their elements contiguously, and check their indexes.
+(define h (lambda (c) c))
+(define v (make-vector 3 0))
+(vector-set! v 0 'a)
+(vector-set! v 2 (list 1 2))
+v
+(vector-length v)
+(vector-ref v 2)
+(vector 1 "two" 'three (vector))
+#(1 #(2 3) ())
+(vector)
+(try (vector-ref v 3) h)
+(try (vector-ref v -1) h)
+(try (vector-set! v 3 0) h)
+(try (make-vector -1 0) h)
+"a \"quoted\"\nstring\\"
+(string-length "hello")
+(string-length "")
+(string-length "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghij")
+(string-ref "hello" 1)
+(try (string-ref "hello" 5) h)
+(try (string-length 'x) h)